@@ -0,0 +1,396 @@
+#include "Bin.hpp"
+#include "gui.hpp"
+#include "HardwareLimits.hpp"
+#include "Compensation.hpp"
+#include "Sound.h"
+#include "log.h"
+#include "cast.hpp"
+#include <math.h>
+#include <stdio.h>
+
+#define Log_Bin (LevelDebug|LevelInfo|LevelWarn|LevelError|LevelCrit)
+
+constexpr Bin::Config Bin::defaultConfig;
+static constexpr char *parameterNames[] = { "Capacitance", "Inductance", "Resistance", "|Z|", nullptr };
+static constexpr char *secondaryNames[] = { "None", "Q min.", "D max.", "ESR max.", nullptr };
+
+/*
+ * Handler interface on the AD5941 GPIOs: bin number in binary (0 for any reject) and end of
+ * measurement (high while a verdict is valid). GPIO0 is left free, it is the interrupt output if
+ * that is wired to the MCU
+ */
+static constexpr uint8_t OutputBin0 = AD5940_GPIO1;
+static constexpr uint8_t OutputBin1 = AD5940_GPIO2;
+static constexpr uint8_t OutputEOM = AD5940_GPIO3;
+// A bin is unambiguous if the measurement uncertainty of this many standard errors does not change it
+static constexpr float DecisionSigma = 3.0f;
+/*
+ * Parts within this fraction of the tightest tolerance around the nominal value are decided after the
+ * first partial measurement, parts closer to a bin edge need further ones
+ */
+static constexpr float FirstDecision = 0.5f;
+// Consecutive out of range measurements required to reject a part (contacts might still be settling)
+static constexpr uint8_t OutOfRangeReject = 2;
+
+Bin::Bin(coords_t size, Menu &menu, Config c) {
+	this->size = size;
+	config = c;
+	generation = 1;
+	verdict = Verdict::NoPart;
+	samples = 0;
+	outOfRange = 0;
+	value = secondaryValue = NAN;
+	chunkStart = partStart = 0;
+	ResetStatistics(nullptr);
+	Frontend::PreparePlanEntry(config.frequency, plan);
+
+	mConfig = new Menu("Bin", menu.getSize());
+	// limits menu
+	auto mLimits = new Menu("Limits", menu.getSize());
+	mLimits->AddEntry(new MenuChooser("Parameter", parameterNames, (uint8_t*) &config.parameter,
+			pmf_cast<void (*)(void*, Widget *w), Bin, &Bin::SettingChanged>::cfn, this));
+	mLimits->AddEntry(new MenuValue<float>("Nominal", &config.nominal, Unit::None,
+			pmf_cast<void (*)(void*, Widget *w), Bin, &Bin::SettingChanged>::cfn, this));
+	constexpr char *BinNames[MaxBins] = { "Bin 1", "Bin 2", "Bin 3" };
+	for (uint8_t i = 0; i < MaxBins; i++) {
+		mLimits->AddEntry(new MenuValue<int32_t>(BinNames[i], &config.tolerance[i], Unit::Percent,
+				pmf_cast<void (*)(void*, Widget *w), Bin, &Bin::SettingChanged>::cfn, this, 0,
+				Unit::maxPercent));
+	}
+	mLimits->AddEntry(new MenuChooser("Secondary", secondaryNames, (uint8_t*) &config.secondary,
+			pmf_cast<void (*)(void*, Widget *w), Bin, &Bin::SettingChanged>::cfn, this));
+	mLimits->AddEntry(new MenuValue<float>("Sec. limit", &config.secondaryLimit, Unit::None,
+			pmf_cast<void (*)(void*, Widget *w), Bin, &Bin::SettingChanged>::cfn, this));
+	mLimits->AddEntry(new MenuBack());
+	// acquisition menu
+	auto mAcq = new Menu("Acquisition\nSettings", menu.getSize());
+	mAcq->AddEntry(new MenuValue<uint32_t>("Frequency", &config.frequency, Unit::Frequency,
+			pmf_cast<void (*)(void*, Widget *w), Bin, &Bin::SettingChanged>::cfn, this,
+			HardwareLimits::MinFrequency, HardwareLimits::MaxFrequency));
+	mAcq->AddEntry(new MenuValue<uint16_t>("Max. avg.", &config.averages, Unit::None,
+			pmf_cast<void (*)(void*, Widget *w), Bin, &Bin::SettingChanged>::cfn, this, 1, 1000));
+	mAcq->AddEntry(new MenuValue<uint32_t>("Excitation", &config.excitationVoltage, Unit::Voltage,
+			pmf_cast<void (*)(void*, Widget *w), Bin, &Bin::SettingChanged>::cfn, this,
+			HardwareLimits::MinExcitationVoltage, HardwareLimits::MaxExcitationVoltage));
+	mAcq->AddEntry(new MenuValue<uint32_t>("Bias", &config.biasVoltage, Unit::Voltage,
+			pmf_cast<void (*)(void*, Widget *w), Bin, &Bin::SettingChanged>::cfn, this,
+			HardwareLimits::MinBiasVoltage, HardwareLimits::MaxBiasVoltage));
+	mAcq->AddEntry(new MenuBack());
+
+	mConfig->AddEntry(mLimits);
+	mConfig->AddEntry(mAcq);
+	mConfig->AddEntry(new MenuAction("Reset\nstatistics",
+			pmf_cast<void (*)(void*, Widget *w), Bin, &Bin::ResetStatistics>::cfn, this));
+	mConfig->AddEntry(new MenuBack());
+
+	menu.AddEntry(mConfig);
+}
+
+Bin::~Bin() {
+	if (mConfig) {
+		delete mConfig;
+	}
+}
+
+Frontend::Settings Bin::GetAcquisitionSettings() {
+	Frontend::Settings s;
+	s.biasVoltage = config.biasVoltage;
+	s.excitationVoltage = config.excitationVoltage;
+	s.frequency = config.frequency;
+	s.plan = &plan;
+	s.range = Frontend::Range::AUTO;
+	// keep the gain of the previous part, parts of the same value do not need to range again
+	s.rangeHint = AD5940_HSRTIA_OPEN;
+	/*
+	 * A partial measurement ends as soon as it is precise enough for the bin limits. Open leads are
+	 * aborted after one or two DFTs, the removal of a decided part is detected just as fast
+	 */
+	s.averages = config.averages;
+	s.targetError = TargetError();
+	s.abortInvalid = true;
+	s.id = Id();
+	chunkStart = xTaskGetTickCount() * portTICK_PERIOD_MS;
+	return s;
+}
+
+float Bin::TargetError() {
+	int32_t tightest = 0;
+	for (uint8_t i = 0; i < MaxBins; i++) {
+		if (config.tolerance[i] > 0 && (!tightest || config.tolerance[i] < tightest)) {
+			tightest = config.tolerance[i];
+		}
+	}
+	// without any bin every part is rejected, use all averages
+	return tightest / 100000000.0f * FirstDecision / DecisionSigma;
+}
+
+bool Bin::AddResult(const Frontend::Result &r) {
+	if (r.id != Id()) {
+		// measurement was started before the bin setup changed
+		return false;
+	}
+	uint32_t resultStart = chunkStart;
+	chunkStart = xTaskGetTickCount() * portTICK_PERIOD_MS;
+	if (r.type == Frontend::ResultType::OpenLeads) {
+		if (verdict == Verdict::NoPart) {
+			return false;
+		}
+		// part has been removed, ready for the next one
+		samples = 0;
+		outOfRange = 0;
+		SetVerdict(Verdict::NoPart);
+		return true;
+	}
+	if (verdict != Verdict::NoPart && verdict != Verdict::Measuring) {
+		// already decided, waiting for the part to be removed
+		return false;
+	}
+	if (verdict == Verdict::NoPart) {
+		// new part inserted, its measurement started with this result
+		partStart = resultStart;
+		samples = 0;
+		outOfRange = 0;
+		sumZ = 0.0f;
+		varMag = varPhase = 0.0f;
+		SetVerdict(Verdict::Measuring);
+	}
+	Verdict v;
+	if (r.type != Frontend::ResultType::Valid) {
+		// out of range or clipped, no bin possible
+		if (++outOfRange < OutOfRangeReject) {
+			return false;
+		}
+		value = secondaryValue = NAN;
+		v = Verdict::Reject;
+	} else {
+		outOfRange = 0;
+		// combine the partial measurements, weighted by their number of averages
+		float n = r.averages;
+		sumZ += r.Z * n;
+		varMag += n * n * r.errorMag * r.errorMag;
+		varPhase += n * n * r.errorPhase * r.errorPhase;
+		samples += r.averages;
+		auto Z = Compensation::Apply(sumZ / (float) samples, config.frequency);
+		float sigmaMag = sqrtf(varMag) / samples * DecisionSigma;
+		float sigmaPhase = sqrtf(varPhase) / samples * DecisionSigma;
+		v = Evaluate(Z);
+		bool decided = samples >= config.averages;
+		if (!decided && isfinite(sigmaMag) && isfinite(sigmaPhase)) {
+			/*
+			 * The bin is unambiguous if all corners of the uncertainty region of the impedance result
+			 * in the same verdict
+			 */
+			decided = true;
+			for (uint8_t i = 0; i < 4 && decided; i++) {
+				float mag = i & 0x01 ? 1.0f + sigmaMag : 1.0f - sigmaMag;
+				float phase = i & 0x02 ? sigmaPhase : -sigmaPhase;
+				if (Evaluate(Z * std::polar(mag, phase)) != v) {
+					decided = false;
+				}
+			}
+		}
+		if (!decided) {
+			return false;
+		}
+		Values(Z, value, secondaryValue);
+	}
+	// update statistics
+	uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+	lastLatency = now - partStart;
+	latencySum += lastLatency;
+	if (lastLatency > latencyMax) {
+		latencyMax = lastLatency;
+	}
+	if (!parts) {
+		firstDecision = now;
+	}
+	lastDecision = now;
+	parts++;
+	totalSamples += samples;
+	LOG(Log_Bin, LevelInfo, "Verdict %u after %lu samples, %lums", (uint8_t) v, samples, lastLatency);
+	SetVerdict(v);
+	return true;
+}
+
+void Bin::Values(std::complex<float> Z, float &primary, float &secondary) {
+	Frontend::Result f;
+	f.Z = Z;
+	f.frequency = config.frequency;
+	auto r = LCR::ComponentValues(f);
+	switch (config.parameter) {
+	case Parameter::Capacitance:
+		primary = r.type == LCR::ImpedanceType::CAPACITANCE ? r.C.capacitance : NAN;
+		break;
+	case Parameter::Inductance:
+		primary = r.type == LCR::ImpedanceType::INDUCTANCE ? r.L.inductance : NAN;
+		break;
+	case Parameter::Resistance:
+		primary = real(r.Z);
+		break;
+	case Parameter::Magnitude:
+	default:
+		primary = abs(Z);
+		break;
+	}
+	switch (config.secondary) {
+	case Secondary::QMin:
+		secondary = r.qualityFactor;
+		break;
+	case Secondary::DMax:
+		secondary = 1.0f / r.qualityFactor;
+		break;
+	case Secondary::ESRMax:
+		secondary = real(Z);
+		break;
+	case Secondary::None:
+	default:
+		secondary = NAN;
+		break;
+	}
+}
+
+Bin::Verdict Bin::Evaluate(std::complex<float> Z) {
+	float primary, secondary;
+	Values(Z, primary, secondary);
+	if (!isfinite(primary)) {
+		return Verdict::Reject;
+	}
+	float deviation = fabsf(primary / config.nominal - 1.0f);
+	Verdict v = Verdict::Reject;
+	for (uint8_t i = 0; i < MaxBins; i++) {
+		if (config.tolerance[i] > 0 && deviation <= config.tolerance[i] / 100000000.0f) {
+			v = (Verdict) ((uint8_t) Verdict::Bin1 + i);
+			break;
+		}
+	}
+	if (v == Verdict::Reject) {
+		return v;
+	}
+	switch (config.secondary) {
+	case Secondary::QMin:
+		if (!(secondary >= config.secondaryLimit)) {
+			v = Verdict::SecondaryReject;
+		}
+		break;
+	case Secondary::DMax:
+	case Secondary::ESRMax:
+		if (!(secondary <= config.secondaryLimit)) {
+			v = Verdict::SecondaryReject;
+		}
+		break;
+	case Secondary::None:
+	default:
+		break;
+	}
+	return v;
+}
+
+void Bin::SetVerdict(Verdict v) {
+	uint8_t code = 0;
+	if (v >= Verdict::Bin1 && v <= Verdict::Bin3) {
+		code = (uint8_t) v - (uint8_t) Verdict::Bin1 + 1;
+	}
+	uint8_t outputs = 0;
+	if (code & 0x01) {
+		outputs |= OutputBin0;
+	}
+	if (code & 0x02) {
+		outputs |= OutputBin1;
+	}
+	if (v != Verdict::NoPart && v != Verdict::Measuring) {
+		outputs |= OutputEOM;
+		if (code) {
+			Sound::Beep(2000, 50);
+		} else {
+			Sound::Beep(500, 200);
+		}
+	}
+	Frontend::SetOutputs(OutputBin0 | OutputBin1 | OutputEOM, outputs);
+	verdict = v;
+	requestRedraw();
+}
+
+void Bin::SettingChanged(Widget *w) {
+	Frontend::PreparePlanEntry(config.frequency, plan);
+	// results of the previous settings are ignored, the frontend has to be restarted (see Id())
+	if (++generation >= 0x80) {
+		generation = 1;
+	}
+	// decide the current part again with the new settings
+	samples = 0;
+	outOfRange = 0;
+	SetVerdict(Verdict::NoPart);
+}
+
+void Bin::ResetStatistics(Widget *w) {
+	parts = 0;
+	totalSamples = 0;
+	latencySum = latencyMax = lastLatency = 0;
+	firstDecision = lastDecision = 0;
+	requestRedraw();
+}
+
+void Bin::draw(coords_t offset) {
+	size = getSize();
+	auto pos = offset;
+	display_SetForeground(ColorBackground);
+	display_RectangleFull(pos.x, pos.y, pos.x + size.x - 1, pos.y + size.y - 1);
+	display_SetBackground(ColorBackground);
+
+	// verdict
+	constexpr char *verdictNames[] = { "NO PART", "MEASURING", "BIN 1", "BIN 2", "BIN 3", "REJECT",
+			"REJECT SEC." };
+	display_SetFont(Font_Big);
+	if (verdict >= Verdict::Bin1 && verdict <= Verdict::Bin3) {
+		display_SetForeground(ColorPass);
+	} else if (verdict == Verdict::Reject || verdict == Verdict::SecondaryReject) {
+		display_SetForeground(ColorFail);
+	} else {
+		display_SetForeground(ColorForeground);
+	}
+	display_AutoCenterString(verdictNames[(uint8_t) verdict], pos + COORDS(0, 10),
+			pos + COORDS(size.x, 10 + Font_Big.height));
+
+	// measured values of the last decision
+	display_SetFont(Font_Medium);
+	display_SetForeground(ColorForeground);
+	char line[40];
+	int16_t y = pos.y + 50;
+	if (isfinite(value)) {
+		constexpr char *units[] = { "F", "H", "Ohm", "Ohm" };
+		Unit::SIStringFromFloat(line, 7, value);
+		strcat(line, units[(uint8_t) config.parameter]);
+		// deviation from nominal value in 0.01%
+		int32_t deviation = lroundf((value / config.nominal - 1.0f) * 10000);
+		uint32_t absDeviation = abs(deviation);
+		snprintf(&line[strlen(line)], sizeof(line) - strlen(line), " (%c%lu.%02lu%%)",
+				deviation < 0 ? '-' : '+', absDeviation / 100, absDeviation % 100);
+		display_String(pos.x + 5, y, line);
+		y += Font_Medium.height + 2;
+		if (isfinite(secondaryValue)) {
+			constexpr char *names[] = { "", "Q: ", "D: ", "ESR: " };
+			strcpy(line, names[(uint8_t) config.secondary]);
+			Unit::SIStringFromFloat(&line[strlen(line)], 7, secondaryValue);
+			if (config.secondary == Secondary::ESRMax) {
+				strcat(line, "Ohm");
+			}
+			display_String(pos.x + 5, y, line);
+		}
+	}
+
+	// statistics
+	y = pos.y + size.y - 3 * (Font_Medium.height + 2);
+	uint32_t perMinute = 0;
+	if (parts > 1 && lastDecision > firstDecision) {
+		perMinute = (parts - 1) * 60000UL / (lastDecision - firstDecision);
+	}
+	snprintf(line, sizeof(line), "Parts: %lu, %lu/min", parts, perMinute);
+	display_String(pos.x + 5, y, line);
+	y += Font_Medium.height + 2;
+	snprintf(line, sizeof(line), "Time: %lums, avg. %lu, max. %lu", lastLatency,
+			parts ? latencySum / parts : 0, latencyMax);
+	display_String(pos.x + 5, y, line);
+	y += Font_Medium.height + 2;
+	snprintf(line, sizeof(line), "Avg. samples: %lu", parts ? totalSamples / parts : 0);
+	display_String(pos.x + 5, y, line);
+}
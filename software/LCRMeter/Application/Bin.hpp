@@ -0,0 +1,115 @@
+#pragma once
+
+#include <stdint.h>
+#include "Frontend.hpp"
+#include "LCR.hpp"
+#include "widget.hpp"
+#include "menu.hpp"
+
+/*
+ * Sorts components into tolerance bins around a nominal value. Averaging stops as soon as the bin
+ * is unambiguous, the verdict is output on the AD5941 GPIOs for a component handler.
+ *
+ * The frontend measures continuously with the settings of GetAcquisitionSettings(), they only have to be
+ * applied again if the result id differs from Id(). Every result is a partial measurement that stops
+ * once it reaches the standard error derived from the bin limits (TargetError()).
+ */
+class Bin : public Widget {
+public:
+	enum class Parameter : uint8_t {
+		Capacitance = 0x00,
+		Inductance = 0x01,
+		Resistance = 0x02,
+		Magnitude = 0x03,
+	};
+	enum class Secondary : uint8_t {
+		None = 0x00,
+		QMin = 0x01,
+		DMax = 0x02,
+		ESRMax = 0x03,
+	};
+	enum class Verdict : uint8_t {
+		NoPart,
+		Measuring,
+		Bin1,
+		Bin2,
+		Bin3,
+		Reject,
+		SecondaryReject,
+	};
+	static constexpr uint8_t MaxBins = 3;
+	using Config = struct _config {
+		Parameter parameter;
+		float nominal;
+		// tolerance of every bin (1% = 1000000), 0 disables the bin. The first matching bin is selected
+		int32_t tolerance[MaxBins];
+		Secondary secondary;
+		float secondaryLimit;
+		uint32_t frequency;
+		uint32_t biasVoltage;
+		uint32_t excitationVoltage;
+		// maximum number of averages for a decision
+		uint16_t averages;
+	};
+	static constexpr Config defaultConfig = {
+			.parameter = Parameter::Capacitance,
+			.nominal = 100e-9f,
+			.tolerance = {1000000, 5000000, 10000000},
+			.secondary = Secondary::None,
+			.secondaryLimit = 0.1f,
+			.frequency = 1000,
+			.biasVoltage = 0,
+			.excitationVoltage = 300000,
+			.averages = 100,
+	};
+
+	Bin(coords_t size, Menu &menu, Config c = defaultConfig);
+	~Bin();
+	Frontend::Settings GetAcquisitionSettings();
+	// Identifier of the current acquisition settings
+	uint16_t Id() { return (uint16_t) generation << 8; };
+	// Processes a (not compensated) measurement result, returns true if the verdict has changed
+	bool AddResult(const Frontend::Result &r);
+private:
+	static constexpr color_t ColorBackground = COLOR_BG_DEFAULT;
+	static constexpr color_t ColorForeground = COLOR_BLACK;
+	static constexpr color_t ColorPass = COLOR_DARKGREEN;
+	static constexpr color_t ColorFail = COLOR_RED;
+
+	Widget::Type getType() override { return Widget::Type::Custom; };
+
+	void SettingChanged(Widget *w);
+	void ResetStatistics(Widget *w);
+	// Standard error of a partial measurement, derived from the tightest enabled bin
+	float TargetError();
+	// Primary and secondary parameter of a (compensated) impedance
+	void Values(std::complex<float> Z, float &primary, float &secondary);
+	Verdict Evaluate(std::complex<float> Z);
+	void SetVerdict(Verdict v);
+	void draw(coords_t offset) override;
+	void input(GUIEvent_t *ev) override {};
+
+	Menu *mConfig;
+	Config config;
+	Frontend::PlanEntry plan;
+	// incremented whenever the acquisition settings change (1 to 127, see Id(). Ids of the main
+	// measurement and the sweep are 0, remote measurements start at 0x8000)
+	uint8_t generation;
+	Verdict verdict;
+	// partial measurements of the current part (sum of uncompensated impedances)
+	std::complex<float> sumZ;
+	uint32_t samples;
+	float varMag, varPhase;
+	// consecutive out of range results
+	uint8_t outOfRange;
+	// measured values of the last decision
+	float value, secondaryValue;
+	// time keeping (in ms), a partial measurement starts with the result of the previous one
+	uint32_t chunkStart;
+	uint32_t partStart;
+	// statistics
+	uint32_t parts;
+	uint32_t totalSamples;
+	uint32_t latencySum, latencyMax, lastLatency;
+	uint32_t firstDecision, lastDecision;
+};
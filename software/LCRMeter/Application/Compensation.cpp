@@ -0,0 +1,153 @@
+#include "Compensation.hpp"
+
+#include <math.h>
+#include "HardwareLimits.hpp"
+#include "Persistence.hpp"
+#include "log.h"
+
+#define Log_Compensation (LevelDebug|LevelInfo|LevelWarn|LevelError|LevelCrit)
+
+using namespace std;
+
+// Marks a completely captured table (erased flash reads as 0xFF)
+static constexpr uint32_t TableValid = 0x434F4D50;
+
+/*
+ * Plausibility limits of the standards. The open standard is a small capacitance (leads and fixture)
+ * in parallel to a small leakage conductance, its admittance limit grows with the frequency
+ */
+static constexpr float MaxOpenCapacitance = 100e-12f;
+static constexpr float MaxOpenConductance = 10e-6f;
+static constexpr float MaxShortImpedance = 15.0f;
+static constexpr float MaxLoadDeviation = 0.5f;
+
+using Table = struct {
+	uint32_t magic;
+	// resistance of the load standard, 0 if no load compensation has been captured
+	float loadStandard;
+	uint32_t frequency[Compensation::Points];
+	// The open standard is stored as admittance, it is roughly proportional to the frequency
+	complex<float> Yopen[Compensation::Points];
+	complex<float> Zshort[Compensation::Points];
+	// measured load impedance during the capture, correction factor after Finish()
+	complex<float> load[Compensation::Points];
+};
+
+static Table table;
+static bool enabled = false;
+
+static void SetupGrid() {
+	const float ratio = powf((float) HardwareLimits::MaxFrequency / HardwareLimits::MinFrequency,
+			1.0f / (Compensation::Points - 1));
+	for (uint8_t i = 0; i < Compensation::Points; i++) {
+		table.frequency[i] = lroundf(HardwareLimits::MinFrequency * powf(ratio, i));
+	}
+}
+
+// Open/short compensation, identical to the previous single frequency compensation
+static complex<float> OpenShort(complex<float> Z, complex<float> Yopen, complex<float> Zshort) {
+	return (Z - Zshort) / (complex<float>(1, 0) - Z * Yopen);
+}
+
+bool Compensation::Init() {
+	table.magic = 0;
+	SetupGrid();
+	return Persistence::Add(&table, sizeof(table));
+}
+
+uint32_t Compensation::Frequency(uint8_t point) {
+	return table.frequency[point];
+}
+
+void Compensation::Clear() {
+	table.magic = 0;
+	table.loadStandard = 0.0f;
+	SetupGrid();
+}
+
+bool Compensation::SetMeasurement(Standard s, uint8_t point, complex<float> Z) {
+	if (point >= Points) {
+		return false;
+	}
+	switch (s) {
+	case Standard::Open: {
+		auto Y = complex<float>(1, 0) / Z;
+		float maxY = 2 * (float) M_PI * table.frequency[point] * MaxOpenCapacitance
+				+ MaxOpenConductance;
+		if (abs(Y) > maxY) {
+			return false;
+		}
+		table.Yopen[point] = Y;
+	}
+		break;
+	case Standard::Short:
+		if (abs(Z) > MaxShortImpedance) {
+			return false;
+		}
+		table.Zshort[point] = Z;
+		break;
+	case Standard::Load:
+		table.load[point] = Z;
+		break;
+	}
+	return true;
+}
+
+bool Compensation::Finish(float loadStandard) {
+	if (loadStandard > 0.0f) {
+		// replace the measured load impedances by the correction factors
+		for (uint8_t i = 0; i < Points; i++) {
+			auto Zload = OpenShort(table.load[i], table.Yopen[i], table.Zshort[i]);
+			if (abs(Zload - loadStandard) > loadStandard * MaxLoadDeviation) {
+				LOG(Log_Compensation, LevelWarn, "Implausible load measurement at %luHz: %f",
+						table.frequency[i], abs(Zload));
+				return false;
+			}
+			table.load[i] = loadStandard / Zload;
+		}
+		table.loadStandard = loadStandard;
+	} else {
+		table.loadStandard = 0.0f;
+	}
+	table.magic = TableValid;
+	LOG(Log_Compensation, LevelInfo, "Captured compensation table (load standard: %f)",
+			table.loadStandard);
+	return Persistence::Save();
+}
+
+bool Compensation::Valid() {
+	return table.magic == TableValid;
+}
+
+void Compensation::Enable(bool enable) {
+	enabled = enable;
+}
+
+complex<float> Compensation::Apply(complex<float> Z, uint32_t frequency) {
+	if (!enabled || !Valid()) {
+		return Z;
+	}
+	/*
+	 * Linear interpolation over the frequency between the neighbouring grid points. Parasitic
+	 * capacitances and inductances of the leads are proportional to the frequency and thus exactly
+	 * represented. No extrapolation beyond the grid.
+	 */
+	uint8_t i = 0;
+	while (i < Points - 2 && frequency > table.frequency[i + 1]) {
+		i++;
+	}
+	float t = (float) ((int32_t) frequency - (int32_t) table.frequency[i])
+			/ (table.frequency[i + 1] - table.frequency[i]);
+	if (t < 0.0f) {
+		t = 0.0f;
+	} else if (t > 1.0f) {
+		t = 1.0f;
+	}
+	auto Yopen = table.Yopen[i] + t * (table.Yopen[i + 1] - table.Yopen[i]);
+	auto Zshort = table.Zshort[i] + t * (table.Zshort[i + 1] - table.Zshort[i]);
+	Z = OpenShort(Z, Yopen, Zshort);
+	if (table.loadStandard > 0.0f) {
+		Z *= table.load[i] + t * (table.load[i + 1] - table.load[i]);
+	}
+	return Z;
+}
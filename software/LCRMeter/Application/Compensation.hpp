@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdint.h>
+#include <complex>
+
+/*
+ * Frequency dependent open/short(/load) compensation of the test leads. The standards are measured
+ * once on a logarithmic frequency grid, the corrections are interpolated for any frequency in between.
+ */
+namespace Compensation {
+
+enum class Standard : uint8_t {
+	Open,
+	Short,
+	Load,
+};
+
+static constexpr uint8_t Points = 20;
+
+// Registers the table in the persistent storage, must be called before Persistence::Load
+bool Init();
+// Frequency of a grid point in Hz
+uint32_t Frequency(uint8_t point);
+// Invalidates the table, must be called before capturing the standards
+void Clear();
+// Stores the measured impedance of a standard, returns false if the measurement is implausible
+bool SetMeasurement(Standard s, uint8_t point, std::complex<float> Z);
+/*
+ * Completes the capture of the standards and saves the table. With loadStandard set to the resistance
+ * of the load standard (in ohm), the load measurements are used as well (0 for open/short only)
+ */
+bool Finish(float loadStandard);
+bool Valid();
+void Enable(bool enable);
+// Applies the compensation to a measured impedance (unchanged if disabled or no valid table)
+std::complex<float> Apply(std::complex<float> Z, uint32_t frequency);
+
+}
@@ -0,0 +1,318 @@
+#include "DataLogger.hpp"
+
+#include "ResultBus.hpp"
+#include "Remote.h"
+#include "fatfs.h"
+#include "log.h"
+#include "stm.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include <stdio.h>
+#include <string.h>
+#include <new>
+
+#define Log_DataLogger (LevelDebug|LevelInfo|LevelWarn|LevelError|LevelCrit)
+
+// Largest single write, clusters smaller than this limit the writes to one cluster
+static constexpr uint16_t MaxChunkSize = 4096;
+// Reserved when the file is created, no clusters have to be allocated while logging
+static constexpr uint32_t PreallocationSize = 4UL * 1024 * 1024;
+// Interval of directory/FAT updates (in ms), limits the loss of data at power failure
+static constexpr uint32_t SyncInterval = 2000;
+
+static constexpr uint32_t collector_stack_words = 256;
+static uint32_t collector_stack[collector_stack_words];
+static StaticTask_t collectorTask;
+static TaskHandle_t collectorHandle;
+
+static constexpr uint32_t writer_stack_words = 512;
+static uint32_t writer_stack[writer_stack_words];
+static StaticTask_t writerTask;
+static TaskHandle_t writerHandle;
+
+/*
+ * Events of the writer task. Passed through a queue, the task notification of the writer is taken by the
+ * SD card driver while it waits for its transfers
+ */
+enum class Event : uint8_t {
+	Open,
+	Write,
+	Close,
+};
+// Open/Close are sent at most once per file, Write only if no other event is pending
+static constexpr uint8_t eventQueueLen = 4;
+static StaticQueue_t eventQueue;
+static uint8_t eventQueueBuf[sizeof(Event) * eventQueueLen];
+static QueueHandle_t eventHandle;
+
+static void Send(Event e) {
+	if (xQueueSend(eventHandle, &e, 0) != pdPASS) {
+		LOG(Log_DataLogger, LevelError, "Writer event queue full");
+	}
+}
+
+enum class State : uint8_t {
+	Idle,
+	// file is being created and preallocated
+	Opening,
+	Logging,
+	// the collector hands over the remaining records
+	Stopping,
+	// the writer writes the remaining records and closes the file
+	Closing,
+};
+static volatile State state = State::Idle;
+
+static FIL file;
+static char filename[13];
+static int8_t subscriber = -1;
+
+/*
+ * Double buffer: the collector fills buffer[active] while the writer writes the other half. A half is
+ * owned by the writer while pending is set
+ */
+static uint8_t *buffer[2];
+static uint16_t chunkSize;
+static volatile bool pending[2];
+static uint16_t length[2];
+// only used by the collector
+static uint8_t active;
+static uint16_t fill;
+// only used by the writer
+static uint8_t writeIndex;
+static bool writeError;
+
+static DataLogger::Statistics stats;
+static uint32_t startTime, stopTime;
+
+static void HandOver() {
+	length[active] = fill;
+	pending[active] = true;
+	active ^= 1;
+	fill = 0;
+	if (!uxQueueMessagesWaiting(eventHandle)) {
+		// every event flushes the pending halves, no need to queue more than one
+		Send(Event::Write);
+	}
+}
+
+static void Add(const ResultBus::Record &r) {
+	Remote::StreamRecord s;
+	Remote::Pack(r, s);
+	if (pending[active] || (fill + sizeof(s) > chunkSize && pending[active ^ 1])) {
+		// the SD card is too slow, drop the record instead of waiting
+		stats.lost++;
+		return;
+	}
+	// records may be split across both halves, the file is a continuous stream of records
+	auto src = (const uint8_t*) &s;
+	uint16_t len = sizeof(s);
+	while (len) {
+		uint16_t n = chunkSize - fill;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(&buffer[active][fill], src, n);
+		fill += n;
+		src += n;
+		len -= n;
+		if (fill == chunkSize) {
+			HandOver();
+		}
+	}
+	stats.records++;
+}
+
+static void collector_task(void*) {
+	while (1) {
+		xTaskNotifyWait(0, 0, nullptr, portMAX_DELAY);
+		if (subscriber < 0) {
+			continue;
+		}
+		ResultBus::Record r;
+		while (ResultBus::Read(subscriber, r)) {
+			Add(r);
+		}
+		if (state == State::Stopping) {
+			stats.lost += ResultBus::Overruns(subscriber);
+			ResultBus::Unsubscribe(subscriber);
+			subscriber = -1;
+			if (fill && !pending[active]) {
+				HandOver();
+			}
+			state = State::Closing;
+			Send(Event::Close);
+		}
+	}
+}
+
+static void Flush() {
+	while (pending[writeIndex]) {
+		UINT written;
+		uint32_t cycles = DWT->CYCCNT;
+		FRESULT res = f_write(&file, buffer[writeIndex], length[writeIndex], &written);
+		cycles = DWT->CYCCNT - cycles;
+		uint32_t us = cycles / (SystemCoreClock / 1000000);
+		if (us > stats.maxFlushTime) {
+			stats.maxFlushTime = us;
+		}
+		stats.flushes++;
+		if ((res != FR_OK || written != length[writeIndex]) && !writeError) {
+			LOG(Log_DataLogger, LevelError, "Failed to write %s (%d)", filename, res);
+			writeError = true;
+		}
+		pending[writeIndex] = false;
+		writeIndex ^= 1;
+	}
+}
+
+static void Close() {
+	Flush();
+	// release the preallocated clusters behind the last record
+	FRESULT res = f_truncate(&file);
+	FRESULT closed = f_close(&file);
+	if (res == FR_OK) {
+		res = closed;
+	}
+	if (res != FR_OK) {
+		LOG(Log_DataLogger, LevelError, "Failed to close %s (%d)", filename, res);
+	}
+	delete[] buffer[0];
+	buffer[0] = buffer[1] = nullptr;
+	stopTime = xTaskGetTickCount();
+	state = State::Idle;
+	auto s = DataLogger::GetStatistics();
+	LOG(Log_DataLogger, LevelInfo, "%s: %lu records (%lu/s), %lu lost, longest write %luus", filename,
+			s.records, s.rate, s.lost, s.maxFlushTime);
+}
+
+static void Open() {
+	if (!filename[0]) {
+		for (uint32_t i = 1; i <= 99999; i++) {
+			snprintf(filename, sizeof(filename), "LOG%05lu.BIN", i);
+			if (f_stat(filename, nullptr) != FR_OK) {
+				// name not in use (or no card, f_open reports the error)
+				break;
+			}
+		}
+	}
+	FRESULT res = f_open(&file, filename, FA_CREATE_ALWAYS | FA_WRITE);
+	if (res != FR_OK) {
+		LOG(Log_DataLogger, LevelError, "Failed to create %s (%d)", filename, res);
+		state = State::Idle;
+		return;
+	}
+	uint32_t clusterSize = (uint32_t) file.fs->csize * _MIN_SS;
+	chunkSize = clusterSize < MaxChunkSize ? clusterSize : MaxChunkSize;
+	buffer[0] = new (std::nothrow) uint8_t[2 * chunkSize];
+	if (!buffer[0]) {
+		LOG(Log_DataLogger, LevelError, "Failed to allocate buffer");
+		f_close(&file);
+		state = State::Idle;
+		return;
+	}
+	buffer[1] = buffer[0] + chunkSize;
+	// FatFs (R0.11) has no f_expand, seeking behind the end allocates the clusters as well
+	res = f_lseek(&file, PreallocationSize);
+	if (res != FR_OK || f_tell(&file) != PreallocationSize) {
+		LOG(Log_DataLogger, LevelWarn, "Preallocated only %lu bytes", f_tell(&file));
+	}
+	f_lseek(&file, 0);
+	f_sync(&file);
+	pending[0] = pending[1] = false;
+	active = writeIndex = 0;
+	fill = 0;
+	writeError = false;
+	memset(&stats, 0, sizeof(stats));
+	startTime = xTaskGetTickCount();
+	if (state == State::Stopping) {
+		// stopped while the file was being created
+		Close();
+		return;
+	}
+	subscriber = ResultBus::Subscribe(collectorHandle);
+	if (subscriber < 0) {
+		LOG(Log_DataLogger, LevelError, "No free result subscriber");
+		Close();
+		return;
+	}
+	state = State::Logging;
+	LOG(Log_DataLogger, LevelInfo, "Logging to %s, %u byte writes", filename, chunkSize);
+}
+
+static void writer_task(void*) {
+	TickType_t lastSync = 0;
+	while (1) {
+		Event event;
+		if (xQueueReceive(eventHandle, &event,
+				state == State::Idle ? portMAX_DELAY : SyncInterval / portTICK_PERIOD_MS) != pdPASS) {
+			// only the periodic sync is due
+			event = Event::Write;
+		}
+		if (event == Event::Open) {
+			Open();
+			lastSync = xTaskGetTickCount();
+		}
+		if (buffer[0]) {
+			Flush();
+		}
+		if (event == Event::Close) {
+			Close();
+		} else if (state == State::Logging
+				&& xTaskGetTickCount() - lastSync >= SyncInterval / portTICK_PERIOD_MS) {
+			f_sync(&file);
+			lastSync = xTaskGetTickCount();
+		}
+	}
+}
+
+bool DataLogger::Init() {
+	eventHandle = xQueueGenericCreateStatic(eventQueueLen, sizeof(Event), eventQueueBuf, &eventQueue, 0);
+	collectorHandle = xTaskCreateStatic(collector_task, "LogCollect", collector_stack_words, nullptr, 2,
+			collector_stack, &collectorTask);
+	writerHandle = xTaskCreateStatic(writer_task, "LogWrite", writer_stack_words, nullptr, 1,
+			writer_stack, &writerTask);
+	return collectorHandle && writerHandle;
+}
+
+bool DataLogger::Start(const char *name) {
+	if (state != State::Idle || !writerHandle) {
+		return false;
+	}
+	if (name) {
+		strncpy(filename, name, sizeof(filename) - 1);
+		filename[sizeof(filename) - 1] = 0;
+	} else {
+		filename[0] = 0;
+	}
+	state = State::Opening;
+	Send(Event::Open);
+	return true;
+}
+
+void DataLogger::Stop() {
+	if (state == State::Logging) {
+		state = State::Stopping;
+		// the collector hands over the remaining records
+		xTaskNotify(collectorHandle, 0, eNoAction);
+	} else if (state == State::Opening) {
+		// checked by the writer once the file has been created
+		state = State::Stopping;
+	}
+}
+
+bool DataLogger::Active() {
+	return state != State::Idle;
+}
+
+DataLogger::Statistics DataLogger::GetStatistics() {
+	Statistics s = stats;
+	if (subscriber >= 0) {
+		s.lost += ResultBus::Overruns(subscriber);
+	}
+	uint32_t end = state == State::Idle ? stopTime : xTaskGetTickCount();
+	uint32_t duration = (end - startTime) * portTICK_PERIOD_MS;
+	s.rate = duration ? (uint64_t) s.records * 1000 / duration : 0;
+	return s;
+}
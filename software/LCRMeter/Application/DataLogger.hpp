@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Records all measurement results to a file on the SD card in the background.
+ *
+ * The results are taken from the ResultBus and packed (Remote::StreamRecord, same format as the
+ * binary USB stream) into one half of a RAM double buffer while a second task writes the other half.
+ * The writes are aligned to and at most as large as a cluster, the file is preallocated at the start
+ * and synced periodically. Neither the frontend nor the collecting task ever wait for the SD card, if
+ * both buffer halves are full the records are dropped and counted as lost.
+ */
+namespace DataLogger {
+
+using Statistics = struct statistics {
+	// records written to the file
+	uint32_t records;
+	// records lost because the buffer or the result bus was full
+	uint32_t lost;
+	// average since the start (in records/s)
+	uint32_t rate;
+	// number of buffer writes and duration of the longest one (in us)
+	uint32_t flushes;
+	uint32_t maxFlushTime;
+};
+
+bool Init();
+/*
+ * Starts logging to a new file (8.3 name, LOGnnnnn.BIN if filename is nullptr). Returns immediately,
+ * the file is opened by the logger task. Returns false if the logger is already running
+ */
+bool Start(const char *filename = nullptr);
+// Writes the remaining records and closes the file, returns immediately
+void Stop();
+bool Active();
+// Statistics of the running or the last log file
+Statistics GetStatistics();
+
+}
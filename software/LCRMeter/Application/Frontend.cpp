@@ -7,19 +7,23 @@
 #include "semphr.h"
 #include <math.h>
 #include <util.h>
+#include <limits>
 #include "Persistence.hpp"
+#include "ResultBus.hpp"
 #include "GUI/Dialog/progress.hpp"
 #include "HardwareLimits.hpp"
 #include "gui.hpp"
 
 static ad5940_t ad;
 extern SPI_HandleTypeDef hspi3;
+// The interrupt output of the AD5941 (GPIO0) is not connected on the current hardware. If it is
+// wired to the MCU, define the pin here to wait for results by interrupt instead of polling
+//#define AD5941_INT_GPIO_Port	GPIOx
+//#define AD5941_INT_Pin		GPIO_PIN_x
 
 #define Log_Frontend (LevelDebug|LevelInfo|LevelWarn|LevelError|LevelCrit)
 
 static constexpr uint32_t referenceVoltage = 1100000;
-static Frontend::Callback callback;
-static void *cb_ctx;
 static ProgressBar *AcquisitionProgress = nullptr;
 
 static constexpr ad5940_pga_gain_t PGA_gain = AD5940_PGA_GAIN_4;
@@ -33,15 +37,99 @@ static QueueHandle_t queueHandle;
 
 static ProgressDialog *cal_dialog;
 
+// First sequence slot used for the acquisition (current DFT, followed by the voltage DFT in the next slot)
+static constexpr uint8_t AcquisitionSequence = 0;
+static ad5940_seq_t acquisition[2];
+// Expected execution time of one acquisition sequence in ms
+static uint32_t acquisitionDuration;
+// DFT planning limits (see PlanDFT)
+static constexpr uint8_t MinPeriodsPerDFT = 10;
+// Lower limit for the noise performance of a single DFT (ADC samples with the Hann window)
+static constexpr uint32_t MinRawSamplesPerDFT = 4096;
+// Samples per period at the DFT input
+static constexpr uint8_t MinSamplesPerPeriod = 4;
+// ADCFILTERCON bits of the DFT input: AVRGNUM, AVRGEN and the SINC3 bypass
+static constexpr uint16_t ADCFilterDFTMask = 0xC0C0;
+// DFTCON bits of a plan entry: DFTINSEL, DFTNUM and the Hann window
+static constexpr uint32_t DFTConMask = (0x03UL << 20) | (0x0F << 4) | 0x01;
+static constexpr uint32_t DFTConHanning = 0x01;
+// ADC samples per DFT point with the SINC2 filter as DFT input (SINC3 and SINC2 oversampling)
+static constexpr uint16_t SINC2Decimation = 4 * 178;
+enum class ADCMeasurement : uint8_t {
+	Current,
+	Voltage,
+	VoltageCalibrationResistor,
+};
+/*
+ * Configuration currently applied to the AD5941. A reconfiguration only writes the registers whose
+ * values differ from this state, e.g. the next point of a sweep at constant bias and range only
+ * retunes the waveform generator. Anything configuring the frontend directly has to call
+ * InvalidateConfiguration()
+ */
+enum class SwitchSetting : uint8_t {
+	Unknown,
+	Measurement,
+	RCAL,
+};
+static struct {
+	SwitchSetting switches;
+	// LPDAC code of the bias voltage, -1 if unknown
+	int32_t biasCode;
+	// selected TIA gain, 0xFF if unknown
+	uint8_t rtia;
+	// amplitude of the running excitation waveform, 0 if the waveform generator needs a full setup
+	uint32_t amplitude;
+	uint32_t FCW;
+	// ADCFILTERCON/DFTCON fields of the DFT input, all bits set if unknown
+	uint16_t ADCFilter;
+	uint32_t DFTCon;
+	// timing and voltage input of the uploaded acquisition sequence
+	bool sequenceValid;
+	uint16_t settle_us;
+	uint32_t dft_us;
+	ADCMeasurement voltage;
+} applied;
+// Adaptive averaging requires a few samples for a meaningful variance
+static constexpr uint8_t MinAdaptiveAverages = 4;
+// Maximum DFT magnitude (16384 is the value according to datasheet, ADC actually reports values up
+// to 32768, two additional bits due to DFT)
+static constexpr uint32_t ADC_max_value = 32768 * 4;
+/*
+ * Autoranging thresholds in percent of the used current range. A range switch is triggered outside
+ * of the low/high limits, the new range is selected to end up at or below the target. The target is
+ * far enough away from both limits to avoid toggling between adjacent ranges.
+ */
+static constexpr float AutorangeLow = 15.0f;
+static constexpr float AutorangeHigh = 95.0f;
+static constexpr float AutorangeTarget = 80.0f;
+// Minimum used ADC range (relative to full scale) for a valid voltage/current measurement
+static constexpr float minRangeU = 0.00005f;
+static constexpr float minRangeI = 0.02f;
+// A single DFT aborts the acquisition if it is below this fraction of the minimum ranges
+static constexpr float AbortMargin = 0.5f;
+
+// Waiting time after changing the bias voltage before taking samples (in ms)
+static constexpr uint32_t BiasSettlingTime = 200;
+
 enum class MessageType : uint8_t {
 	MeasurementConfig,
 	StopMeasurement,
 	RunCalibration,
+	Trigger,
 };
 
 using Message = struct {
 	MessageType type;
 	Frontend::Settings settings;
+	Frontend::PlanEntry plan;
+	// MeasurementConfig: only configure and wait for triggers (single shot mode)
+	bool arm;
+	// MeasurementConfig: apply after the current measurement has completed
+	bool queued;
+	// MeasurementConfig: AD5941 GPIOs used as trigger inputs (rising edge)
+	uint8_t triggerGPIO;
+	// Trigger: cycle counter at the time of the trigger
+	uint32_t timestamp;
 };
 
 using Calibration = struct {
@@ -69,55 +157,169 @@ static float interpolate(float value, float scaleFromLow, float scaleFromHigh,
 	return result;
 }
 
+// DFTNUM field of DFTCON for a number of DFT points (4 to 16384)
+static constexpr uint16_t DFTNumBits(uint16_t points) {
+	return (points <= 4 ? 0 : DFTNumBits(points / 2) + 1);
+}
+
+/*
+ * Inputs of the DFT, ordered from the slowest to the fastest data rate. The averages are taken from the
+ * SINC3 output with the SINC3 filter bypassed, i.e. from the raw ADC samples
+ */
+static constexpr struct {
+	// ADC samples per DFT point
+	uint16_t decimation;
+	uint16_t ADCFilter;
+	// DFTINSEL bits of DFTCON
+	uint32_t DFTCon;
+} DFTInputs[] = {
+	// SINC3 and SINC2 filters, only for low frequencies. Long captures without many DFT points
+	{SINC2Decimation, 0x0000, 0x00UL << 20},
+	{16, 0xC0C0, 0x01UL << 20},
+	{8, 0x80C0, 0x01UL << 20},
+	{4, 0x40C0, 0x01UL << 20},
+	{2, 0x00C0, 0x01UL << 20},
+	// raw ADC samples
+	{1, 0x0040, 0x02UL << 20},
+};
+
 /*
- * Sets the ADC averages depending on the selected frequency in order
- * to cover at least a few waveform periods with the DFT
+ * Selects the ADC averages depending on the frequency in order to cover
+ * at least a few waveform periods with the DFT (fixed number of DFT points, Hann window)
  */
-static void SetADCAverages(uint32_t freq) {
+static void PlanADCAverages(uint32_t freq, Frontend::PlanEntry &e) {
 	uint32_t rawSamplesPerPeriod = HardwareLimits::ADCSampleRate / freq;
-	constexpr uint8_t MinPeriodsPerDFT = 10;
-	uint16_t avgRegVal = 0x0000;
+	// averaging entry of DFTInputs
+	uint8_t input;
 	if (HardwareLimits::DFTpoints / (rawSamplesPerPeriod / 2)
 			>= MinPeriodsPerDFT) {
 		// Averaging of 2 is enough
-		avgRegVal = 0x0000;
-		LOG(Log_Frontend, LevelDebug, "ADC averaging: 2");
+		input = 4;
 	} else if (HardwareLimits::DFTpoints / (rawSamplesPerPeriod / 4)
 			>= MinPeriodsPerDFT) {
 		// Averaging of 4 is enough
-		avgRegVal = 0x4000;
-		LOG(Log_Frontend, LevelDebug, "ADC averaging: 4");
+		input = 3;
 	} else if (HardwareLimits::DFTpoints / (rawSamplesPerPeriod / 8)
 			>= MinPeriodsPerDFT) {
 		// Averaging of 8 is enough
-		avgRegVal = 0x8000;
-		LOG(Log_Frontend, LevelDebug, "ADC averaging: 8");
+		input = 2;
 	} else {
 		// needs maximum averaging of 16
-		avgRegVal = 0xC000;
-		LOG(Log_Frontend, LevelDebug, "ADC averaging: 16");
+		input = 1;
 	}
-	ad5940_take_mutex(&ad);
-	ad5940_modify_reg(&ad, AD5940_REG_ADCFILTERCON, avgRegVal, 0xC000);
-	ad5940_release_mutex(&ad);
+	e.ADCFilter = DFTInputs[input].ADCFilter;
+	e.DFTCon = DFTInputs[input].DFTCon | DFTNumBits(HardwareLimits::DFTpoints) << 4 | DFTConHanning;
+	e.decimation = DFTInputs[input].decimation;
+}
+
+/*
+ * Leakage of a signal component at DC (e.g. ADC offset) into the DFT result, relative to a signal of
+ * the same amplitude at the excitation frequency. Depends on the number of captured periods k: the
+ * response sin(pi*k)/(pi*k) of the rectangular window and sin(pi*k)/(pi*k*(k^2-1)) of the Hann window
+ * vanish for an integer number of periods.
+ */
+static float Leakage(float periods, bool hanning) {
+	float leakage = fabsf(sinf(M_PI * (periods - floorf(periods)))) / (M_PI * periods);
+	return hanning ? leakage / (periods * periods - 1.0f) : leakage;
+}
+
+float Frontend::Leakage(const PlanEntry &e) {
+	uint32_t points = 4UL << ((e.DFTCon >> 4) & 0x0F);
+	return ::Leakage((float) points * e.decimation * e.frequency / HardwareLimits::ADCSampleRate,
+			e.DFTCon & DFTConHanning);
 }
 
-static Calibration GetCalibration(ad5940_hsrtia_t rtia, uint32_t freq) {
+/*
+ * Selects the DFT input, the number of DFT points and the window with the shortest capture:
+ * - a capture covering an integer number of periods (coherent) is free of leakage and measured without
+ *   window. The rectangular window has a 1.5 times lower noise bandwidth than the Hann window, it
+ *   reaches the same noise with fewer samples
+ * - any other capture uses the Hann window
+ * Both have to cover MinPeriodsPerDFT periods with at least MinSamplesPerPeriod DFT points per period.
+ * The fixed configuration is kept if no shorter capture meets the limits.
+ */
+static void PlanDFT(uint32_t freq, Frontend::PlanEntry &e, bool adaptive) {
+	PlanADCAverages(freq, e);
+	if (!adaptive) {
+		return;
+	}
+	uint32_t bestRawSamples = (uint32_t) HardwareLimits::DFTpoints * e.decimation;
+	for (auto &in : DFTInputs) {
+		float samplesPerPeriod = (float) HardwareLimits::ADCSampleRate / in.decimation / freq;
+		if (samplesPerPeriod < MinSamplesPerPeriod) {
+			continue;
+		}
+		for (uint16_t points = 4; points <= HardwareLimits::DFTpoints; points *= 2) {
+			uint32_t rawSamples = (uint32_t) points * in.decimation;
+			if (rawSamples >= bestRawSamples) {
+				break;
+			}
+			float periods = points / samplesPerPeriod;
+			bool coherent = (uint64_t) rawSamples * freq % HardwareLimits::ADCSampleRate == 0;
+			uint32_t minRawSamples = coherent ? MinRawSamplesPerDFT * 2 / 3 : MinRawSamplesPerDFT;
+			if (rawSamples < minRawSamples || periods < MinPeriodsPerDFT) {
+				continue;
+			}
+			// longer captures with this input can not be better
+			bestRawSamples = rawSamples;
+			e.ADCFilter = in.ADCFilter;
+			e.DFTCon = in.DFTCon | DFTNumBits(points) << 4 | (coherent ? 0 : DFTConHanning);
+			e.decimation = in.decimation;
+			break;
+		}
+	}
+}
+
+/*
+ * Rounds the settling time up to four steps per octave. The settling time is part of the acquisition
+ * sequence, neighboring points of a sweep share the same value and do not need a new sequence upload
+ */
+static uint32_t QuantizeSettleTime(uint32_t us) {
+	uint8_t msb = 31 - __builtin_clz(us);
+	if (msb < 2) {
+		return us;
+	}
+	uint32_t step = 1UL << (msb - 2);
+	return (us + step - 1) & ~(step - 1);
+}
+
+void Frontend::PreparePlanEntry(uint32_t frequency, PlanEntry &e, bool adaptiveDFT) {
+	e.frequency = frequency;
+	e.FCW = ad5940_frequency_to_FCW(frequency * 1000);
+	PlanDFT(frequency, e, adaptiveDFT);
+	// Analog settling time after switching the ADC mux: a few periods of the excitation, at least 200us
+	uint32_t settle_us = 3000000UL / frequency;
+	if (settle_us < 200) {
+		settle_us = 200;
+	}
+	e.settle_us = QuantizeSettleTime(settle_us);
+	// DFT duration plus some margin for the latency of the digital filters (two DFT input samples)
+	uint32_t points = 4UL << ((e.DFTCon >> 4) & 0x0F);
+	e.dft_us = (uint64_t) (points + 2) * e.decimation * 1000000UL / HardwareLimits::ADCSampleRate + 100;
 	// find previous and next calibration point in frequency
 	uint16_t i;
-	for (i = 0; i < ARRAY_SIZE(calibration_frequencies) - 1; i++) {
-		if (calibration_frequencies[i + 1] >= freq) {
+	for (i = 0; i < ARRAY_SIZE(calibration_frequencies) - 2; i++) {
+		if (calibration_frequencies[i + 1] >= frequency) {
 			break;
 		}
 	}
-	auto CalLower = calibration_points[rtia][i];
-	auto CalHigher = calibration_points[rtia][i + 1];
+	e.calIndex = i;
+	e.calWeight = interpolate(frequency, calibration_frequencies[i],
+			calibration_frequencies[i + 1], 0.0f, 1.0f);
+}
+
+uint32_t Frontend::SampleTime(const PlanEntry &e) {
+	// the acquisition sequence settles and runs a DFT for both current and voltage
+	return 2 * (e.settle_us + e.dft_us);
+}
+
+static Calibration GetCalibration(ad5940_hsrtia_t rtia, const Frontend::PlanEntry &p) {
+	auto CalLower = calibration_points[rtia][p.calIndex];
+	auto CalHigher = calibration_points[rtia][p.calIndex + 1];
 	// interpolate calibration values
 	Calibration c;
-	c.MagCal = interpolate(freq, calibration_frequencies[i],
-			calibration_frequencies[i + 1], CalLower.MagCal, CalHigher.MagCal);
-	c.PhaseCal = interpolate(freq, calibration_frequencies[i],
-			calibration_frequencies[i + 1], CalLower.PhaseCal, CalHigher.PhaseCal);
+	c.MagCal = CalLower.MagCal + p.calWeight * (CalHigher.MagCal - CalLower.MagCal);
+	c.PhaseCal = CalLower.PhaseCal + p.calWeight * (CalHigher.PhaseCal - CalLower.PhaseCal);
 	return c;
 }
 
@@ -145,9 +347,56 @@ static uint32_t GetCalibrationExcitationAmplitude(ad5940_hsrtia_t rtia) {
 	}
 }
 
+/*
+ * Predicts the TIA gain for the measured current. The current range used at the ADC scales linearly
+ * with the TIA gain, so the best fitting gain is the highest one that keeps the current below the
+ * autoranging target.
+ */
+static ad5940_hsrtia_t PredictRTIA(ad5940_hsrtia_t rtia, float usedRangeI) {
+	float rangePerOhm = usedRangeI / ad5940_HSTIA_gain_to_value(rtia);
+	ad5940_hsrtia_t predicted = AD5940_HSRTIA_200;
+	for (uint8_t i = AD5940_HSRTIA_200 + 1; i <= AD5940_HSRTIA_160K; i++) {
+		auto gain = (ad5940_hsrtia_t) i;
+		if (rangePerOhm * ad5940_HSTIA_gain_to_value(gain) > AutorangeTarget) {
+			break;
+		}
+		predicted = gain;
+	}
+	return predicted;
+}
+
+/*
+ * Classifies a measurement from the used ADC ranges (relative to full scale) and the clipping flags
+ */
+static Frontend::ResultType ClassifyResult(float rangeI, float rangeU, bool clippedI,
+		bool clippedU) {
+	if (rangeI < minRangeI && rangeU < minRangeU) {
+		// No current flowing and no voltage measured -> no leads connected
+		return Frontend::ResultType::OpenLeads;
+	} else if (rangeI < minRangeI || clippedU) {
+		// No current flowing, connected impedance too high
+		return Frontend::ResultType::Overrange;
+	} else if (rangeU < minRangeU || clippedI) {
+		// No voltage measurable, impedance too low
+		return Frontend::ResultType::Underrange;
+	}
+	return Frontend::ResultType::Valid;
+}
+
 static constexpr uint8_t msgQueueLen = 16;
 static uint8_t queueBuf[sizeof(Message) * msgQueueLen];
 
+static void InvalidateConfiguration() {
+	applied.switches = SwitchSetting::Unknown;
+	applied.biasCode = -1;
+	applied.rtia = 0xFF;
+	applied.amplitude = 0;
+	applied.FCW = UINT32_MAX;
+	applied.ADCFilter = 0xFFFF;
+	applied.DFTCon = 0xFFFFFFFF;
+	applied.sequenceValid = false;
+}
+
 static bool SetBias(int32_t biasVoltage, bool applyCalibration = true) {
 	if(biasVoltage > 10000000) {
 		return false;
@@ -159,71 +408,210 @@ static bool SetBias(int32_t biasVoltage, bool applyCalibration = true) {
 	// convert to DAC voltage (Gain of 4.9)
 	uint32_t V_DAC = highSide * 10 / 49;
 	uint16_t code_DAC = util_Map(V_DAC, 200000, 2400000, 0, 4095);
+	if (code_DAC == applied.biasCode) {
+		return true;
+	}
 	ad5940_take_mutex(&ad);
 	ad5940_modify_reg(&ad, AD5940_REG_LPDACDAT0, code_DAC, 0x00000FFF);
 	ad5940_release_mutex(&ad);
+	applied.biasCode = code_DAC;
 	LOG(Log_Frontend, LevelDebug, "Set bias voltage of %ld, DAC code %u", biasVoltage, code_DAC);
 	return true;
 }
 
 static void SetSwitchesForRCAL() {
+	if (applied.switches == SwitchSetting::RCAL) {
+		return;
+	}
 	ad5940_take_mutex(&ad);
 	ad5940_modify_reg(&ad, AD5940_REG_SWCON, AD5940_EXAMP_DSW_RCAL0 | AD5940_HSTSW_RCAL1, 0xF00F);
 	ad5940_release_mutex(&ad);
+	applied.switches = SwitchSetting::RCAL;
 	LOG(Log_Frontend, LevelDebug, "Switches set for calibration");
 }
 
 static void SetSwitchesForMeasurement() {
+	if (applied.switches == SwitchSetting::Measurement) {
+		return;
+	}
 	ad5940_take_mutex(&ad);
 	ad5940_modify_reg(&ad, AD5940_REG_SWCON, AD5940_EXAMP_DSW_CE0 | AD5940_HSTSW_DE0_DIRECT, 0xF00F);
 	ad5940_release_mutex(&ad);
+	applied.switches = SwitchSetting::Measurement;
 	LOG(Log_Frontend, LevelDebug, "Switches set for measurement");
 }
 
-enum class ADCMeasurement : uint8_t {
-	Current,
-	Voltage,
-	VoltageCalibrationResistor,
-};
-
-static void StartADC(ADCMeasurement m) {
-	ad5940_ADC_stop(&ad);
-	// Clear ADC min/max flags
+static void SetRTIA(ad5940_hsrtia_t rtia) {
+	if (rtia == applied.rtia) {
+		return;
+	}
 	ad5940_take_mutex(&ad);
-	ad5940_write_reg(&ad, AD5940_REG_INTCCLR, 0x30);
+	ad5940_modify_reg(&ad, AD5940_REG_HSRTIACON, rtia, 0x0F);
 	ad5940_release_mutex(&ad);
+	applied.rtia = rtia;
+}
+
+static ad5940_seq_dft_step_t GetADCMux(ADCMeasurement m) {
 	switch(m) {
 	case ADCMeasurement::Current:
-		ad5940_set_ADC_mux(&ad, AD5940_ADC_MUXP_HSTIAP, AD5940_ADC_MUXN_HSTIAN);
-		LOG(Log_Frontend, LevelDebug, "Starting ADC current measurement");
-		break;
+	default:
+		return {AD5940_ADC_MUXP_HSTIAP, AD5940_ADC_MUXN_HSTIAN};
 	case ADCMeasurement::Voltage:
-		ad5940_set_ADC_mux(&ad, AD5940_ADC_MUXP_AIN1, AD5940_ADC_MUXN_AIN0);
-		LOG(Log_Frontend, LevelDebug, "Starting ADC voltage measurement");
-		break;
+		return {AD5940_ADC_MUXP_AIN1, AD5940_ADC_MUXN_AIN0};
 	case ADCMeasurement::VoltageCalibrationResistor:
-		ad5940_set_ADC_mux(&ad, AD5940_ADC_MUXP_AIN2, AD5940_ADC_MUXN_AIN3);
-		LOG(Log_Frontend, LevelDebug, "Starting ADC calibration measurement");
-		break;
+		return {AD5940_ADC_MUXP_AIN2, AD5940_ADC_MUXN_AIN3};
 	}
+}
+
+static void StartADC(ADCMeasurement m) {
+	ad5940_ADC_stop(&ad);
+	// Clear ADC min/max flags
+	ad5940_take_mutex(&ad);
+	ad5940_write_reg(&ad, AD5940_REG_INTCCLR, 0x30);
+	ad5940_release_mutex(&ad);
+	auto mux = GetADCMux(m);
+	ad5940_set_ADC_mux(&ad, mux.p, mux.n);
 	ad5940_ADC_start(&ad);
 }
 
-static void SetCalibrationMeasurement(uint32_t freq, ad5940_hsrtia_t rtia) {
-	SetSwitchesForRCAL();
-	// Configure the frontend
-	SetBias(0);
+/*
+ * Builds and uploads the acquisition sequences for the given frequency. Each run of the
+ * sequences measures the current and then the voltage with one DFT each, both results are read
+ * back from the data FIFO. Must be called again whenever the frequency or the waveform changes.
+ * Filter settings and sequence are only written if they differ from the applied configuration.
+ */
+static void ConfigureAcquisition(const Frontend::PlanEntry &p, ADCMeasurement voltage) {
 	ad5940_take_mutex(&ad);
-	ad5940_modify_reg(&ad, AD5940_REG_HSRTIACON, rtia, 0x0F);
+	// DFT input (averaging, raw samples or SINC2), number of points and window of the plan
+	if (p.ADCFilter != applied.ADCFilter) {
+		ad5940_modify_reg(&ad, AD5940_REG_ADCFILTERCON, p.ADCFilter, ADCFilterDFTMask);
+		applied.ADCFilter = p.ADCFilter;
+	}
+	if (p.DFTCon != applied.DFTCon) {
+		ad5940_modify_reg(&ad, AD5940_REG_DFTCON, p.DFTCon, DFTConMask);
+		applied.DFTCon = p.DFTCon;
+	}
 	ad5940_release_mutex(&ad);
+	acquisitionDuration = (p.settle_us + p.dft_us + 999) / 1000;
+	if (applied.sequenceValid && applied.settle_us == p.settle_us && applied.dft_us == p.dft_us
+			&& applied.voltage == voltage) {
+		// sequence already uploaded
+		return;
+	}
+	constexpr uint32_t cycles_per_us = AD5940_SEQ_CLK / 1000000UL;
+	const ad5940_seq_dft_step_t steps[2] = {
+		GetADCMux(ADCMeasurement::Current),
+		GetADCMux(voltage),
+	};
+	ad5940_seq_build_dft(&ad, acquisition, steps, 2, p.settle_us * cycles_per_us,
+			p.dft_us * cycles_per_us);
+	uint16_t start = 0;
+	for (uint8_t i = 0; i < 2; i++) {
+		ad5940_seq_upload(&ad, AcquisitionSequence + i, start, &acquisition[i]);
+		start += acquisition[i].len;
+	}
+	applied.sequenceValid = true;
+	applied.settle_us = p.settle_us;
+	applied.dft_us = p.dft_us;
+	applied.voltage = voltage;
+	LOG(Log_Frontend, LevelDebug,
+			"Acquisition sequence: %lu DFT points, decimation %u, Hann %u, %uus settling, %luus DFT, leakage %e",
+			4UL << ((p.DFTCon >> 4) & 0x0F), p.decimation, (uint8_t) (p.DFTCon & DFTConHanning),
+			p.settle_us, p.dft_us, Frontend::Leakage(p));
+}
+
+/*
+ * Starts the excitation waveform. If only the frequency changed, the running waveform generator is
+ * just retuned
+ */
+static void SetExcitation(uint32_t amplitude, const Frontend::PlanEntry &p) {
+	if (amplitude == applied.amplitude) {
+		if (p.FCW != applied.FCW) {
+			ad5940_take_mutex(&ad);
+			ad5940_write_reg(&ad, AD5940_REG_WGFCW, p.FCW);
+			ad5940_release_mutex(&ad);
+			applied.FCW = p.FCW;
+		}
+		return;
+	}
 	ad5940_waveinfo_t wave;
 	wave.type = AD5940_WAVE_SINE;
-	wave.sine.amplitude = GetCalibrationExcitationAmplitude(rtia);
-	wave.sine.frequency = freq * 1000;
+	wave.sine.amplitude = amplitude;
+	wave.sine.frequency = p.frequency * 1000;
 	wave.sine.offset = 0;
 	wave.sine.phaseoffset = 0;
 	ad5940_generate_waveform(&ad, &wave);
-	SetADCAverages(freq);
+	applied.amplitude = amplitude;
+	applied.FCW = p.FCW;
+	// the sequence contains AFECON, which might have been changed by the waveform setup
+	applied.sequenceValid = false;
+}
+
+/*
+ * Running mean and covariance of complex samples (Welford's algorithm)
+ */
+class ComplexStatistics {
+public:
+	void reset() {
+		n = 0;
+		mean = 0.0f;
+		m2re = m2im = m2reim = 0.0f;
+	}
+	void add(std::complex<float> x) {
+		n++;
+		auto delta = x - mean;
+		mean += delta / (float) n;
+		auto delta2 = x - mean;
+		m2re += delta.real() * delta2.real();
+		m2im += delta.imag() * delta2.imag();
+		m2reim += delta.real() * delta2.imag();
+	}
+	/*
+	 * Variance of the mean in direction of the mean (magnitude) and perpendicular to it (phase),
+	 * relative to the squared magnitude of the mean
+	 */
+	void relativeVariance(float &radial, float &tangential) const {
+		float mag2 = std::norm(mean);
+		if (n < 2 || mag2 == 0.0f) {
+			radial = tangential = std::numeric_limits<float>::infinity();
+			return;
+		}
+		float c = mean.real() * mean.real() / mag2;
+		float s = mean.imag() * mean.imag() / mag2;
+		float cs = mean.real() * mean.imag() / mag2;
+		// sample variance divided by n for the variance of the mean
+		float scale = 1.0f / ((n - 1) * n * mag2);
+		radial = (c * m2re + 2 * cs * m2reim + s * m2im) * scale;
+		tangential = (s * m2re - 2 * cs * m2reim + c * m2im) * scale;
+	}
+private:
+	uint32_t n;
+	std::complex<float> mean;
+	float m2re, m2im, m2reim;
+};
+
+/*
+ * Standard error of the impedance calculated from the voltage and current statistics
+ * (relative for the magnitude, in radians for the phase)
+ */
+static void ImpedanceError(const ComplexStatistics &current, const ComplexStatistics &voltage,
+		float &errorMag, float &errorPhase) {
+	float radialI, tangentialI, radialU, tangentialU;
+	current.relativeVariance(radialI, tangentialI);
+	voltage.relativeVariance(radialU, tangentialU);
+	errorMag = sqrt(radialI + radialU);
+	errorPhase = sqrt(tangentialI + tangentialU);
+}
+
+static void SetCalibrationMeasurement(uint32_t freq, ad5940_hsrtia_t rtia) {
+	SetSwitchesForRCAL();
+	// Configure the frontend
+	SetBias(0);
+	SetRTIA(rtia);
+	Frontend::PlanEntry p;
+	Frontend::PreparePlanEntry(freq, p);
+	SetExcitation(GetCalibrationExcitationAmplitude(rtia), p);
+	ConfigureAcquisition(p, ADCMeasurement::VoltageCalibrationResistor);
 }
 
 static uint32_t GetADCAverage(uint16_t samples) {
@@ -260,10 +648,9 @@ static void RunBiasVoltageCalibration() {
 	wave.sine.offset = 0;
 	wave.sine.phaseoffset = 0;
 	ad5940_generate_waveform(&ad, &wave);
+	InvalidateConfiguration();
 
-	ad5940_take_mutex(&ad);
-	ad5940_modify_reg(&ad, AD5940_REG_HSRTIACON, AD5940_HSRTIA_160K, 0x0F);
-	ad5940_release_mutex(&ad);
+	SetRTIA(AD5940_HSRTIA_160K);
 
 	SetSwitchesForMeasurement();
 	StartADC(ADCMeasurement::Current);
@@ -309,91 +696,148 @@ static void frontend_task(void*) {
 		Stopped,
 		Measuring,
 		Calibrating,
-
+		// configured for a single shot measurement, waiting for the trigger
+		Armed,
 	};
 	State state = State::Stopped;
 
+	// Single shot mode: exactly one settled result per trigger
+	bool singleShot = false;
+	uint8_t triggerGPIO = 0;
+	bool triggerLevel = false;
+	uint32_t triggerCycles = 0;
+
 	// Measurement variables
 	Frontend::Settings settings;
-	uint8_t sampleCnt = 0;
-	bool voltageMeasurement = false;
-	float sumMagCurrent = 0.0f;
-	float sumPhaseCurrent = 0.0f;
-	float sumMagVoltage = 0.0f;
-	float sumPhaseVoltage = 0.0f;
+	Frontend::PlanEntry plan;
+	uint32_t sampleCnt = 0;
+	ad5940_dftacc_t accCurrent, accVoltage;
+	ad5940_dftacc_reset(&accCurrent);
+	ad5940_dftacc_reset(&accVoltage);
+	ComplexStatistics statCurrent, statVoltage;
+	statCurrent.reset();
+	statVoltage.reset();
 	ad5940_hsrtia_t rtia = AD5940_HSRTIA_1K;
 	bool currentMeasurementClipped = false;
+	bool voltageMeasurementClipped = false;
+	// consecutive DFTs below the minimum ranges (early abort)
+	uint8_t invalidSamples = 0;
 	uint32_t averagesBuffer;
 
 	// Calibration state variables
 	uint16_t calFreqIndex = 0;
+
+	// Applies a measurement configuration (MeasurementConfig message)
+	auto configure = [&](const Message &m) {
+		settings = m.settings;
+		plan = m.plan;
+		singleShot = m.arm;
+		triggerGPIO = m.arm ? m.triggerGPIO : 0;
+		state = singleShot ? State::Armed : State::Measuring;
+		sampleCnt = 0;
+		ad5940_dftacc_reset(&accCurrent);
+		ad5940_dftacc_reset(&accVoltage);
+		statCurrent.reset();
+		statVoltage.reset();
+		currentMeasurementClipped = false;
+		voltageMeasurementClipped = false;
+		invalidSamples = 0;
+
+		if (settings.range == Frontend::Range::Lowest) {
+			rtia = AD5940_HSRTIA_200;
+		} else if (settings.range == Frontend::Range::Highest) {
+			rtia = AD5940_HSRTIA_160K;
+		} else if (settings.rangeHint != AD5940_HSRTIA_OPEN) {
+			rtia = settings.rangeHint;
+		}
+
+		// Configure the frontend, only the changed settings are written
+		ad5940_spi_stats_t spiBefore, spiAfter;
+		ad5940_get_spi_stats(&ad, &spiBefore, false);
+		uint32_t cycles = DWT->CYCCNT;
+		int32_t previousBias = applied.biasCode;
+		SetSwitchesForMeasurement();
+		SetBias(settings.biasVoltage);
+		// Select correct TIA gain
+		SetRTIA(rtia);
+		SetExcitation(settings.excitationVoltage, plan);
+		ConfigureAcquisition(plan, ADCMeasurement::Voltage);
+		cycles = DWT->CYCCNT - cycles;
+		ad5940_get_spi_stats(&ad, &spiAfter, false);
+		LOG(Log_Frontend, LevelDebug, "Reconfiguration: %lu reads, %lu writes, %luus",
+				spiAfter.reads - spiBefore.reads, spiAfter.writes - spiBefore.writes,
+				cycles / (SystemCoreClock / 1000000));
+		if (previousBias >= 0 && applied.biasCode != previousBias) {
+			// the bias network needs time to settle, samples taken before are not usable
+			vTaskDelay(BiasSettlingTime);
+		}
+		if (triggerGPIO) {
+			ad5940_gpio_configure(&ad, triggerGPIO, AD5940_GPIO_INPUT);
+			triggerLevel = ad5940_gpio_get(&ad, triggerGPIO);
+		}
+
+		UpdateAcquisitionState(0);
+	};
+	// configuration of the next measurement, applied as soon as the current one has completed
+	Message next;
+	bool nextPending = false;
+
 	while(1) {
-		uint32_t delay = state == State::Stopped ? portMAX_DELAY : 5;
+		// The acquisition sequence already blocks while the AD5941 is busy, no need for additional delays
+		uint32_t delay = 0;
+		if (state == State::Stopped || (state == State::Armed && !triggerGPIO)) {
+			delay = portMAX_DELAY;
+		} else if (state == State::Armed) {
+			// poll the trigger inputs
+			delay = 1;
+		}
 		Message msg;
 		if (xQueueReceive(queueHandle, &msg, delay)) {
 			// Got message, handle
 			switch(msg.type) {
 			case MessageType::StopMeasurement:
 				state = State::Stopped;
+				nextPending = false;
+				break;
+			case MessageType::Trigger:
+				if (state != State::Armed) {
+					LOG(Log_Frontend, LevelWarn, "Ignoring trigger, frontend not armed");
+					break;
+				}
+				triggerCycles = msg.timestamp;
+				state = State::Measuring;
 				break;
 			case MessageType::RunCalibration:
 				// Create calibration window
 				cal_dialog = new ProgressDialog("Calibrating...", 200);
+				nextPending = false;
 				RunBiasVoltageCalibration();
 				calFreqIndex = 0;
 				rtia = AD5940_HSRTIA_200;
 				state = State::Calibrating;
 				calFreqIndex = 0;
 				sampleCnt = 0;
-				sumMagCurrent = 0.0f;
-				sumPhaseCurrent = 0.0f;
-				sumMagVoltage = 0.0f;
-				sumPhaseVoltage = 0.0f;
-				voltageMeasurement = false;
+				ad5940_dftacc_reset(&accCurrent);
+				ad5940_dftacc_reset(&accVoltage);
+				statCurrent.reset();
+				statVoltage.reset();
+				currentMeasurementClipped = false;
+				voltageMeasurementClipped = false;
+				invalidSamples = 0;
 				averagesBuffer = settings.averages;
 				settings.averages = 50;
 
 				// Configure the frontend
 				SetCalibrationMeasurement(calibration_frequencies[calFreqIndex], rtia);
-
-				StartADC(ADCMeasurement::Current);
-
 				break;
 			case MessageType::MeasurementConfig:
-				settings = msg.settings;
-				state = State::Measuring;
-				sampleCnt = 0;
-				sumMagCurrent = 0.0f;
-				sumPhaseCurrent = 0.0f;
-				sumMagVoltage = 0.0f;
-				sumPhaseVoltage = 0.0f;
-				voltageMeasurement = false;
-
-				if (settings.range == Frontend::Range::Lowest) {
-					rtia = AD5940_HSRTIA_200;
-				} else if (settings.range == Frontend::Range::Highest) {
-					rtia = AD5940_HSRTIA_160K;
+				if (msg.queued && state == State::Measuring && !singleShot) {
+					next = msg;
+					nextPending = true;
+					break;
 				}
-
-				// Configure the frontend
-				SetSwitchesForMeasurement();
-				SetBias(settings.biasVoltage);
-				// Select correct TIA gain
-				ad5940_take_mutex(&ad);
-				ad5940_modify_reg(&ad, AD5940_REG_HSRTIACON, rtia, 0x0F);
-				ad5940_release_mutex(&ad);
-				ad5940_waveinfo_t wave;
-				wave.type = AD5940_WAVE_SINE;
-				wave.sine.amplitude = msg.settings.excitationVoltage;
-				wave.sine.frequency = settings.frequency * 1000;
-				wave.sine.offset = 0;
-				wave.sine.phaseoffset = 0;
-				ad5940_generate_waveform(&ad, &wave);
-				SetADCAverages(settings.frequency);
-
-				StartADC(ADCMeasurement::Current);
-				UpdateAcquisitionState(0);
-
+				nextPending = false;
+				configure(msg);
 				break;
 			}
 			if(msg.type != MessageType::RunCalibration && cal_dialog) {
@@ -405,248 +849,299 @@ static void frontend_task(void*) {
 		case State::Stopped:
 			// nothing to do
 			break;
+		case State::Armed:
+			if (triggerGPIO) {
+				bool level = ad5940_gpio_get(&ad, triggerGPIO);
+				if (level && !triggerLevel) {
+					triggerCycles = DWT->CYCCNT;
+					state = State::Measuring;
+				}
+				triggerLevel = level;
+			}
+			break;
 		case State::Calibrating:
 		case State::Measuring: {
-			ad5940_dftresult_t result;
-			ad5940_get_dft_result(&ad, 1, &result);
-//			ad5940_take_mutex(&ad);
-//			int32_t adc = ad5940_read_reg(&ad, AD5940_REG_ADCDAT);
-//			ad5940_release_mutex(&ad);
-//			LOG(Log_Frontend, LevelDebug, "Raw ADC: %u", adc);
+			ad5940_dftraw_t raw[2];
+			uint32_t flags[2];
+			if (ad5940_seq_run_dft(&ad, AcquisitionSequence, acquisitionDuration,
+					raw, 2, flags) != AD5940_RES_OK) {
+				LOG(Log_Frontend, LevelWarn, "Acquisition sequence failed, retrying");
+				break;
+			}
 			sampleCnt++;
-			// Each measurement (current/voltage takes 50 percent of the acquisition time)
-			uint8_t acquisitionPercentage = util_Map(sampleCnt, 0,
-					settings.averages + 1, 0, 50);
-			if (voltageMeasurement) {
-				acquisitionPercentage += 50;
+			UpdateAcquisitionState(util_Map(sampleCnt, 0, settings.averages, 0, 100));
+			// each DFT runs in its own sequence, the ADC min/max flags belong to that measurement
+			if (flags[0] & (AD5940_INT_ADCMIN | AD5940_INT_ADCMAX)) {
+				currentMeasurementClipped = true;
 			}
-			UpdateAcquisitionState(acquisitionPercentage);
-			if (sampleCnt > 1) {
-				if (voltageMeasurement) {
-					sumMagVoltage += result.mag;
-					sumPhaseVoltage += result.phase;
-				} else {
-					if (state == State::Measuring
-							&& settings.range == Frontend::Range::AUTO) {
-						// check clipping and change range before averaging is complete -> faster range switching
-						ad5940_take_mutex(&ad);
-						currentMeasurementClipped = ad5940_read_reg(&ad,
-								AD5940_REG_INTCFLAG0) & 0x30;
-						ad5940_release_mutex(&ad);
-						if (currentMeasurementClipped) {
-							// reduce tia gain if possible
-							if (rtia != AD5940_HSRTIA_200) {
-								rtia = (ad5940_hsrtia_t) ((int) rtia - 1);
-								ad5940_take_mutex(&ad);
-								ad5940_modify_reg(&ad, AD5940_REG_HSRTIACON,
-										rtia, 0x0F);
-								ad5940_release_mutex(&ad);
-								// reset sample cnt and restart ADC (resets clipped bits)
-								sampleCnt = 0;
-								StartADC(ADCMeasurement::Current);
-							}
-						}
+			if (flags[1] & (AD5940_INT_ADCMIN | AD5940_INT_ADCMAX)) {
+				voltageMeasurementClipped = true;
+			}
+			if (state == State::Measuring && settings.range == Frontend::Range::AUTO) {
+				ad5940_hsrtia_t newRtia = rtia;
+				if (currentMeasurementClipped) {
+					/*
+					 * The magnitude of a clipped measurement is not usable for predicting the range.
+					 * Escape to the lowest gain, the next sample selects the correct range
+					 */
+					newRtia = AD5940_HSRTIA_200;
+				} else if (sampleCnt == 1) {
+					// first sample with this gain, switch to the predicted range before averaging
+					float normCurrent = (float) raw[0].real * raw[0].real
+							+ (float) raw[0].imag * raw[0].imag;
+					float usedRangeI = sqrtf(normCurrent) / ADC_max_value * 120;
+					if (usedRangeI > AutorangeHigh || usedRangeI < AutorangeLow) {
+						newRtia = PredictRTIA(rtia, usedRangeI);
 					}
-					sumMagCurrent += result.mag;
-					sumPhaseCurrent += result.phase;
+				}
+				if (newRtia != rtia) {
+					LOG(Log_Frontend, LevelDebug, "Switching TIA gain %lu -> %lu",
+							ad5940_HSTIA_gain_to_value(rtia), ad5940_HSTIA_gain_to_value(newRtia));
+					rtia = newRtia;
+					SetRTIA(rtia);
+					// discard samples taken with the previous range
+					sampleCnt = 0;
+					ad5940_dftacc_reset(&accCurrent);
+					ad5940_dftacc_reset(&accVoltage);
+					statCurrent.reset();
+					statVoltage.reset();
+					currentMeasurementClipped = false;
+					voltageMeasurementClipped = false;
+					invalidSamples = 0;
+					break;
+				}
+			}
+			// average in the complex domain, conversion to polar form only once per measurement
+			ad5940_dftacc_add(&accCurrent, &raw[0]);
+			ad5940_dftacc_add(&accVoltage, &raw[1]);
+			statCurrent.add(std::complex<float>(raw[0].real, raw[0].imag));
+			statVoltage.add(std::complex<float>(raw[1].real, raw[1].imag));
+			float errorMag, errorPhase;
+			ImpedanceError(statCurrent, statVoltage, errorMag, errorPhase);
+			bool averagingDone = sampleCnt >= settings.averages;
+			if (state == State::Measuring && settings.targetError > 0.0f
+					&& sampleCnt >= MinAdaptiveAverages && errorMag <= settings.targetError
+					&& errorPhase <= settings.targetError) {
+				// result has converged, no need for further averaging
+				averagingDone = true;
+			}
+			if (state == State::Measuring && settings.abortInvalid && !averagingDone) {
+				/*
+				 * Abort early if the result can not be valid anymore. Clipping flags are sticky and
+				 * the autoranger has already switched the gain if that could have helped. A single
+				 * unaveraged DFT is noisy, it only indicates open leads or an out of range impedance
+				 * if it is clearly below the minimum ranges (AbortMargin). Closer to the limits, two
+				 * consecutive DFTs have to agree
+				 */
+				bool abort = currentMeasurementClipped || voltageMeasurementClipped;
+				float rangeI = sqrtf((float) raw[0].real * raw[0].real
+						+ (float) raw[0].imag * raw[0].imag) / ADC_max_value;
+				float rangeU = sqrtf((float) raw[1].real * raw[1].real
+						+ (float) raw[1].imag * raw[1].imag) / ADC_max_value;
+				if (ClassifyResult(rangeI, rangeU, false, false) != Frontend::ResultType::Valid) {
+					invalidSamples++;
+				} else {
+					invalidSamples = 0;
+				}
+				if (invalidSamples >= 2 || ClassifyResult(rangeI / AbortMargin,
+						rangeU / AbortMargin, false, false) != Frontend::ResultType::Valid) {
+					abort = true;
+				}
+				if (abort) {
+					LOG(Log_Frontend, LevelDebug, "Result invalid after %lu samples, aborting",
+							sampleCnt);
+					averagingDone = true;
 				}
 			}
-			if (sampleCnt > settings.averages) {
-				if (voltageMeasurement) {
-					Frontend::Result result;
-					// all done calculate impedance
-					sumMagCurrent /= settings.averages;
-					sumPhaseCurrent /= settings.averages;
-					sumMagVoltage /= settings.averages;
-					sumPhaseVoltage /= settings.averages;
-
-					ad5940_take_mutex(&ad);
-					bool voltageMeasurementClipped = ad5940_read_reg(&ad, AD5940_REG_INTCFLAG0) & 0x30;
-					ad5940_release_mutex(&ad);
-
-					constexpr uint32_t ADC_max_value = 32768		// 16384 is the value according to datasheet, ADC actually reports values up to 32768
-														* 4;		// two additional bits due to DFT
-					float rangeU = sumMagVoltage * (1UL << 17) / ADC_max_value;
-					float rangeI = sumMagCurrent * (1UL << 17) / ADC_max_value;
-					// multiplication by 120 instead of 100 to have some headroom above displayed ADC ranges
-					result.usedRangeU = rangeU * 120;
-					result.usedRangeI = rangeI * 120;
-
-					// Check ranges for valid result
-					Frontend::ResultType type = Frontend::ResultType::Valid;
-					constexpr float minRangeU = 0.00005f;
-					constexpr float minRangeI = 0.02f;
-					if (rangeI < minRangeI && rangeU < minRangeU) {
-						// No current flowing and no voltage measured -> no leads connected
-						type = Frontend::ResultType::OpenLeads;
-					} else if (rangeI < minRangeI || voltageMeasurementClipped) {
-						// No current flowing, connected impedance too high
-						type = Frontend::ResultType::Overrange;
-					} else if (rangeU < minRangeU || currentMeasurementClipped) {
-						// No voltage measurable, impedance too low
-						type = Frontend::ResultType::Underrange;
+			if (averagingDone) {
+				Frontend::Result result;
+				// all done calculate impedance
+				ad5940_dftresult_t current, voltage;
+				ad5940_dftacc_to_polar(&accCurrent, &current);
+				ad5940_dftacc_to_polar(&accVoltage, &voltage);
+
+				float rangeU = voltage.mag * (1UL << 17) / ADC_max_value;
+				float rangeI = current.mag * (1UL << 17) / ADC_max_value;
+				// multiplication by 120 instead of 100 to have some headroom above displayed ADC ranges
+				result.usedRangeU = rangeU * 120;
+				result.usedRangeI = rangeI * 120;
+
+				// Check ranges for valid result
+				Frontend::ResultType type = ClassifyResult(rangeI, rangeU,
+						currentMeasurementClipped, voltageMeasurementClipped);
+
+				// Adjust current measurement by TIA gain (results in all calibration factors roughly equal to 1)
+				current.mag /= ad5940_HSTIA_gain_to_value(rtia);
+				float mag = voltage.mag / current.mag;
+				float phase = voltage.phase - current.phase;
+				LOG(Log_Frontend, LevelDebug,
+						"Measurement U: %f@%f, I: %f@%f", voltage.mag,
+						voltage.phase, current.mag, current.phase);
+				LOG(Log_Frontend, LevelDebug, "%lu averages, error |Z|: %f, phase: %f", sampleCnt,
+						errorMag, errorPhase);
+				ad5940_spi_stats_t spi;
+				ad5940_get_spi_stats(&ad, &spi, true);
+				LOG(Log_Frontend, LevelDebug,
+						"SPI transactions: %lu reads (%lu from shadow registers), %lu writes",
+						spi.reads, spi.cached, spi.writes);
+
+				if (state == State::Measuring) {
+					auto cal = GetCalibration(rtia, plan);
+					mag *= cal.MagCal;
+					phase -= cal.PhaseCal;
+					// constrain phase to +/-PI
+					if (phase >= M_PI) {
+						phase -= 2 * M_PI;
+					} else if (phase <= -M_PI) {
+						phase += 2 * M_PI;
 					}
-
-					// Adjust current measurement by TIA gain (results in all calibration factors roughly equal to 1)
-					sumMagCurrent /= ad5940_HSTIA_gain_to_value(rtia);
-					float mag = sumMagVoltage / sumMagCurrent;
-					float phase = sumPhaseVoltage - sumPhaseCurrent;
-					LOG(Log_Frontend, LevelDebug,
-							"Measurement U: %f@%f, I: %f@%f", sumMagVoltage,
-							sumPhaseVoltage, sumMagCurrent, sumPhaseCurrent);
-
-					if (state == State::Measuring) {
-						auto cal = GetCalibration(rtia, settings.frequency);
-						mag *= cal.MagCal;
-						phase -= cal.PhaseCal;
-						// constrain phase to +/-PI
-						if (phase >= M_PI) {
-							phase -= 2 * M_PI;
-						} else if (phase <= -M_PI) {
-							phase += 2 * M_PI;
-						}
 //						result.Magnitude = mag;
 //						// convert phase to degrees
 //						result.Phase = phase * 180.0 / M_PI;
-						/*
-						 * Reconstruct I/Q values from magnitude and phase, making it easier to calculate
-						 * component values later on. Original I/Q is not valid anymore because the
-						 * calibration works in the polar domain
-						 */
-						result.Z = std::complex<float>(mag * cos(phase), mag * sin(phase));
-						result.frequency = settings.frequency;
-
-						constexpr float mag_to_RMS = (1UL << 17)		// compensate division in ad5940_get_dft_result
-													* 1.835f/32768		// ADC bits and slope compensation
-													* 0.25f 			// Compensate additional 2 bits in DFT
-													* M_SQRT1_2;		// Peak to RMS
-						result.RMS_U = sumMagVoltage * mag_to_RMS * 10 / ad5940_PGA_gain_to_value10(PGA_gain);
-						result.RMS_I = sumMagCurrent * mag_to_RMS * 10 / ad5940_PGA_gain_to_value10(PGA_gain);
-						/*
-						 * The calibration factor contains corrections for both the current and the voltage, it is
-						 * not possible to separate their influences. However, the voltage accuracy of the AD5941 is
-						 * significantly better than the current accuracy (due to inaccurate resistors in the TIA) so
-						 * it is assumed here that all error sources come from the current measurement only and the
-						 * calibration factor is used to correct the measured current value.
-						 */
-						result.RMS_I /= cal.MagCal;
-
-						// Calculate lowest and highest measurable impedances
-						float smallestCurrent = result.RMS_I * minRangeI / rangeI;
-						float smallestVoltage = result.RMS_U * minRangeU / rangeU;
-						float highestCurrent = result.RMS_I / rangeI;
-						float highestVoltage = (float) settings.excitationVoltage
-												* 0.000001		// Convert from uV to V
-												* M_SQRT1_2;	// Convert from peak to RMS
-						if (result.clippedI) {
-							result.LimitLow = smallestVoltage / highestCurrent;
-						} else {
-							result.LimitLow = smallestVoltage / result.RMS_I;
-						}
-						if (result.clippedU) {
-							result.LimitHigh = highestVoltage / smallestCurrent;
-						} else {
-							result.LimitHigh = result.RMS_U / smallestCurrent;
-						}
+					/*
+					 * Reconstruct I/Q values from magnitude and phase, making it easier to calculate
+					 * component values later on. Original I/Q is not valid anymore because the
+					 * calibration works in the polar domain
+					 */
+					result.Z = std::complex<float>(mag * cos(phase), mag * sin(phase));
+					result.frequency = settings.frequency;
+					result.id = settings.id;
+					result.errorMag = errorMag;
+					result.errorPhase = errorPhase;
+					result.averages = sampleCnt;
+					result.triggerLatency = 0;
+					result.rawCurrent = accCurrent;
+					result.rawVoltage = accVoltage;
+
+					constexpr float mag_to_RMS = (1UL << 17)		// compensate division in ad5940_dftacc_to_polar
+												* 1.835f/32768		// ADC bits and slope compensation
+												* 0.25f 			// Compensate additional 2 bits in DFT
+												* M_SQRT1_2;		// Peak to RMS
+					result.RMS_U = voltage.mag * mag_to_RMS * 10 / ad5940_PGA_gain_to_value10(PGA_gain);
+					result.RMS_I = current.mag * mag_to_RMS * 10 / ad5940_PGA_gain_to_value10(PGA_gain);
+					/*
+					 * The calibration factor contains corrections for both the current and the voltage, it is
+					 * not possible to separate their influences. However, the voltage accuracy of the AD5941 is
+					 * significantly better than the current accuracy (due to inaccurate resistors in the TIA) so
+					 * it is assumed here that all error sources come from the current measurement only and the
+					 * calibration factor is used to correct the measured current value.
+					 */
+					result.RMS_I /= cal.MagCal;
+
+					// Calculate lowest and highest measurable impedances
+					float smallestCurrent = result.RMS_I * minRangeI / rangeI;
+					float smallestVoltage = result.RMS_U * minRangeU / rangeU;
+					float highestCurrent = result.RMS_I / rangeI;
+					float highestVoltage = (float) settings.excitationVoltage
+											* 0.000001		// Convert from uV to V
+											* M_SQRT1_2;	// Convert from peak to RMS
+					if (result.clippedI) {
+						result.LimitLow = smallestVoltage / highestCurrent;
+					} else {
+						result.LimitLow = smallestVoltage / result.RMS_I;
+					}
+					if (result.clippedU) {
+						result.LimitHigh = highestVoltage / smallestCurrent;
+					} else {
+						result.LimitHigh = result.RMS_U / smallestCurrent;
+					}
 
-						result.type = type;
-						result.clippedI = currentMeasurementClipped;
-						result.clippedU = voltageMeasurementClipped;
-
-						// TODO fill with proper values
-						result.range = Frontend::Range::AUTO;
-						UpdateAcquisitionState(0);
-						if (settings.range == Frontend::Range::AUTO) {
-							// Check if range switch is required
-							if (result.clippedI || result.usedRangeI > 95) {
-								// reduce tia gain if possible
-								if (rtia != AD5940_HSRTIA_200) {
-									rtia = (ad5940_hsrtia_t) ((int)rtia - 1);
-									ad5940_take_mutex(&ad);
-									ad5940_modify_reg(&ad, AD5940_REG_HSRTIACON,
-											rtia, 0x0F);
-									ad5940_release_mutex(&ad);
-									result.type = Frontend::ResultType::Ranging;
-								}
-							} else if (result.usedRangeI < 15) {
-								// increase tia gain if possible
-								if (rtia != AD5940_HSRTIA_160K) {
-									rtia = (ad5940_hsrtia_t) ((int)rtia + 1);
-									ad5940_take_mutex(&ad);
-									ad5940_modify_reg(&ad, AD5940_REG_HSRTIACON,
-											rtia, 0x0F);
-									ad5940_release_mutex(&ad);
-									result.type = Frontend::ResultType::Ranging;
-								}
-							}
-						}
-						if (callback) {
-							callback(cb_ctx, result);
+					result.type = type;
+					result.clippedI = currentMeasurementClipped;
+					result.clippedU = voltageMeasurementClipped;
+
+					// TODO fill with proper values
+					result.range = Frontend::Range::AUTO;
+					result.rtia = rtia;
+					UpdateAcquisitionState(0);
+					if (settings.range == Frontend::Range::AUTO) {
+						// Check if range switch is required
+						ad5940_hsrtia_t newRtia = rtia;
+						if (result.clippedI) {
+							newRtia = AD5940_HSRTIA_200;
+						} else if (result.usedRangeI > AutorangeHigh
+								|| result.usedRangeI < AutorangeLow) {
+							// jump directly to the best fitting gain instead of single steps
+							newRtia = PredictRTIA(rtia, rangeI * 120);
 						}
-					} else if (state == State::Calibrating) {
-						// Store in appropriate calibration slot (calibration resistor is 1k5)
-						float magCal = 1500.0f / mag;
-						LOG(Log_Frontend, LevelInfo,
-								"Calibration at gain %lu, frequency %luHz is: %f@%f",
-								ad5940_HSTIA_gain_to_value(rtia),
-								calibration_frequencies[calFreqIndex], magCal,
-								phase);
-						calibration_points[rtia][calFreqIndex].MagCal = magCal;
-						calibration_points[rtia][calFreqIndex].PhaseCal = phase;
-						// calculate percentage of calibration
-						uint8_t percentage = 100UL * (rtia
-								* ARRAY_SIZE(calibration_frequencies)
-								+ calFreqIndex)
-								/ (AD5940_HSRTIA_OPEN
-										* ARRAY_SIZE(calibration_frequencies));
-						if (cal_dialog) {
-							cal_dialog->SetPercentage(percentage);
+						if (newRtia != rtia) {
+							rtia = newRtia;
+							SetRTIA(rtia);
+							result.type = Frontend::ResultType::Ranging;
 						}
-						// move on to next step
-						if (calFreqIndex < ARRAY_SIZE(calibration_frequencies) - 1) {
-							calFreqIndex++;
+					}
+					if (singleShot) {
+						if (result.type == Frontend::ResultType::Ranging) {
+							// continue with the new gain, only the settled result is reported
 						} else {
-							calFreqIndex = 0;
-							if (rtia != AD5940_HSRTIA_160K) {
-								rtia = (ad5940_hsrtia_t) (uint8_t) (rtia + 1);
-							} else {
-								// Calibration routine complete
-								state = State::Stopped;
-								if (cal_dialog) {
-									delete cal_dialog;
-									cal_dialog = nullptr;
-									Persistence::Save();
-								}
-								// Start again with measurement
-								settings.averages = averagesBuffer;
-								Frontend::Start(settings);
-								break;
-							}
+							result.triggerLatency = (DWT->CYCCNT - triggerCycles)
+									/ (SystemCoreClock / 1000000);
+							LOG(Log_Frontend, LevelInfo,
+									"Triggered measurement: %luus latency (%luus expected)",
+									result.triggerLatency, sampleCnt * Frontend::SampleTime(plan));
+							state = State::Armed;
 						}
-						SetCalibrationMeasurement(
-								calibration_frequencies[calFreqIndex], rtia);
 					}
-
-					sumMagCurrent = 0.0f;
-					sumPhaseCurrent = 0.0f;
-					sumMagVoltage = 0.0f;
-					sumPhaseVoltage = 0.0f;
-					voltageMeasurement = false;
-					StartADC(ADCMeasurement::Current);
-				} else {
-					voltageMeasurement = true;
-					// Check ADC limits of the finished current measurement
-					ad5940_take_mutex(&ad);
-					currentMeasurementClipped = ad5940_read_reg(&ad, AD5940_REG_INTCFLAG0) & 0x30;
-					ad5940_release_mutex(&ad);
-					if (state == State::Calibrating) {
-						StartADC(ADCMeasurement::VoltageCalibrationResistor);
+					if (!(singleShot && result.type == Frontend::ResultType::Ranging)) {
+						ResultBus::Publish(result);
+					}
+					if (nextPending && result.type != Frontend::ResultType::Ranging) {
+						// continue with the queued measurement without an idle sample in between
+						nextPending = false;
+						configure(next);
+					}
+				} else if (state == State::Calibrating) {
+					// Store in appropriate calibration slot (calibration resistor is 1k5)
+					float magCal = 1500.0f / mag;
+					LOG(Log_Frontend, LevelInfo,
+							"Calibration at gain %lu, frequency %luHz is: %f@%f",
+							ad5940_HSTIA_gain_to_value(rtia),
+							calibration_frequencies[calFreqIndex], magCal,
+							phase);
+					calibration_points[rtia][calFreqIndex].MagCal = magCal;
+					calibration_points[rtia][calFreqIndex].PhaseCal = phase;
+					// calculate percentage of calibration
+					uint8_t percentage = 100UL * (rtia
+							* ARRAY_SIZE(calibration_frequencies)
+							+ calFreqIndex)
+							/ (AD5940_HSRTIA_OPEN
+									* ARRAY_SIZE(calibration_frequencies));
+					if (cal_dialog) {
+						cal_dialog->SetPercentage(percentage);
+					}
+					// move on to next step
+					if (calFreqIndex < ARRAY_SIZE(calibration_frequencies) - 1) {
+						calFreqIndex++;
 					} else {
-						StartADC(ADCMeasurement::Voltage);
+						calFreqIndex = 0;
+						if (rtia != AD5940_HSRTIA_160K) {
+							rtia = (ad5940_hsrtia_t) (uint8_t) (rtia + 1);
+						} else {
+							// Calibration routine complete
+							state = State::Stopped;
+							if (cal_dialog) {
+								delete cal_dialog;
+								cal_dialog = nullptr;
+								Persistence::Save();
+							}
+							// Start again with measurement
+							settings.averages = averagesBuffer;
+							Frontend::Start(settings);
+							break;
+						}
 					}
+					SetCalibrationMeasurement(
+							calibration_frequencies[calFreqIndex], rtia);
 				}
 
 				sampleCnt = 0;
+				ad5940_dftacc_reset(&accCurrent);
+				ad5940_dftacc_reset(&accVoltage);
+				statCurrent.reset();
+				statVoltage.reset();
+				currentMeasurementClipped = false;
+				voltageMeasurementClipped = false;
+				invalidSamples = 0;
 			}
 		}
 			break;
@@ -667,9 +1162,17 @@ bool Frontend::Init() {
 		}
 	}
 	calibration_BiasVoltageOffset = 0;
+	InvalidateConfiguration();
+	// cycle counter for timing the reconfiguration
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 	ad.CSport = AD5941_CS_GPIO_Port;
 	ad.CSpin = AD5941_CS_Pin;
 	ad.spi = &hspi3;
+#ifdef AD5941_INT_GPIO_Port
+	ad.INTport = AD5941_INT_GPIO_Port;
+	ad.INTpin = AD5941_INT_Pin;
+#endif
 	vTaskDelay(5);
 	if(ad5940_init(&ad) != AD5940_RES_OK) {
 		LOG(Log_Frontend, LevelError, "AD5941 initalization failed");
@@ -725,11 +1228,13 @@ bool Frontend::Init() {
 	ad5940_write_reg(&ad, AD5940_REG_ADCMINSM, UINT16_MAX - HardwareLimits::ADCHeadroom);
 	ad5940_write_reg(&ad, AD5940_REG_ADCMAX, UINT16_MAX - HardwareLimits::ADCHeadroom);
 	ad5940_write_reg(&ad, AD5940_REG_ADCMAXSMEN, UINT16_MAX - HardwareLimits::ADCHeadroom);
-	// enable min/max interrupts
-	ad5940_set_bits(&ad, AD5940_REG_INTCSEL0, 0x30);
+	// enable min/max flags. Selected in INTCSEL1, INTCSEL0 drives the interrupt pin and is reserved for
+	// the completion flags (min/max would keep the pin asserted after a clip)
+	ad5940_set_bits(&ad, AD5940_REG_INTCSEL1, 0x30);
 
-	// bypass SINC3 filter
+	// bypass SINC3 filter, only enabled by plans with SINC2 as the DFT input (see DFTInputs)
 	ad5940_set_bits(&ad, AD5940_REG_ADCFILTERCON, 1UL << 6);
+	ad5940_set_SINC2_OSR(&ad, AD5940_SINC2OSR_178);
 
 	// Set recommended DAC update rate
 	ad5940_modify_reg(&ad, AD5940_REG_HSDACCON, 0x000E, 0x01FE);
@@ -752,6 +1257,10 @@ bool Frontend::Init() {
 	dft.source = AD5940_DFTSRC_AVG;
 	ad5940_set_dft(&ad, &dft);
 
+	// DFT results of the acquisition sequence are collected through the data FIFO
+	ad5940_enable_FIFO(&ad, AD5940_FIFOSRC_DFT);
+	ad5940_seq_enable(&ad, true);
+
 	queueHandle = xQueueGenericCreateStatic(msgQueueLen, sizeof(Message),
 			queueBuf, &msgQueue, 0);
 
@@ -762,15 +1271,24 @@ bool Frontend::Init() {
 	return true;
 }
 
-void Frontend::SetCallback(Callback cb, void *ctx) {
-	callback = cb;
-	cb_ctx = ctx;
-}
-
 void Frontend::SetAcquisitionProgressBar(ProgressBar *p) {
 	AcquisitionProgress = p;
 }
 
+void Frontend::SetOutputs(uint8_t outputs, uint8_t state) {
+	static uint8_t configuredOutputs = 0;
+	if (outputs & ~configuredOutputs) {
+		configuredOutputs |= outputs;
+		ad5940_gpio_configure(&ad, configuredOutputs, AD5940_GPIO_OUTPUT);
+	}
+	if (outputs & state) {
+		ad5940_gpio_set(&ad, outputs & state);
+	}
+	if (outputs & ~state) {
+		ad5940_gpio_clear(&ad, outputs & ~state);
+	}
+}
+
 bool Frontend::Stop() {
 	Message msg;
 	msg.type = MessageType::StopMeasurement;
@@ -781,6 +1299,53 @@ bool Frontend::Start(Settings s) {
 	Message msg;
 	msg.type = MessageType::MeasurementConfig;
 	msg.settings = s;
+	// copy the plan entry, the caller may change it while the message is queued
+	if (s.plan) {
+		msg.plan = *s.plan;
+	} else {
+		PreparePlanEntry(s.frequency, msg.plan);
+	}
+	msg.settings.plan = nullptr;
+	msg.arm = false;
+	msg.queued = false;
+	return xQueueSend(queueHandle, &msg, 0) == pdPASS;
+}
+
+bool Frontend::Enqueue(Settings s) {
+	Message msg;
+	msg.type = MessageType::MeasurementConfig;
+	msg.settings = s;
+	if (s.plan) {
+		msg.plan = *s.plan;
+	} else {
+		PreparePlanEntry(s.frequency, msg.plan);
+	}
+	msg.settings.plan = nullptr;
+	msg.arm = false;
+	msg.queued = true;
+	return xQueueSend(queueHandle, &msg, 0) == pdPASS;
+}
+
+bool Frontend::Arm(Settings s, uint8_t triggerGPIO) {
+	Message msg;
+	msg.type = MessageType::MeasurementConfig;
+	msg.settings = s;
+	if (s.plan) {
+		msg.plan = *s.plan;
+	} else {
+		PreparePlanEntry(s.frequency, msg.plan);
+	}
+	msg.settings.plan = nullptr;
+	msg.arm = true;
+	msg.queued = false;
+	msg.triggerGPIO = triggerGPIO;
+	return xQueueSend(queueHandle, &msg, 0) == pdPASS;
+}
+
+bool Frontend::Trigger() {
+	Message msg;
+	msg.type = MessageType::Trigger;
+	msg.timestamp = DWT->CYCCNT;
 	return xQueueSend(queueHandle, &msg, 0) == pdPASS;
 }
 
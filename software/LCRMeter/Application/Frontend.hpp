@@ -2,6 +2,7 @@
 #include <stdint.h>
 #include "progressbar.hpp"
 #include <complex>
+#include "AD5940/ad5940.h"
 
 namespace Frontend {
 
@@ -31,24 +32,94 @@ using Result = struct result {
 	float LimitLow, LimitHigh;
 	ResultType type;
 	Range range;
+	// TIA gain used for this result
+	ad5940_hsrtia_t rtia;
 	uint32_t frequency;
+	// Identifier of the settings this result was measured with
+	uint16_t id;
+	// Estimated standard error of the result (relative for |Z|, in radians for the phase)
+	float errorMag, errorPhase;
+	// Number of averaged samples
+	uint32_t averages;
+	// Time from the trigger to the result in us (single shot mode only, 0 otherwise)
+	uint32_t triggerLatency;
+	// Sums of the raw DFT results of all averaged samples (uncalibrated, current measured with the TIA
+	// gain of this result), allows further processing in the complex domain
+	ad5940_dftacc_t rawCurrent, rawVoltage;
+};
+
+/*
+ * Acquisition parameters for one frequency, prepared with PreparePlanEntry(). A caller measuring many
+ * frequencies (e.g. a sweep) prepares the entry of each point right before it is measured, keeping a
+ * table for all points would cost more heap than the preparation costs time.
+ */
+using PlanEntry = struct planentry {
+	uint32_t frequency;
+	// Frequency control word of the waveform generator (WGFCW)
+	uint32_t FCW;
+	// DFT duration including filter latency
+	uint32_t dft_us;
+	// Analog settling time after switching the ADC mux
+	uint16_t settle_us;
+	// DFT input: averaging and SINC3 bypass bits of ADCFILTERCON
+	uint16_t ADCFilter;
+	// Source (DFTINSEL), number of points (DFTNUM) and Hann window (HANNINGEN) bits of DFTCON
+	uint32_t DFTCon;
+	// ADC samples per DFT point (averages, SINC2 decimation or 1 for raw samples)
+	uint16_t decimation;
+	// Calibration is interpolated between the calibration frequencies calIndex and calIndex + 1
+	uint8_t calIndex;
+	float calWeight;
 };
 
 using Settings = struct settings {
 	uint32_t biasVoltage;
 	uint32_t frequency;
+	// Prepared parameters for the frequency, nullptr calculates them in Start()
+	const PlanEntry *plan;
 	uint32_t excitationVoltage;
 	Range range;
+	// TIA gain to start with in AUTO range (e.g. the settled gain of a previous measurement at the same
+	// frequency), AD5940_HSRTIA_OPEN keeps the gain of the last measurement
+	ad5940_hsrtia_t rangeHint;
+	// Maximum number of averages. With a target error, averaging stops as soon as it has been reached
 	uint32_t averages;
+	// Target for the relative standard error of |Z| and the phase (in radians), 0 always uses all averages
+	float targetError;
+	// Stop averaging as soon as the result can not be valid anymore (open leads, out of range, clipping)
+	bool abortInvalid;
+	// Arbitrary identifier, copied into the result (e.g. the step of a list)
+	uint16_t id;
 };
 
-using Callback = void(*)(void*ctx, Result);
-
 bool Init();
-void SetCallback(Callback cb, void *ctx=nullptr);
 void SetAcquisitionProgressBar(ProgressBar *p);
+// Drives GPIOs of the AD5941 as digital outputs (AD5940_GPIOx masks), e.g. for a component handler
+void SetOutputs(uint8_t outputs, uint8_t state);
 bool Stop();
 bool Start(Settings s);
+/*
+ * Starts a measurement as soon as the current one has completed (immediately if not measuring). The
+ * next configuration is applied right after the result, without an idle sample in between
+ */
+bool Enqueue(Settings s);
+/*
+ * Configures the frontend ahead of time without measuring (single shot mode). Every trigger, either
+ * by Trigger() or by a rising edge on one of the triggerGPIO inputs of the AD5941, produces exactly
+ * one settled result.
+ */
+bool Arm(Settings s, uint8_t triggerGPIO = 0);
+bool Trigger();
+/*
+ * Plans the acquisition of a frequency. The adaptive DFT selects input, length and window for the
+ * shortest capture within the noise and leakage limits. Otherwise every frequency uses
+ * HardwareLimits::DFTpoints with the Hann window (the fixed configuration, e.g. for comparisons)
+ */
+void PreparePlanEntry(uint32_t frequency, PlanEntry &e, bool adaptiveDFT = true);
+// Expected duration of one sample (current and voltage DFT) in us
+uint32_t SampleTime(const PlanEntry &e);
+// Expected leakage of the ADC offset into the DFT result, relative to the signal
+float Leakage(const PlanEntry &e);
 bool Calibrate();
 
 }
@@ -4,10 +4,18 @@
 #include "HardwareLimits.hpp"
 #include "Frontend.hpp"
 #include <math.h>
+#include <stdio.h>
 #include "log.h"
 #include "touch.h"
 #include <complex>
 #include "Sweep.hpp"
+#include "Bin.hpp"
+#include "List.hpp"
+#include "Compensation.hpp"
+#include "ResultBus.hpp"
+#include "DataLogger.hpp"
+#include "Remote.h"
+#include <new>
 
 using namespace std;
 
@@ -18,17 +26,27 @@ static int32_t biasVoltage = 0;
 static int32_t excitationVoltage = 100000;
 static bool measurementUpdated = false;
 static uint32_t measurementAverages = 10;
-static bool newMeasurement = false;
+// target error for adaptive averaging (1% = 1000000, 0 disables adaptive averaging)
+static int32_t measurementTargetError = 0;
+// measure once per trigger (touching the result) instead of continuously
+static bool singleShot = false;
 static Frontend::Result measurementResult;
+// index of the LCR task on the result bus
+static int8_t resultSubscriber = -1;
 static TaskHandle_t handle = nullptr;
 
-static complex<float> Zopen, Zshort;
 static bool leadCompensation = false;
+// resistance of the load standard in uOhm, 0 skips the load step of the compensation capture
+static int32_t loadStandard = 100000000;
+static bool captureCompensation = false;
+static bool logToSD = false;
 
 // GUI elements
 Custom *cResult;
 static Menu *mainmenu;
 static Sweep *sweep;
+static Bin *bin;
+static List *list;
 
 static LCR::DisplayMode displayMode = LCR::DisplayMode::AUTO;
 static LCR::Result lastMeasurement;
@@ -177,6 +195,17 @@ static void drawResult(Widget &w, coords_t pos) {
 		break;
 	}
 
+	// Trigger to result latency of single shot measurements
+	display_SetFont(Font_Medium);
+	display_SetForeground(COLOR_BG_DEFAULT);
+	display_RectangleFull(pos.x, pos.y + 104, pos.x + w.getSize().x - 1, pos.y + 104 + Font_Medium.height);
+	if (lastMeasurement.frontend.triggerLatency) {
+		char latency[22];
+		snprintf(latency, sizeof(latency), "Latency: %lums", lastMeasurement.frontend.triggerLatency / 1000);
+		display_SetForeground(COLOR_BLACK);
+		display_String(pos.x + 2, pos.y + 104, latency);
+	}
+
 	// Draw ADC ranges at bottom
 	constexpr uint16_t xSpaceText = 75;
 	constexpr uint16_t xPadLeft = 40;
@@ -229,11 +258,8 @@ static void drawResult(Widget &w, coords_t pos) {
 	display_String(ADCRangeBottomRight.x - xSpaceText + 2, ADCRangeTopLeft.y + 11, val);
 }
 
-static LCR::Result CalculateComponentValues(Frontend::Result f) {
+LCR::Result LCR::ComponentValues(Frontend::Result f) {
 	LCR::Result res;
-	if (leadCompensation) {
-		f.Z = (f.Z - Zshort) / (complex<float>(1, 0) - f.Z / Zopen);
-	}
 	res.frontend = f;
 	float phase = 180 * arg(res.frontend.Z) / M_PI;
 	if (phase >= 0.0f) {
@@ -274,12 +300,9 @@ static LCR::Result CalculateComponentValues(Frontend::Result f) {
 	return res;
 }
 
-static void measurementCallback(void*, Frontend::Result result) {
-	measurementResult = result;
-	newMeasurement = true;
-	if (handle) {
-		xTaskNotify(handle, 0, eNoAction);
-	}
+static LCR::Result CalculateComponentValues(Frontend::Result f) {
+	f.Z = Compensation::Apply(f.Z, f.frequency);
+	return LCR::ComponentValues(f);
 }
 
 bool LCR::Init() {
@@ -305,9 +328,31 @@ bool LCR::Init() {
 			new MenuValue<int32_t>("Averages", &measurementAverages, Unit::None, callback_setTrueNotify,
 					&measurementUpdated, 1, 100));
 
-	sweep = new Sweep(SIZE(DISPLAY_WIDTH - mainmenu->getSize().x, DISPLAY_HEIGHT - 10), *mainmenu);
-	sweep->setVisible(false);
-	c->attach(sweep, COORDS(0, 0));
+	/*
+	 * The measurement modes are the largest allocations (the sweep alone takes about 6kB). A mode that
+	 * does not fit into the heap is left out, it adds no menu entry and is never selected
+	 */
+	sweep = new (std::nothrow) Sweep(SIZE(DISPLAY_WIDTH - mainmenu->getSize().x, DISPLAY_HEIGHT - 10), *mainmenu);
+	if (sweep) {
+		sweep->setVisible(false);
+		c->attach(sweep, COORDS(0, 0));
+	}
+
+	bin = new (std::nothrow) Bin(SIZE(DISPLAY_WIDTH - mainmenu->getSize().x, DISPLAY_HEIGHT - 10), *mainmenu);
+	if (bin) {
+		bin->setVisible(false);
+		c->attach(bin, COORDS(0, 0));
+	}
+
+	list = new (std::nothrow) List(SIZE(DISPLAY_WIDTH - mainmenu->getSize().x, DISPLAY_HEIGHT - 10), *mainmenu);
+	if (list) {
+		list->setVisible(false);
+		c->attach(list, COORDS(0, 0));
+	}
+	if (!sweep || !bin || !list) {
+		LOG(Log_LCR, LevelError, "Not enough memory for all measurement modes, %u bytes free",
+				xPortGetFreeHeapSize());
+	}
 
 	auto advancedMenu = new Menu("Advanced\nSettings", mainmenu->getSize());
 
@@ -317,7 +362,15 @@ bool LCR::Init() {
 	advancedMenu->AddEntry(
 			new MenuValue<int32_t>("Excitation", &excitationVoltage, Unit::Voltage, callback_setTrueNotify,
 					&measurementUpdated, HardwareLimits::MinExcitationVoltage, HardwareLimits::MaxExcitationVoltage));
+	advancedMenu->AddEntry(new MenuBool("Single shot", &singleShot, callback_setTrueNotify, &measurementUpdated));
 	advancedMenu->AddEntry(new MenuBool("O/S Comp.", &leadCompensation, callback_setTrueNotify, nullptr));
+	advancedMenu->AddEntry(
+			new MenuValue<int32_t>("Load std.", &loadStandard, Unit::Resistance, nullptr, nullptr, 0,
+					2000000000));
+	advancedMenu->AddEntry(new MenuAction("Capture\nComp.", callback_setTrueNotify, &captureCompensation));
+	advancedMenu->AddEntry(
+			new MenuValue<int32_t>("Target err.", &measurementTargetError, Unit::Percent, callback_setTrueNotify,
+					&measurementUpdated, 0, Unit::maxPercent / 10));
 	advancedMenu->AddEntry(new MenuBack());
 
 	mainmenu->AddEntry(advancedMenu);
@@ -337,75 +390,179 @@ bool LCR::Init() {
 	systemmenu->AddEntry(new MenuAction("Calibrate\nTouch", [](void*, Widget*) {
 		touch_Calibrate();
 	}, nullptr));
+	systemmenu->AddEntry(new MenuBool("Log to SD", &logToSD, [](void*, Widget*) {
+		if (logToSD) {
+			logToSD = DataLogger::Start();
+		} else {
+			DataLogger::Stop();
+		}
+	}, nullptr));
 	systemmenu->AddEntry(new MenuBack());
 	c->attach(mainmenu, COORDS(DISPLAY_WIDTH - mainmenu->getSize().x, 0));
-	cResult = new Custom(SIZE(DISPLAY_WIDTH - mainmenu->getSize().x, DISPLAY_HEIGHT - 10), drawResult, nullptr);
+	cResult = new Custom(SIZE(DISPLAY_WIDTH - mainmenu->getSize().x, DISPLAY_HEIGHT - 10), drawResult,
+			[](Widget&, GUIEvent_t *ev) {
+				if (singleShot && ev->type == EVENT_TOUCH_PRESSED && !Remote::OwnsFrontend()) {
+					Frontend::Trigger();
+				}
+			});
 	c->attach(cResult, COORDS(0, 0));
 	auto p = new ProgressBar(COORDS(DISPLAY_WIDTH - mainmenu->getSize().x - 10, 9), LCR::BarColor);
 	c->attach(p, COORDS(5, DISPLAY_HEIGHT - 10));
 	c->requestRedrawFull();
 	GUI::Init(*c);
 
-	Frontend::SetCallback(measurementCallback);
 	Frontend::SetAcquisitionProgressBar(p);
 	return true;
 }
 
 static void ConfigureFrontendMeasurement() {
+	if (Remote::OwnsFrontend()) {
+		// applied once the remote control releases the frontend
+		return;
+	}
 	Frontend::Settings s;
 	s.biasVoltage = biasVoltage;
 	s.frequency = measurementFrequency;
+	s.plan = nullptr;
 	s.averages = measurementAverages;
+	s.targetError = measurementTargetError / 100000000.0f;
+	s.abortInvalid = true;
+	s.id = 0;
 	s.excitationVoltage = excitationVoltage;
 	s.range = Frontend::Range::AUTO;
+	s.rangeHint = AD5940_HSRTIA_OPEN;
+	if (singleShot) {
+		Frontend::Arm(s);
+	} else {
+		Frontend::Start(s);
+	}
+}
+
+static void ConfigureCompensationMeasurement(uint8_t point) {
+	if (Remote::OwnsFrontend()) {
+		return;
+	}
+	// Start measurement with high averaging, also for the (out of range) open standard
+	Frontend::Settings s;
+	s.biasVoltage = biasVoltage;
+	s.frequency = Compensation::Frequency(point);
+	s.plan = nullptr;
+	s.averages = 50;
+	s.targetError = 0.0f;
+	s.abortInvalid = false;
+	s.id = 0;
+	s.excitationVoltage = excitationVoltage;
+	s.range = Frontend::Range::AUTO;
+	s.rangeHint = AD5940_HSRTIA_OPEN;
 	Frontend::Start(s);
 }
 
 void LCR::Run() {
 	handle = xTaskGetCurrentTaskHandle();
+	resultSubscriber = ResultBus::Subscribe(handle);
+	Remote::NotifyOnRelease(handle);
 	ConfigureFrontendMeasurement();
+	uint32_t lastOverruns = 0;
+	bool remoteOwned = false;
 	bool lastLeadCompensation = false;
-	int32_t compensationFrequency = 0;
 	enum class State : uint8_t {
 		Measuring,
 		CompensationOpen,
 		CompensationShort,
+		CompensationLoad,
 	};
 	State state = State::Measuring;
+	// grid point of the compensation table that is currently being captured
+	uint8_t compensationPoint = 0;
 	while (1) {
 		xTaskNotifyWait(0, 0, nullptr, portMAX_DELAY);
+		ResultBus::Record record;
+		if (Remote::OwnsFrontend()) {
+			// results of the remote measurement are not evaluated, settings changes are kept for later
+			while (ResultBus::Read(resultSubscriber, record))
+				;
+			remoteOwned = true;
+			continue;
+		}
+		if (remoteOwned) {
+			// the frontend still has the settings of the remote control
+			remoteOwned = false;
+			if (state == State::Measuring) {
+				measurementUpdated = true;
+			} else {
+				ConfigureCompensationMeasurement(compensationPoint);
+			}
+		}
 		if (measurementUpdated) {
 			ConfigureFrontendMeasurement();
 			measurementUpdated = false;
-			if (leadCompensation && compensationFrequency != measurementFrequency) {
-				leadCompensation = false;
-				lastLeadCompensation = false;
-				Dialog::MessageBox("Warning", Font_Big,
-						"Measurement frequency\nchanged. Lead\ncompensation has\nbeen disabled.", Dialog::MsgBox::OK,
-						nullptr, false);
-			}
 		}
-		if (newMeasurement) {
+		while (ResultBus::Read(resultSubscriber, record)) {
+			measurementResult = record.result;
 			LOG(Log_LCR, LevelDebug, "Got new measurement");
 			switch (state) {
 			case State::Measuring: {
 				lastMeasurement = CalculateComponentValues(measurementResult);
-				newMeasurement = false;
 
 				const char *s = mainmenu->GetSelectedSubmenuName();
 				static bool lastSweepActive = false;
+				static bool lastBinActive = false;
+				static bool lastListActive = false;
 				bool sweepActive = false;
+				bool binActive = false;
+				bool listActive = false;
 				if (s && !strcmp(s, "Sweep")) {
 					sweepActive = true;
+				} else if (s && !strcmp(s, "Bin")) {
+					binActive = true;
+				} else if (s && !strcmp(s, "List")) {
+					listActive = true;
 				}
 
 				if (sweepActive) {
 					// Only add a result when the correct range has been reached
 					if (lastMeasurement.frontend.type != Frontend::ResultType::Ranging) {
-						sweep->AddResult(lastMeasurement);
+						// the sweep applies the compensation itself
+						sweep->AddResult(measurementResult);
 						Frontend::Start(sweep->GetAcquisitionSettings());
 						sweep->requestRedraw();
 					}
+				} else if (binActive) {
+					if (lastMeasurement.frontend.type != Frontend::ResultType::Ranging) {
+						// the bin mode applies the compensation itself
+						bin->AddResult(measurementResult);
+						if (measurementResult.id != bin->Id()) {
+							// mode just entered or bin setup changed, otherwise the frontend keeps measuring
+							Frontend::Start(bin->GetAcquisitionSettings());
+						}
+					}
+				} else if (listActive) {
+					if (list->LoadRequested()) {
+						// 8.3 filename (no long file names)
+						char filename[13];
+						if (Dialog::FileChooser("Load list", filename, "/", "LST") == Dialog::Result::OK
+								&& !list->Load(filename)) {
+							Dialog::MessageBox("Error", Font_Big, "Invalid list file.", Dialog::MsgBox::OK,
+									nullptr, false);
+						}
+					}
+					if (lastMeasurement.frontend.type != Frontend::ResultType::Ranging && list->Steps()) {
+						/*
+						 * The frontend continues with the already queued step right after the result,
+						 * queue the following one while that is being measured
+						 */
+						switch (list->AddResult(measurementResult)) {
+						case List::Action::Next:
+							Frontend::Enqueue(list->GetAcquisitionSettings());
+							break;
+						case List::Action::Restart:
+							Frontend::Start(list->Restart());
+							Frontend::Enqueue(list->GetAcquisitionSettings());
+							break;
+						case List::Action::None:
+							break;
+						}
+					}
 				} else {
 					cResult->requestRedraw();
 				}
@@ -415,68 +572,93 @@ void LCR::Run() {
 					cResult->setVisible(false);
 				} else if (!sweepActive && lastSweepActive) {
 					sweep->setVisible(false);
+				}
+				if (binActive && !lastBinActive) {
+					bin->setVisible(true);
+					cResult->setVisible(false);
+				} else if (!binActive && lastBinActive) {
+					bin->setVisible(false);
+				}
+				if (listActive && !lastListActive) {
+					list->setVisible(true);
+					cResult->setVisible(false);
+				} else if (!listActive && lastListActive) {
+					list->setVisible(false);
+				}
+				if (!sweepActive && !binActive && !listActive
+						&& (lastSweepActive || lastBinActive || lastListActive)) {
 					cResult->setVisible(true);
 					ConfigureFrontendMeasurement();
 					measurementUpdated = false;
 				}
 
 				lastSweepActive = sweepActive;
+				lastBinActive = binActive;
+				lastListActive = listActive;
 			}
 				break;
 			case State::CompensationOpen:
-//				if (measurementResult.type != Frontend::ResultType::Valid) {
-//					// ignore settling measurements
-//					break;
-//				}
-				if(abs(measurementResult.Z) < 100000) {
-					Dialog::MessageBox("Error", Font_Big, "\"Open\" measurement\nfailed.",
-											Dialog::MsgBox::OK, nullptr, false);
-					leadCompensation = false;
-					lastLeadCompensation = false;
-					state = State::Measuring;
-					ConfigureFrontendMeasurement();
+			case State::CompensationShort:
+			case State::CompensationLoad: {
+				if (measurementResult.type == Frontend::ResultType::Ranging
+						|| measurementResult.frequency != Compensation::Frequency(compensationPoint)) {
+					// wait for the settled result of the current grid point
+					break;
+				}
+				auto standard = Compensation::Standard::Open;
+				const char *error = "\"Open\" measurement\nfailed.";
+				if (state == State::CompensationShort) {
+					standard = Compensation::Standard::Short;
+					error = "\"Short\" measurement\nfailed.";
+				} else if (state == State::CompensationLoad) {
+					standard = Compensation::Standard::Load;
+				}
+				bool failed = !Compensation::SetMeasurement(standard, compensationPoint,
+						measurementResult.Z);
+				if (!failed && ++compensationPoint < Compensation::Points) {
+					ConfigureCompensationMeasurement(compensationPoint);
 					break;
 				}
 				Frontend::Stop();
-				if (Dialog::MessageBox("Lead compensation", Font_Big, "Compensation step 1/2:\nShort cables.",
-						Dialog::MsgBox::ABORT_OK, nullptr, true) == Dialog::Result::OK) {
-					state = State::CompensationShort;
-					// Store result from open compensation
-					Zopen = measurementResult.Z;
-					// Start measurement with high averaging
-					Frontend::Settings s;
-					s.biasVoltage = biasVoltage;
-					s.frequency = measurementFrequency;
-					s.averages = 50;
-					s.excitationVoltage = excitationVoltage;
-					s.range = Frontend::Range::AUTO;
-					Frontend::Start(s);
-				} else {
-					// user aborted
-					leadCompensation = false;
-					lastLeadCompensation = false;
-					state = State::Measuring;
-					mainmenu->requestRedrawChildren();
-					ConfigureFrontendMeasurement();
+				bool done = false;
+				if (!failed) {
+					// all grid points of this standard captured, continue with the next one
+					if (state == State::CompensationOpen) {
+						if (Dialog::MessageBox("Lead compensation", Font_Big, "Compensation step 2/3:\nShort cables.",
+								Dialog::MsgBox::ABORT_OK, nullptr, true) == Dialog::Result::OK) {
+							state = State::CompensationShort;
+							compensationPoint = 0;
+							ConfigureCompensationMeasurement(compensationPoint);
+							break;
+						}
+						// user aborted
+						failed = true;
+						error = nullptr;
+					} else if (state == State::CompensationShort && loadStandard > 0
+							&& Dialog::MessageBox("Lead compensation", Font_Big,
+									"Compensation step 3/3:\nConnect load standard.\nAbort skips this step.",
+									Dialog::MsgBox::ABORT_OK, nullptr, true) == Dialog::Result::OK) {
+						state = State::CompensationLoad;
+						compensationPoint = 0;
+						ConfigureCompensationMeasurement(compensationPoint);
+						break;
+					} else {
+						float load = state == State::CompensationLoad ? loadStandard / 1000000.0f : 0.0f;
+						done = Compensation::Finish(load);
+						if (!done) {
+							failed = true;
+							error = "Compensation\nfailed.";
+						}
+					}
 				}
-				break;
-			case State::CompensationShort:
-//				if (measurementResult.type != Frontend::ResultType::Valid) {
-//					// ignore settling measurements
-//					break;
-//				}
-				Zshort = measurementResult.Z;
-				if (abs(Zshort) > 15) {
-					Dialog::MessageBox("Error", Font_Big, "\"Short\" measurement\nfailed.", Dialog::MsgBox::OK, nullptr,
-							false);
-					leadCompensation = false;
-					lastLeadCompensation = false;
-					compensationFrequency = 0;
-				} else {
-					compensationFrequency = measurementFrequency;
+				if (failed && error) {
+					Dialog::MessageBox("Error", Font_Big, error, Dialog::MsgBox::OK, nullptr, false);
 				}
+				leadCompensation = done;
 				state = State::Measuring;
+				mainmenu->requestRedrawChildren();
 				ConfigureFrontendMeasurement();
+			}
 				break;
 			}
 
@@ -485,28 +667,32 @@ void LCR::Run() {
 			ev.type = EVENT_NONE;
 			GUI::SendEvent(&ev);
 		}
-		if (leadCompensation != lastLeadCompensation) {
-			if (leadCompensation && compensationFrequency != measurementFrequency) {
-				Frontend::Stop();
-				if (Dialog::MessageBox("Lead compensation", Font_Big,
-						"Compensation step 1/2:\nDisconnect cables\nfrom device.", Dialog::MsgBox::ABORT_OK, nullptr,
-						true) == Dialog::Result::OK) {
-					state = State::CompensationOpen;
-					// Start measurement with high averaging
-					Frontend::Settings s;
-					s.biasVoltage = biasVoltage;
-					s.frequency = measurementFrequency;
-					s.averages = 50;
-					s.excitationVoltage = excitationVoltage;
-					s.range = Frontend::Range::AUTO;
-					Frontend::Start(s);
-				} else {
-					// user aborted
-					leadCompensation = false;
-					mainmenu->requestRedrawChildren();
-					ConfigureFrontendMeasurement();
-				}
+		if (ResultBus::Overruns(resultSubscriber) != lastOverruns) {
+			lastOverruns = ResultBus::Overruns(resultSubscriber);
+			LOG(Log_LCR, LevelWarn, "Lost measurements, %lu in total", lastOverruns);
+		}
+		if (state == State::Measuring && (captureCompensation
+				|| (leadCompensation && !lastLeadCompensation && !Compensation::Valid()))) {
+			// capture the compensation table over the whole frequency range
+			captureCompensation = false;
+			Frontend::Stop();
+			if (Dialog::MessageBox("Lead compensation", Font_Big,
+					"Compensation step 1/3:\nDisconnect cables\nfrom device.", Dialog::MsgBox::ABORT_OK, nullptr,
+					true) == Dialog::Result::OK) {
+				Compensation::Clear();
+				leadCompensation = false;
+				state = State::CompensationOpen;
+				compensationPoint = 0;
+				ConfigureCompensationMeasurement(compensationPoint);
+			} else {
+				// user aborted
+				leadCompensation = leadCompensation && Compensation::Valid();
+				mainmenu->requestRedrawChildren();
+				ConfigureFrontendMeasurement();
 			}
+		}
+		if (leadCompensation != lastLeadCompensation) {
+			Compensation::Enable(leadCompensation);
 			lastLeadCompensation = leadCompensation;
 		}
 	}
@@ -40,5 +40,7 @@ constexpr color_t BarColor = COLOR(11, 68, 181);
 
 bool Init();
 void Run();
+// Calculates the component values from an already compensated impedance (uses Z and frequency only)
+Result ComponentValues(Frontend::Result f);
 
 }
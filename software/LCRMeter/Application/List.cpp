@@ -0,0 +1,262 @@
+#include "List.hpp"
+#include "gui.hpp"
+#include "HardwareLimits.hpp"
+#include "Compensation.hpp"
+#include "file.hpp"
+#include "log.h"
+#include "cast.hpp"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define Log_List (LevelDebug|LevelInfo|LevelWarn|LevelError|LevelCrit)
+
+static constexpr uint16_t MaxAverages = 1000;
+
+List::List(coords_t size, Menu &menu) {
+	this->size = size;
+	numSteps = 0;
+	minimizeBiasChanges = false;
+	loadRequested = false;
+	generation = 0;
+	passStart = passTime = 0;
+	BuildOrder();
+
+	mConfig = new Menu("List", menu.getSize());
+	mConfig->AddEntry(new MenuAction("Load\nfile",
+			pmf_cast<void (*)(void*, Widget *w), List, &List::RequestLoad>::cfn, this));
+	mConfig->AddEntry(new MenuBool("Min. bias\nchanges", &minimizeBiasChanges,
+			pmf_cast<void (*)(void*, Widget *w), List, &List::SettingChanged>::cfn, this));
+	mConfig->AddEntry(new MenuBack());
+
+	menu.AddEntry(mConfig);
+}
+
+List::~List() {
+	if (mConfig) {
+		delete mConfig;
+	}
+}
+
+bool List::Load(const char *filename) {
+	if (File::Open(filename, FA_READ | FA_OPEN_EXISTING) != FR_OK) {
+		LOG(Log_List, LevelError, "Failed to open %s", filename);
+		return false;
+	}
+	Step loaded[MaxSteps];
+	uint8_t cnt = 0;
+	bool success = true;
+	char line[60];
+	while (success && File::ReadLine(line, sizeof(line))) {
+		if (line[0] == '#' || strncmp(line, "step", 4)) {
+			// skip comments and empty lines
+			continue;
+		}
+		char *s = strchr(line, '=');
+		if (!s || cnt >= MaxSteps) {
+			success = false;
+			break;
+		}
+		// frequency, bias, excitation, averages
+		uint32_t values[4];
+		for (uint8_t i = 0; i < 4; i++) {
+			char *end;
+			values[i] = strtoul(s + 1, &end, 0);
+			if (end == s + 1 || (i < 3 && *end != ',')) {
+				success = false;
+				break;
+			}
+			s = end;
+		}
+		if (!success) {
+			break;
+		}
+		if (values[0] < HardwareLimits::MinFrequency || values[0] > HardwareLimits::MaxFrequency
+				|| values[1] > HardwareLimits::MaxBiasVoltage
+				|| values[2] < HardwareLimits::MinExcitationVoltage
+				|| values[2] > HardwareLimits::MaxExcitationVoltage || values[3] < 1
+				|| values[3] > MaxAverages) {
+			success = false;
+			break;
+		}
+		loaded[cnt].frequency = values[0];
+		loaded[cnt].biasVoltage = values[1];
+		loaded[cnt].excitationVoltage = values[2];
+		loaded[cnt].averages = values[3];
+		cnt++;
+	}
+	File::Close();
+	if (!success) {
+		LOG(Log_List, LevelError, "Invalid step %u in %s", cnt + 1, filename);
+		return false;
+	}
+	numSteps = cnt;
+	for (uint8_t i = 0; i < numSteps; i++) {
+		steps[i] = loaded[i];
+		// the plan entries are calculated only once, not for every step of every pass
+		Frontend::PreparePlanEntry(steps[i].frequency, plan[i]);
+		results[i].valid = false;
+		results[i].rtia = AD5940_HSRTIA_OPEN;
+	}
+	passTime = 0;
+	BuildOrder();
+	LOG(Log_List, LevelInfo, "Loaded %u steps from %s", numSteps, filename);
+	requestRedraw();
+	return true;
+}
+
+bool List::LoadRequested() {
+	bool ret = loadRequested;
+	loadRequested = false;
+	return ret;
+}
+
+Frontend::Settings List::Restart() {
+	measured = requested = 0;
+	passStart = xTaskGetTickCount() * portTICK_PERIOD_MS;
+	return Settings(order[requested]);
+}
+
+Frontend::Settings List::GetAcquisitionSettings() {
+	if (++requested >= numSteps) {
+		requested = 0;
+	}
+	return Settings(order[requested]);
+}
+
+List::Action List::AddResult(const Frontend::Result &r) {
+	if (!numSteps) {
+		return Action::None;
+	}
+	uint8_t step = order[measured];
+	if (r.id == Id(step)) {
+		results[step].Z = r.Z;
+		results[step].type = r.type;
+		results[step].rtia = r.rtia;
+		results[step].valid = true;
+		if (++measured >= numSteps) {
+			// pass complete
+			uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+			passTime = now - passStart;
+			passStart = now;
+			measured = 0;
+			LOG(Log_List, LevelInfo, "Completed %u steps in %lums", numSteps, passTime);
+		}
+		requestRedraw();
+		return Action::Next;
+	}
+	uint8_t previous = order[measured ? measured - 1 : numSteps - 1];
+	if (r.id == Id(previous)) {
+		// the next step was queued too late, the frontend measured the previous one again
+		return Action::None;
+	}
+	return Action::Restart;
+}
+
+void List::SettingChanged(Widget *w) {
+	BuildOrder();
+	requestRedraw();
+}
+
+void List::RequestLoad(Widget *w) {
+	loadRequested = true;
+}
+
+void List::BuildOrder() {
+	for (uint8_t i = 0; i < numSteps; i++) {
+		order[i] = i;
+	}
+	if (minimizeBiasChanges) {
+		// stable insertion sort, steps with the same bias keep their order
+		for (uint8_t i = 1; i < numSteps; i++) {
+			uint8_t step = order[i];
+			uint8_t j = i;
+			while (j > 0 && steps[order[j - 1]].biasVoltage > steps[step].biasVoltage) {
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = step;
+		}
+	}
+	// results of the old order are not expected anymore, the list starts again with the next result
+	if (++generation == 0) {
+		generation = 1;
+	}
+	measured = requested = 0;
+}
+
+Frontend::Settings List::Settings(uint8_t step) {
+	Frontend::Settings s;
+	s.biasVoltage = steps[step].biasVoltage;
+	s.excitationVoltage = steps[step].excitationVoltage;
+	s.frequency = steps[step].frequency;
+	s.plan = &plan[step];
+	s.range = Frontend::Range::AUTO;
+	// start with the settled gain of the previous pass
+	s.rangeHint = results[step].rtia;
+	s.averages = steps[step].averages;
+	s.targetError = 0.0f;
+	s.abortInvalid = true;
+	s.id = Id(step);
+	return s;
+}
+
+void List::draw(coords_t offset) {
+	size = getSize();
+	auto pos = offset;
+	display_SetForeground(ColorBackground);
+	display_RectangleFull(pos.x, pos.y, pos.x + size.x - 1, pos.y + size.y - 1);
+	display_SetBackground(ColorBackground);
+	display_SetFont(Font_Medium);
+	display_SetForeground(ColorForeground);
+	if (!numSteps) {
+		display_String(pos.x + 5, pos.y + 5, "No list loaded");
+		return;
+	}
+	char line[50];
+	snprintf(line, sizeof(line), "%u steps, pass: %lums", numSteps, passTime);
+	display_String(pos.x + 5, pos.y + 3, line);
+	display_String(pos.x + 5, pos.y + 15, " # Freq.   Bias  |Z|      Phase Value");
+	int16_t y = pos.y + 27;
+	for (uint8_t i = 0; i < numSteps; i++) {
+		snprintf(line, sizeof(line), "%2u", i + 1);
+		Unit::SIStringFromFloat(&line[strlen(line)], 5, steps[i].frequency);
+		uint32_t bias = steps[i].biasVoltage;
+		snprintf(&line[strlen(line)], sizeof(line) - strlen(line), "Hz %2lu.%02luV", bias / 1000000,
+				bias / 10000 % 100);
+		auto &res = results[i];
+		if (res.valid && res.type == Frontend::ResultType::Valid) {
+			auto Z = Compensation::Apply(res.Z, steps[i].frequency);
+			Unit::SIStringFromFloat(&line[strlen(line)], 6, abs(Z));
+			// phase in 0.1 degree
+			int32_t phase = lroundf(arg(Z) * 1800 / M_PI);
+			uint32_t absPhase = abs(phase);
+			snprintf(&line[strlen(line)], sizeof(line) - strlen(line), "Ohm %c%2lu.%lu",
+					phase < 0 ? '-' : ' ', absPhase / 10, absPhase % 10);
+			Frontend::Result f;
+			f.Z = Z;
+			f.frequency = steps[i].frequency;
+			auto r = LCR::ComponentValues(f);
+			if (r.type == LCR::ImpedanceType::CAPACITANCE) {
+				Unit::SIStringFromFloat(&line[strlen(line)], 5, r.C.capacitance);
+				strcat(line, "F");
+			} else {
+				Unit::SIStringFromFloat(&line[strlen(line)], 5, r.L.inductance);
+				strcat(line, "H");
+			}
+		} else if (res.valid) {
+			constexpr char *typeNames[] = { "", "", " Overrange", " Underrange", " Open leads" };
+			strcat(line, typeNames[(uint8_t) res.type]);
+		}
+		if (i == order[measured]) {
+			display_SetForeground(ColorActive);
+		} else if (res.valid && res.type != Frontend::ResultType::Valid) {
+			display_SetForeground(ColorInvalid);
+		} else {
+			display_SetForeground(ColorForeground);
+		}
+		display_String(pos.x + 5, y, line);
+		y += Font_Medium.height + 2;
+	}
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdint.h>
+#include "Frontend.hpp"
+#include "LCR.hpp"
+#include "widget.hpp"
+#include "menu.hpp"
+
+/*
+ * Runs an ordered list of measurement conditions (test plan) loaded from the SD card. The next step is
+ * queued in the frontend while the current one is measured, so the steps follow each other without
+ * idle time. The results of all steps are collected in one table.
+ */
+class List : public Widget {
+public:
+	using Step = struct _step {
+		uint32_t frequency;
+		uint32_t biasVoltage;
+		uint32_t excitationVoltage;
+		uint16_t averages;
+	};
+	// What to do with the frontend after a result has been added
+	enum class Action : uint8_t {
+		// result stored, queue the settings of the next step
+		Next,
+		// result not needed (repeated measurement of a step), nothing to do
+		None,
+		// result does not belong to the running list, start again with the first step
+		Restart,
+	};
+	static constexpr uint8_t MaxSteps = 20;
+
+	List(coords_t size, Menu &menu);
+	~List();
+	/*
+	 * Reads the steps from a file, one "step = frequency, bias, excitation, averages" line per step
+	 * (in Hz, uV, uV). Returns false and keeps the current list if the file is invalid
+	 */
+	bool Load(const char *filename);
+	// Returns true (once) if the user requested to load a file, the dialog must not run in the GUI thread
+	bool LoadRequested();
+	uint8_t Steps() { return numSteps; };
+	// Starts a new pass through the list, returns the settings of the first step
+	Frontend::Settings Restart();
+	// Settings of the step following the last requested one
+	Frontend::Settings GetAcquisitionSettings();
+	// Processes a (not compensated) measurement result
+	Action AddResult(const Frontend::Result &r);
+private:
+	static constexpr color_t ColorBackground = COLOR_BG_DEFAULT;
+	static constexpr color_t ColorForeground = COLOR_BLACK;
+	static constexpr color_t ColorActive = COLOR_DARKGREEN;
+	static constexpr color_t ColorInvalid = COLOR_RED;
+
+	using StepResult = struct _stepresult {
+		std::complex<float> Z;
+		Frontend::ResultType type;
+		// settled gain of the last measurement, starting point for the next pass
+		ad5940_hsrtia_t rtia;
+		bool valid;
+	};
+
+	Widget::Type getType() override { return Widget::Type::Custom; };
+
+	void SettingChanged(Widget *w);
+	void RequestLoad(Widget *w);
+	// Sets up the execution order of the steps and invalidates all queued measurements
+	void BuildOrder();
+	uint16_t Id(uint8_t step) { return (uint16_t) generation << 8 | (step + 1); };
+	Frontend::Settings Settings(uint8_t step);
+	void draw(coords_t offset) override;
+	void input(GUIEvent_t *ev) override {};
+
+	Menu *mConfig;
+	Step steps[MaxSteps];
+	Frontend::PlanEntry plan[MaxSteps];
+	StepResult results[MaxSteps];
+	uint8_t numSteps;
+	// execution order of the steps
+	uint8_t order[MaxSteps];
+	// reorder the steps by bias voltage, each bias change requires additional settling time
+	bool minimizeBiasChanges;
+	bool loadRequested;
+	// positions in the execution order: step of the next expected result, last requested step
+	uint8_t measured, requested;
+	// part of the result ids, changes with the list so that results of a previous list are not stored
+	uint8_t generation;
+	// time keeping (in ms)
+	uint32_t passStart, passTime;
+};
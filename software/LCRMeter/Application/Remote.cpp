@@ -0,0 +1,548 @@
+#include "Remote.h"
+
+#include "Frontend.hpp"
+#include "ResultBus.hpp"
+#include "DataLogger.hpp"
+#include "HardwareLimits.hpp"
+#include "usbd_cdc_if.h"
+#include "log.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include <ctype.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define Log_Remote (LevelDebug|LevelInfo|LevelWarn|LevelError|LevelCrit)
+
+static constexpr uint32_t stack_size_words = 512;
+static uint32_t task_stack[stack_size_words];
+static TaskHandle_t taskHandle;
+static StaticTask_t task;
+
+// Received characters, written in interrupt context and read by the remote task
+static constexpr uint16_t RxBufferSize = 256;
+static uint8_t rxBuffer[RxBufferSize];
+static volatile uint16_t rxWrite = 0, rxRead = 0;
+static volatile uint32_t rxDropped = 0;
+
+/*
+ * Transmit double buffer: UserTxBufferFS is split into two halves, one is filled while the other one
+ * is being transmitted
+ */
+static uint8_t *txBuffer[2];
+static uint16_t txSize;
+static uint8_t txActive = 0;
+static uint16_t txLen = 0;
+// maximum waiting time for the host to read data before it is discarded (in ms)
+static constexpr uint32_t TxTimeout = 100;
+
+static int8_t subscriber = -1;
+static ResultBus::Record latest;
+static bool latestValid = false;
+
+// Settings of remote measurements
+enum class Mode : uint8_t {
+	Stopped,
+	Continuous,
+	Armed,
+};
+static Mode mode = Mode::Stopped;
+// a command is measuring (READ?, SWE?)
+static bool measuring = false;
+// restores its own measurement when the remote control releases the frontend
+static TaskHandle_t releaseNotify = nullptr;
+static uint32_t frequency = 1000;
+static uint32_t biasVoltage = 0;
+static uint32_t excitationVoltage = 100000;
+static uint16_t averages = 10;
+static uint32_t sweepStart = 100;
+static uint32_t sweepStop = 100000;
+static uint16_t sweepPoints = 11;
+static constexpr uint16_t MaxAverages = 1000;
+static constexpr uint16_t MaxSweepPoints = 1000;
+// results of remote measurements are identified by ids starting at this value
+static constexpr uint16_t FirstId = 0x8000;
+static uint16_t nextId = FirstId;
+
+// Binary streaming
+static bool streaming = false;
+static uint32_t streamRecords;
+static uint32_t streamStart;
+static uint32_t streamOverruns;
+
+static int16_t errorCode = 0;
+static const char *errorText = "No error";
+
+static void SetError(int16_t code, const char *text) {
+	errorCode = code;
+	errorText = text;
+	LOG(Log_Remote, LevelWarn, "Command error %d: %s", code, text);
+}
+
+static bool Flush(uint32_t timeout) {
+	if (!txLen) {
+		return true;
+	}
+	uint32_t start = xTaskGetTickCount();
+	while (CDC_TxBusy_FS()) {
+		if (xTaskGetTickCount() - start >= timeout) {
+			return false;
+		}
+		vTaskDelay(1);
+	}
+	if (CDC_Transmit_FS(txBuffer[txActive], txLen) != USBD_OK) {
+		return false;
+	}
+	// continue with the other half while this one is being transmitted
+	txActive ^= 1;
+	txLen = 0;
+	return true;
+}
+
+static void Send(const void *data, uint16_t len) {
+	auto p = (const uint8_t*) data;
+	while (len) {
+		if (txLen == txSize && !Flush(TxTimeout)) {
+			// host is not reading, discard the buffer instead of blocking the measurements
+			txLen = 0;
+		}
+		uint16_t chunk = txSize - txLen;
+		if (chunk > len) {
+			chunk = len;
+		}
+		memcpy(&txBuffer[txActive][txLen], p, chunk);
+		txLen += chunk;
+		p += chunk;
+		len -= chunk;
+	}
+}
+
+static void Print(const char *fmt, ...) {
+	char line[100];
+	va_list args;
+	va_start(args, fmt);
+	int len = vsnprintf(line, sizeof(line), fmt, args);
+	va_end(args);
+	if (len > (int) sizeof(line) - 1) {
+		len = sizeof(line) - 1;
+	}
+	if (len > 0) {
+		Send(line, len);
+	}
+}
+
+static void PrintResult(const Frontend::Result &r) {
+	Print("%lu,%e,%e,%u,%lu\n", r.frequency, real(r.Z), imag(r.Z), (uint8_t) r.type, r.averages);
+}
+
+static void HandleRecord(const ResultBus::Record &r) {
+	latest = r;
+	latestValid = true;
+	if (streaming) {
+		Remote::StreamRecord s;
+		Remote::Pack(r, s);
+		Send(&s, sizeof(s));
+		streamRecords++;
+	}
+}
+
+static Frontend::Settings GetSettings(uint32_t f, uint16_t id) {
+	Frontend::Settings s;
+	s.biasVoltage = biasVoltage;
+	s.frequency = f;
+	s.plan = nullptr;
+	s.averages = averages;
+	s.targetError = 0.0f;
+	s.abortInvalid = true;
+	s.excitationVoltage = excitationVoltage;
+	s.range = Frontend::Range::AUTO;
+	s.rangeHint = AD5940_HSRTIA_OPEN;
+	s.id = id;
+	return s;
+}
+
+// Reserves consecutive ids for count measurements, returns the first one
+static uint16_t NewIds(uint16_t count = 1) {
+	if (nextId > UINT16_MAX - count) {
+		nextId = FirstId;
+	}
+	uint16_t id = nextId;
+	nextId += count;
+	return id;
+}
+
+// Restores the measurement mode after a measurement triggered by a command
+static void ApplyMode() {
+	switch (mode) {
+	case Mode::Stopped:
+		// the local measurement takes over again
+		if (releaseNotify) {
+			xTaskNotify(releaseNotify, 0, eNoAction);
+		}
+		break;
+	case Mode::Continuous:
+		Frontend::Start(GetSettings(frequency, 0));
+		break;
+	case Mode::Armed:
+		Frontend::Arm(GetSettings(frequency, 0));
+		break;
+	}
+}
+
+// Waits for the settled result of a measurement started with this id
+static bool WaitResult(uint16_t id, uint32_t f, Frontend::Result &result) {
+	// expected duration with plenty of headroom for ranging
+	Frontend::PlanEntry plan;
+	Frontend::PreparePlanEntry(f, plan);
+	uint32_t timeout = (uint64_t) averages * Frontend::SampleTime(plan) * 3 / 1000 + 1000;
+	uint32_t start = xTaskGetTickCount();
+	while (xTaskGetTickCount() - start < timeout) {
+		ResultBus::Record r;
+		while (ResultBus::Read(subscriber, r)) {
+			HandleRecord(r);
+			if (r.result.id == id && r.result.type != Frontend::ResultType::Ranging) {
+				result = r.result;
+				return true;
+			}
+		}
+		xTaskNotifyWait(0, 0, nullptr, 10);
+	}
+	SetError(-240, "Hardware error");
+	return false;
+}
+
+// Settings are only stored while the local measurement owns the frontend
+static void SettingsChanged() {
+	if (mode != Mode::Stopped) {
+		ApplyMode();
+	}
+}
+
+static bool ParseUnsigned(const char *arg, uint32_t min, uint32_t max, uint32_t &value) {
+	if (!arg || !*arg) {
+		SetError(-109, "Missing parameter");
+		return false;
+	}
+	char *end;
+	uint32_t v = strtoul(arg, &end, 10);
+	if (end == arg || v < min || v > max) {
+		SetError(-224, "Illegal parameter value");
+		return false;
+	}
+	value = v;
+	return true;
+}
+
+// Parses a voltage in V and converts it to uV
+static bool ParseVoltage(const char *arg, uint32_t min, uint32_t max, uint32_t &value) {
+	if (!arg || !*arg) {
+		SetError(-109, "Missing parameter");
+		return false;
+	}
+	char *end;
+	float v = strtof(arg, &end);
+	if (end == arg || !(v >= min / 1000000.0f) || !(v <= max / 1000000.0f)) {
+		SetError(-224, "Illegal parameter value");
+		return false;
+	}
+	value = lroundf(v * 1000000.0f);
+	return true;
+}
+
+static bool ParseBool(const char *arg, bool &value) {
+	if (arg && (!strcasecmp(arg, "ON") || !strcmp(arg, "1"))) {
+		value = true;
+	} else if (arg && (!strcasecmp(arg, "OFF") || !strcmp(arg, "0"))) {
+		value = false;
+	} else {
+		SetError(-224, "Illegal parameter value");
+		return false;
+	}
+	return true;
+}
+
+using Command = struct {
+	const char *header;
+	void (*handler)(const char *arg);
+};
+
+static constexpr Command commands[] = {
+	{"*IDN?", [](const char*) {
+		Print("LCR meter\n");
+	}},
+	{"FREQ", [](const char *arg) {
+		if (ParseUnsigned(arg, HardwareLimits::MinFrequency, HardwareLimits::MaxFrequency, frequency)) {
+			SettingsChanged();
+		}
+	}},
+	{"FREQ?", [](const char*) {
+		Print("%lu\n", frequency);
+	}},
+	{"BIAS", [](const char *arg) {
+		if (ParseVoltage(arg, HardwareLimits::MinBiasVoltage, HardwareLimits::MaxBiasVoltage,
+				biasVoltage)) {
+			SettingsChanged();
+		}
+	}},
+	{"BIAS?", [](const char*) {
+		Print("%lu.%06lu\n", biasVoltage / 1000000, biasVoltage % 1000000);
+	}},
+	{"VOLT", [](const char *arg) {
+		if (ParseVoltage(arg, HardwareLimits::MinExcitationVoltage,
+				HardwareLimits::MaxExcitationVoltage, excitationVoltage)) {
+			SettingsChanged();
+		}
+	}},
+	{"VOLT?", [](const char*) {
+		Print("%lu.%06lu\n", excitationVoltage / 1000000, excitationVoltage % 1000000);
+	}},
+	{"AVER", [](const char *arg) {
+		uint32_t value;
+		if (ParseUnsigned(arg, 1, MaxAverages, value)) {
+			averages = value;
+			SettingsChanged();
+		}
+	}},
+	{"AVER?", [](const char*) {
+		Print("%u\n", averages);
+	}},
+	{"INIT", [](const char*) {
+		mode = Mode::Continuous;
+		ApplyMode();
+	}},
+	{"ABOR", [](const char*) {
+		mode = Mode::Stopped;
+		ApplyMode();
+	}},
+	{"ARM", [](const char*) {
+		mode = Mode::Armed;
+		ApplyMode();
+	}},
+	{"*TRG", [](const char*) {
+		if (mode != Mode::Armed) {
+			SetError(-211, "Trigger ignored");
+			return;
+		}
+		Frontend::Trigger();
+	}},
+	{"READ?", [](const char*) {
+		uint16_t id = NewIds();
+		measuring = true;
+		Frontend::Start(GetSettings(frequency, id));
+		Frontend::Result r;
+		if (WaitResult(id, frequency, r)) {
+			PrintResult(r);
+		}
+		measuring = false;
+		ApplyMode();
+	}},
+	{"FETC?", [](const char*) {
+		if (!latestValid) {
+			SetError(-230, "Data stale");
+			return;
+		}
+		PrintResult(latest.result);
+	}},
+	{"SWE:STAR", [](const char *arg) {
+		ParseUnsigned(arg, HardwareLimits::MinFrequency, HardwareLimits::MaxFrequency, sweepStart);
+	}},
+	{"SWE:STAR?", [](const char*) {
+		Print("%lu\n", sweepStart);
+	}},
+	{"SWE:STOP", [](const char *arg) {
+		ParseUnsigned(arg, HardwareLimits::MinFrequency, HardwareLimits::MaxFrequency, sweepStop);
+	}},
+	{"SWE:STOP?", [](const char*) {
+		Print("%lu\n", sweepStop);
+	}},
+	{"SWE:POIN", [](const char *arg) {
+		uint32_t value;
+		if (ParseUnsigned(arg, 2, MaxSweepPoints, value)) {
+			sweepPoints = value;
+		}
+	}},
+	{"SWE:POIN?", [](const char*) {
+		Print("%u\n", sweepPoints);
+	}},
+	{"SWE?", [](const char*) {
+		auto pointFrequency = [](uint16_t point) -> uint32_t {
+			return lroundf(sweepStart * powf((float) sweepStop / sweepStart,
+					(float) point / (sweepPoints - 1)));
+		};
+		// queue the next point while the current one is measured (see Frontend::Enqueue)
+		uint16_t firstId = NewIds(sweepPoints);
+		measuring = true;
+		Frontend::Start(GetSettings(pointFrequency(0), firstId));
+		Frontend::Enqueue(GetSettings(pointFrequency(1), firstId + 1));
+		for (uint16_t i = 0; i < sweepPoints; i++) {
+			Frontend::Result r;
+			if (!WaitResult(firstId + i, pointFrequency(i), r)) {
+				break;
+			}
+			if (i + 2 < sweepPoints) {
+				Frontend::Enqueue(GetSettings(pointFrequency(i + 2), firstId + i + 2));
+			}
+			PrintResult(r);
+		}
+		measuring = false;
+		ApplyMode();
+	}},
+	{"CAL", [](const char*) {
+		Frontend::Calibrate();
+	}},
+	{"STRE", [](const char *arg) {
+		bool enable;
+		if (!ParseBool(arg, enable) || enable == streaming) {
+			return;
+		}
+		if (enable) {
+			streamRecords = 0;
+			streamStart = xTaskGetTickCount();
+			streamOverruns = ResultBus::Overruns(subscriber);
+		}
+		streaming = enable;
+	}},
+	{"STRE:STAT?", [](const char*) {
+		uint32_t duration = xTaskGetTickCount() - streamStart;
+		uint32_t rate = duration ? (uint64_t) streamRecords * 1000 / duration : 0;
+		Print("%lu,%lu,%lu\n", streamRecords, rate, ResultBus::Overruns(subscriber) - streamOverruns);
+	}},
+	{"LOG", [](const char *arg) {
+		bool enable;
+		if (!ParseBool(arg, enable)) {
+			return;
+		}
+		if (!enable) {
+			DataLogger::Stop();
+		} else if (!DataLogger::Start()) {
+			SetError(-221, "Settings conflict");
+		}
+	}},
+	{"LOG:STAT?", [](const char*) {
+		auto s = DataLogger::GetStatistics();
+		Print("%u,%lu,%lu,%lu,%lu,%lu\n", DataLogger::Active(), s.records, s.rate, s.lost, s.flushes,
+				s.maxFlushTime);
+	}},
+	{"SYST:LOG?", [](const char*) {
+		log_statistics_t s;
+		log_get_statistics(&s);
+		log_reset_statistics();
+		uint32_t average = s.calls ? s.cycles / s.calls : 0;
+		Print("%lu,%lu,%lu\n", s.calls, average, s.maxCycles);
+	}},
+	{"SYST:ERR?", [](const char*) {
+		Print("%d,\"%s\"\n", errorCode, errorText);
+		errorCode = 0;
+		errorText = "No error";
+	}},
+};
+
+static void Execute(char *line) {
+	char *arg = strchr(line, ' ');
+	if (arg) {
+		*arg++ = 0;
+		while (*arg == ' ') {
+			arg++;
+		}
+	}
+	for (char *c = line; *c; c++) {
+		*c = toupper(*c);
+	}
+	for (auto &cmd : commands) {
+		if (!strcmp(line, cmd.header)) {
+			cmd.handler(arg);
+			return;
+		}
+	}
+	SetError(-113, "Undefined header");
+}
+
+static void remote_task(void*) {
+	char line[64];
+	uint8_t lineLen = 0;
+	uint32_t lastDropped = 0;
+	while (1) {
+		// retry pending data soon, USB completion does not notify the task
+		xTaskNotifyWait(0, 0, nullptr, txLen ? 1 : portMAX_DELAY);
+		while (rxRead != rxWrite) {
+			char c = rxBuffer[rxRead];
+			rxRead = (rxRead + 1) % RxBufferSize;
+			if (c == '\n' || c == '\r') {
+				if (lineLen) {
+					line[lineLen] = 0;
+					Execute(line);
+					lineLen = 0;
+				}
+			} else if (lineLen < sizeof(line) - 1) {
+				// overlong commands are truncated and result in an error
+				line[lineLen++] = c;
+			}
+		}
+		if (rxDropped != lastDropped) {
+			lastDropped = rxDropped;
+			SetError(-363, "Input buffer overrun");
+		}
+		ResultBus::Record r;
+		while (ResultBus::Read(subscriber, r)) {
+			HandleRecord(r);
+		}
+		if (txLen && !CDC_TxBusy_FS()) {
+			Flush(0);
+		}
+	}
+}
+
+void Remote::Pack(const ResultBus::Record &r, StreamRecord &s) {
+	s.sync = SyncWord;
+	s.sequence = r.sequence;
+	s.timestamp = r.timestamp;
+	s.frequency = r.result.frequency;
+	s.real = real(r.result.Z);
+	s.imag = imag(r.result.Z);
+	s.errorMag = r.result.errorMag;
+	s.errorPhase = r.result.errorPhase;
+	s.averages = r.result.averages;
+	s.id = r.result.id;
+	s.type = (uint8_t) r.result.type;
+	s.rtia = (uint8_t) r.result.rtia;
+}
+
+bool Remote::OwnsFrontend() {
+	return mode != Mode::Stopped || measuring;
+}
+
+void Remote::NotifyOnRelease(TaskHandle_t task) {
+	releaseNotify = task;
+}
+
+bool Remote::Init() {
+	uint16_t size;
+	uint8_t *buf = CDC_TxBuffer_FS(&size);
+	txSize = size / 2;
+	txBuffer[0] = buf;
+	txBuffer[1] = buf + txSize;
+	taskHandle = xTaskCreateStatic(remote_task, "Remote", stack_size_words, nullptr, 2, task_stack,
+			&task);
+	subscriber = ResultBus::Subscribe(taskHandle);
+	return subscriber >= 0;
+}
+
+void Remote_Received(const uint8_t *buf, uint32_t len) {
+	for (uint32_t i = 0; i < len; i++) {
+		uint16_t next = (rxWrite + 1) % RxBufferSize;
+		if (next == rxRead) {
+			rxDropped += len - i;
+			break;
+		}
+		rxBuffer[rxWrite] = buf[i];
+		rxWrite = next;
+	}
+	if (taskHandle) {
+		BaseType_t woken = pdFALSE;
+		xTaskNotifyFromISR(taskHandle, 0, eNoAction, &woken);
+		portYIELD_FROM_ISR(woken);
+	}
+}
@@ -0,0 +1,81 @@
+/*
+ * Remote control over the USB CDC interface.
+ *
+ * Text commands (SCPI style, terminated by '\n', case insensitive):
+ *   *IDN?                      identification
+ *   FREQ <Hz> / FREQ?          measurement frequency
+ *   BIAS <V> / BIAS?           bias voltage
+ *   VOLT <V> / VOLT?           excitation amplitude
+ *   AVER <n> / AVER?           number of averages
+ *   INIT / ABOR                start continuous measurement / return the frontend to local operation
+ *   ARM / *TRG                 single shot mode: configure and wait / trigger one measurement
+ *   READ?                      measure once and return the result
+ *   FETC?                      return the latest result
+ *   SWE:STAR <Hz> / SWE:STOP <Hz> / SWE:POIN <n>
+ *   SWE?                       run a logarithmic sweep, one result line per point
+ *   CAL                        calibrate the frontend (inputs must be shorted)
+ *   STRE ON|OFF / STRE:STAT?   binary result streaming / streaming statistics
+ *   LOG ON|OFF / LOG:STAT?     log results to the SD card / "active,records,rate,lost,writes,longest write"
+ *   SYST:ERR?                  last error
+ *   SYST:LOG?                  debug log calls, average and longest call in CPU cycles since the last query
+ * Results are returned as "frequency,real,imag,type,averages".
+ *
+ * The remote control owns the frontend from INIT or ARM until ABOR and while READ? or SWE? are measuring.
+ * Otherwise the frontend runs the local measurement, FREQ/BIAS/VOLT/AVER only store the remote settings.
+ *
+ * Binary streaming sends every result of the frontend as a packed little endian record (see
+ * Remote::StreamRecord). While streaming, only commands without response should be sent.
+ */
+
+#ifndef REMOTE_H_
+#define REMOTE_H_
+
+#ifdef __cplusplus
+#include <cstdint>
+#include "ResultBus.hpp"
+#include "FreeRTOS.h"
+#include "task.h"
+namespace Remote {
+
+using StreamRecord = struct __attribute__((packed)) streamrecord {
+	// always SyncWord, allows resynchronization of the host
+	uint16_t sync;
+	// consecutive number of the result, gaps indicate lost results
+	uint32_t sequence;
+	// time of the result in ms
+	uint32_t timestamp;
+	uint32_t frequency;
+	float real, imag;
+	// relative standard error of |Z|, standard error of the phase in radians
+	float errorMag, errorPhase;
+	uint32_t averages;
+	uint16_t id;
+	// Frontend::ResultType
+	uint8_t type;
+	// TIA gain setting (ad5940_hsrtia_t)
+	uint8_t rtia;
+};
+
+static constexpr uint16_t SyncWord = 0x5AA5;
+
+bool Init();
+// The local measurement must not configure the frontend while this returns true
+bool OwnsFrontend();
+// Task to notify when the remote control hands the frontend back to the local measurement
+void NotifyOnRelease(TaskHandle_t task);
+// Converts a result into the streaming format (also used by the SD card logger)
+void Pack(const ResultBus::Record &r, StreamRecord &s);
+
+}
+
+extern "C" {
+#else
+#include <stdint.h>
+#endif
+// Called by the USB CDC driver (interrupt context) with received data
+void Remote_Received(const uint8_t *buf, uint32_t len);
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* REMOTE_H_ */
@@ -0,0 +1,105 @@
+#include "ResultBus.hpp"
+
+#include "stm.h"
+
+using Slot = struct {
+	// number of the stored record, Writing while the record is being updated
+	volatile uint32_t sequence;
+	ResultBus::Record record;
+};
+
+using Subscriber = struct {
+	bool used;
+	// number of the next record to read
+	uint32_t cursor;
+	uint32_t overruns;
+	TaskHandle_t task;
+};
+
+static constexpr uint32_t Writing = UINT32_MAX;
+
+static Slot slots[ResultBus::Size];
+// number of published records
+static volatile uint32_t head = 0;
+static Subscriber subscribers[ResultBus::MaxSubscribers];
+
+int8_t ResultBus::Subscribe(TaskHandle_t notify) {
+	int8_t ret = -1;
+	taskENTER_CRITICAL();
+	for (uint8_t i = 0; i < MaxSubscribers; i++) {
+		if (!subscribers[i].used) {
+			subscribers[i].cursor = head;
+			subscribers[i].overruns = 0;
+			subscribers[i].task = notify;
+			subscribers[i].used = true;
+			ret = i;
+			break;
+		}
+	}
+	taskEXIT_CRITICAL();
+	return ret;
+}
+
+void ResultBus::Unsubscribe(int8_t subscriber) {
+	if (subscriber >= 0 && subscriber < MaxSubscribers) {
+		subscribers[subscriber].used = false;
+	}
+}
+
+bool ResultBus::Read(int8_t subscriber, Record &r) {
+	if (subscriber < 0 || subscriber >= MaxSubscribers || !subscribers[subscriber].used) {
+		return false;
+	}
+	auto &sub = subscribers[subscriber];
+	while (sub.cursor != head) {
+		uint32_t available = head - sub.cursor;
+		if (available > Size) {
+			// the oldest records have already been overwritten
+			sub.overruns += available - Size;
+			sub.cursor += available - Size;
+		}
+		/*
+		 * Lock free read: the record is only valid if the sequence number of the slot matches before
+		 * and after copying. Otherwise the producer is (or was) overwriting it, the record is lost
+		 */
+		auto &slot = slots[sub.cursor % Size];
+		if (slot.sequence == sub.cursor) {
+			__DMB();
+			r = slot.record;
+			__DMB();
+			if (slot.sequence == sub.cursor) {
+				sub.cursor++;
+				return true;
+			}
+		}
+		sub.overruns++;
+		sub.cursor++;
+	}
+	return false;
+}
+
+uint32_t ResultBus::Overruns(int8_t subscriber) {
+	if (subscriber < 0 || subscriber >= MaxSubscribers) {
+		return 0;
+	}
+	return subscribers[subscriber].overruns;
+}
+
+void ResultBus::Publish(const Frontend::Result &r) {
+	uint32_t n = head;
+	auto &slot = slots[n % Size];
+	slot.sequence = Writing;
+	__DMB();
+	slot.record.sequence = n;
+	slot.record.timestamp = xTaskGetTickCount() * portTICK_PERIOD_MS;
+	slot.record.result = r;
+	__DMB();
+	slot.sequence = n;
+	__DMB();
+	head = n + 1;
+	for (uint8_t i = 0; i < MaxSubscribers; i++) {
+		if (subscribers[i].used && subscribers[i].task) {
+			xTaskNotify(subscribers[i].task, 0, eNoAction);
+		}
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <stdint.h>
+#include "Frontend.hpp"
+#include "FreeRTOS.h"
+#include "task.h"
+
+/*
+ * Distributes the measurement results of the frontend to any number of consumers (display, logging,
+ * streaming). The results are kept in a ring buffer, every subscriber reads at its own pace with its
+ * own cursor. A subscriber that falls behind by more than the ring size loses the oldest results,
+ * these are counted as overruns.
+ */
+namespace ResultBus {
+
+using Record = struct record {
+	// consecutive number of the result, gaps indicate overruns
+	uint32_t sequence;
+	// time of the result in ms
+	uint32_t timestamp;
+	Frontend::Result result;
+};
+
+static constexpr uint8_t Size = 16;
+static constexpr uint8_t MaxSubscribers = 4;
+
+/*
+ * Registers a consumer, it receives all results published from now on. The task (if not nullptr) is
+ * notified on every new result. Returns the subscriber index or -1 if all subscriber slots are in use
+ */
+int8_t Subscribe(TaskHandle_t notify = nullptr);
+void Unsubscribe(int8_t subscriber);
+// Copies the oldest not yet read result, returns false if there is none
+bool Read(int8_t subscriber, Record &r);
+// Number of results this subscriber has lost because the ring buffer was overwritten
+uint32_t Overruns(int8_t subscriber);
+// Adds a new result, must only be called by the frontend task (single producer)
+void Publish(const Frontend::Result &r);
+
+}
@@ -9,9 +9,13 @@
 #include "gui.hpp"
 #include "touch.h"
 #include "Config.hpp"
+#include "file.hpp"
 #include "Persistence.hpp"
 #include "LCR.hpp"
 #include "Frontend.hpp"
+#include "Compensation.hpp"
+#include "Remote.h"
+#include "DataLogger.hpp"
 #include "Sound.h"
 
 extern ADC_HandleTypeDef hadc1;
@@ -47,6 +51,7 @@ constexpr Test Selftests[] = {
 		{"3V3 rail", VCCRail},
 		{"Frontend init", Frontend::Init},
 		{"Touch thread:", input_Init},
+		{"Compensation:", Compensation::Init},
 		{"Persistance:", Persistence::Load},
 };
 constexpr uint8_t nTests = sizeof(Selftests) / sizeof(Selftests[0]);
@@ -59,6 +64,10 @@ void Start() {
 	touch_Init();
 
 	xMutexSPI1 = xSemaphoreCreateMutexStatic(&xSemSPI1);
+	// the SD card is optional (only needed for loading files)
+	if (File::Init() != FR_OK) {
+		LOG(Log_App, LevelWarn, "Failed to mount SD card");
+	}
 
 	// initialize display
 	//vTaskDelay(1);
@@ -137,6 +146,11 @@ void Start() {
 
 //	Config::Load("default.cfg");
 	LCR::Init();
+	Remote::Init();
+	DataLogger::Init();
+	// headroom for the SD card logger buffers and the dialogs allocated at runtime
+	LOG(Log_App, LevelInfo, "Free heap: %u bytes, minimum %u bytes", xPortGetFreeHeapSize(),
+			xPortGetMinimumEverFreeHeapSize());
 
 	LCR::Run(); // does not return
 	while(1) {
@@ -1,6 +1,7 @@
 #include "Sweep.hpp"
 #include "gui.hpp"
 #include "HardwareLimits.hpp"
+#include "Compensation.hpp"
 #include "log.h"
 #include "cast.hpp"
 
@@ -16,9 +17,10 @@ static constexpr char *scaleTypeNames[] = { "Linear", "Log", nullptr };
 Sweep::Sweep(coords_t size, Menu &menu, Config c) {
 	this->size = size;
 	config = c;
-	initialSweep = true;
-	pointCnt = 0;
 	marker = 0;
+	pointStart = 0;
+	ResetPoints();
+	BuildPlan();
 	// Create menu entries
 	mConfig = new Menu("Sweep", menu.getSize());
 	// X axis menu
@@ -36,13 +38,20 @@ Sweep::Sweep(coords_t size, Menu &menu, Config c) {
 	mX->AddEntry(mXmin);
 	mX->AddEntry(mXmax);
 	mX->AddEntry(mPoints);
+	auto mAdaptive = new MenuBool("Adaptive", &config.X.adaptive,
+			pmf_cast<void (*)(void*, Widget *w), Sweep, &Sweep::MayorSettingChanged>::cfn, this);
+	auto mResolution = new MenuValue<int32_t>("Resolution", &config.X.resolution, Unit::Percent,
+			pmf_cast<void (*)(void*, Widget *w), Sweep, &Sweep::MayorSettingChanged>::cfn, this,
+			Unit::maxPercent / 10000, Unit::maxPercent / 10);
 	mX->AddEntry(mXScale);
+	mX->AddEntry(mAdaptive);
+	mX->AddEntry(mResolution);
 	mX->AddEntry(new MenuBack());
 	// Primary and secondary Y axis menu
 	Menu *mAxis[2];
 	for (uint8_t i = 0; i < 2; i++) {
 		auto mVar = new MenuChooser("Variable", variableNames, (uint8_t*) &config.axis[i].var,
-				pmf_cast<void (*)(void*, Widget *w), Sweep, &Sweep::MayorSettingChanged>::cfn, this);
+				pmf_cast<void (*)(void*, Widget *w), Sweep, &Sweep::MinorSettingChanged>::cfn, this);
 		auto mMin = new MenuValue<float>("Y min", &config.axis[i].min, Unit::None,
 				pmf_cast<void (*)(void*, Widget *w), Sweep, &Sweep::MinorSettingChanged>::cfn, this);
 		auto mMax = new MenuValue<float>("Y max", &config.axis[i].max, Unit::None,
@@ -67,7 +76,15 @@ Sweep::Sweep(coords_t size, Menu &menu, Config c) {
 	auto mBias = new MenuValue<uint32_t>("Bias", &config.biasVoltage, Unit::Voltage,
 			pmf_cast<void (*)(void*, Widget *w), Sweep, &Sweep::MinorSettingChanged>::cfn, this,
 			HardwareLimits::MinBiasVoltage, HardwareLimits::MaxBiasVoltage);
+	auto mErr = new MenuValue<int32_t>("Target err.", &config.targetError, Unit::Percent,
+			pmf_cast<void (*)(void*, Widget *w), Sweep, &Sweep::MinorSettingChanged>::cfn, this, 0,
+			Unit::maxPercent / 10);
 	mAcq->AddEntry(mAvg);
+	auto mTime = new MenuValue<int32_t>("Sweep time", &config.sweepTime, Unit::Time,
+			pmf_cast<void (*)(void*, Widget *w), Sweep, &Sweep::MinorSettingChanged>::cfn, this, 0,
+			2000000000);
+	mAcq->AddEntry(mErr);
+	mAcq->AddEntry(mTime);
 	mAcq->AddEntry(mExc);
 	mAcq->AddEntry(mBias);
 	mAcq->AddEntry(new MenuBack());
@@ -87,78 +104,312 @@ Frontend::settings Sweep::GetAcquisitionSettings() {
 	Frontend::settings s;
 	s.biasVoltage = config.biasVoltage;
 	s.excitationVoltage = config.excitationVoltage;
-	s.averages = config.averages;
+	s.targetError = config.targetError / 100000000.0f;
+	s.abortInvalid = true;
+	s.id = 0;
 	s.range = config.range;
-	s.frequency = PointToFrequency(pointCnt >= config.X.points ? 0 : pointCnt);
+	uint16_t point = pointCnt;
+	Frontend::PreparePlanEntry(points[point].frequency, plan);
+	s.frequency = plan.frequency;
+	s.plan = &plan;
+	s.rangeHint = points[point].rtia;
+	s.averages = ScheduledAverages(point);
+	pointStart = xTaskGetTickCount();
 	return s;
 }
 
+void Sweep::ResetPoints() {
+	numPoints = config.X.points;
+	pointCnt = 0;
+	lastPoint = -1;
+	timeScale = 1.0f;
+	StartPass();
+	for (uint16_t i = 0; i < MaxDataPoints; i++) {
+		points[i].noise = 0.0f;
+		points[i].rtia = AD5940_HSRTIA_OPEN;
+		points[i].valid = false;
+		points[i].pending = true;
+		points[i].refine = false;
+	}
+}
+
+void Sweep::SetFrequency(uint16_t point, uint32_t frequency) {
+	Frontend::PlanEntry e;
+	Frontend::PreparePlanEntry(frequency, e);
+	points[point].frequency = frequency;
+	points[point].sampleTime = Frontend::SampleTime(e);
+}
+
+void Sweep::BuildPlan() {
+	for (uint16_t i = 0; i < config.X.points; i++) {
+		SetFrequency(i, PointToFrequency(i));
+	}
+}
+
+void Sweep::StartPass() {
+	passStart = xTaskGetTickCount();
+}
+
+uint32_t Sweep::ScheduledAverages(uint16_t point) {
+	if (!config.sweepTime) {
+		return config.averages;
+	}
+	int32_t remaining_us = config.sweepTime
+			- (int32_t) ((xTaskGetTickCount() - passStart) * portTICK_PERIOD_MS * 1000);
+	if (remaining_us <= 0) {
+		return 1;
+	}
+	/*
+	 * Minimizing the summed error variance of all points within the time budget results in averages
+	 * proportional to noise / sqrt(sample time). Points without a noise estimate (first pass) use the
+	 * mean noise of the other points.
+	 */
+	float noiseSum = 0.0f;
+	uint16_t noiseCnt = 0;
+	for (uint16_t i = 0; i < numPoints; i++) {
+		if (points[i].pending && points[i].noise > 0.0f) {
+			noiseSum += points[i].noise;
+			noiseCnt++;
+		}
+	}
+	float defaultNoise = noiseCnt ? noiseSum / noiseCnt : 1.0f;
+	float sum = 0.0f;
+	for (uint16_t i = 0; i < numPoints; i++) {
+		if (points[i].pending) {
+			float noise = points[i].noise > 0.0f ? points[i].noise : defaultNoise;
+			sum += noise * sqrtf(points[i].sampleTime * timeScale);
+		}
+	}
+	float noise = points[point].noise > 0.0f ? points[point].noise : defaultNoise;
+	float averages = remaining_us * noise / sqrtf(points[point].sampleTime * timeScale) / sum;
+	if (averages < 1.0f) {
+		return 1;
+	} else if (averages > MaxScheduledAverages) {
+		return MaxScheduledAverages;
+	}
+	return averages;
+}
+
+uint32_t Sweep::RemainingTime() {
+	uint32_t minimum_us = 0;
+	uint32_t configured_us = 0;
+	for (uint16_t i = 0; i < numPoints; i++) {
+		if (points[i].pending) {
+			uint32_t sample_us = points[i].sampleTime * timeScale;
+			minimum_us += sample_us;
+			configured_us += sample_us * config.averages;
+		}
+	}
+	uint32_t elapsed_ms = (xTaskGetTickCount() - pointStart) * portTICK_PERIOD_MS;
+	uint32_t remaining_ms;
+	if (config.sweepTime) {
+		// the schedule uses up the remaining budget, but every point needs at least one sample
+		uint32_t pass_ms = (xTaskGetTickCount() - passStart) * portTICK_PERIOD_MS;
+		uint32_t budget_ms = config.sweepTime / 1000;
+		remaining_ms = budget_ms > pass_ms ? budget_ms - pass_ms : 0;
+		if (remaining_ms < minimum_us / 1000) {
+			remaining_ms = minimum_us / 1000;
+		}
+	} else {
+		remaining_ms = configured_us / 1000;
+	}
+	// part of the current point has already been measured
+	return remaining_ms > elapsed_ms ? remaining_ms - elapsed_ms : 0;
+}
+
 uint32_t Sweep::PointToFrequency(uint16_t point) {
-	switch (config.X.type) {
+	// the coarse grid of an adaptive sweep is always logarithmic
+	auto type = config.X.adaptive ? ScaleType::Log : config.X.type;
+	switch (type) {
 	case ScaleType::Linear:
 		return util_Map(point, 0, config.X.points - 1, config.X.f_min, config.X.f_max);
 	case ScaleType::Log:
-		float b = log(config.X.f_max / config.X.f_min) / (config.X.points - 1);
+		float b = log((float) config.X.f_max / config.X.f_min) / (config.X.points - 1);
 		return config.X.f_min * exp(b * point);
 	}
 }
 
-bool Sweep::AddResult(LCR::Result r) {
-	if (pointCnt >= config.X.points) {
-		// wrap around to beginning
-		pointCnt = 0;
-		initialSweep = false;
+int16_t Sweep::FrequencyToX(uint32_t frequency, int16_t left, int16_t right) {
+	switch (config.X.type) {
+	case ScaleType::Linear:
+	default:
+		return util_Map(frequency, config.X.f_min, config.X.f_max, left, right);
+	case ScaleType::Log:
+		return left + (right - left) * log((float) frequency / config.X.f_min)
+				/ log((float) config.X.f_max / config.X.f_min);
 	}
-	if (!points) {
-		LOG(Log_Sweep, LevelWarn, "Unable to add point, no memory");
+}
+
+bool Sweep::AddResult(const Frontend::Result &r) {
+	if (r.frequency != points[pointCnt].frequency) {
+		// measurement was started before the sweep setup changed
 		return false;
 	}
-	// extract the correct variables
-	for(uint8_t i=0;i<2;i++) {
-		float var;
-		switch(config.axis[i].var) {
-		case Variable::Magnitude:
-			var = abs(r.frontend.Z);
-			break;
-		case Variable::Phase:
-			var = 180.0f / M_PI * arg(r.frontend.Z);
-			break;
-		case Variable::Resistance:
-			var = real(r.Z);
-			break;
-		case Variable::Capacitance:
-			var = r.C.capacitance;
-			break;
-		case Variable::Inductance:
-			var = r.L.inductance;
-			break;
-		case Variable::ESR:
-			var = real(r.frontend.Z);
-			break;
-		case Variable::Quality:
-			var = r.qualityFactor;
-			break;
-		default:
-			var = 0.0f;
-		}
-		points[pointCnt].y[i] = var;
+	points[pointCnt].Z = r.Z;
+	points[pointCnt].frequency = r.frequency;
+	points[pointCnt].rtia = r.rtia;
+	points[pointCnt].type = r.type;
+	points[pointCnt].valid = true;
+	points[pointCnt].pending = false;
+	// track the actual measurement time and the noise for scheduling the averages
+	uint32_t elapsed_us = (xTaskGetTickCount() - pointStart) * portTICK_PERIOD_MS * 1000;
+	uint32_t expected_us = r.averages * points[pointCnt].sampleTime;
+	if (expected_us) {
+		timeScale += 0.2f * ((float) elapsed_us / expected_us - timeScale);
+	}
+	if (r.averages >= 2 && std::isfinite(r.errorMag)) {
+		points[pointCnt].noise = r.errorMag * sqrtf(r.averages);
 	}
-	pointCnt++;
+	lastPoint = pointCnt;
 	LOG(Log_Sweep, LevelDebug, "Added datapoint %d", pointCnt);
+	pointCnt = NextPoint();
 	return true;
 }
 
+uint16_t Sweep::NextPoint() {
+	for (uint16_t i = 0; i < numPoints; i++) {
+		if (points[i].pending) {
+			return i;
+		}
+	}
+	// all points of this pass have been measured
+	if (!config.X.adaptive || !Refine()) {
+		// start the next pass over all points
+		for (uint16_t i = 0; i < numPoints; i++) {
+			points[i].pending = true;
+		}
+		StartPass();
+	}
+	for (uint16_t i = 0; i < numPoints; i++) {
+		if (points[i].pending) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+uint16_t Sweep::Refine() {
+	// phase zero crossings only count if the impedance is not purely resistive
+	constexpr float MinPhase = 5.0f * M_PI / 180.0f;
+	// minimum change of |Z| on both sides of an extremum, relative (natural logarithm)
+	constexpr float MinExtremumChange = 0.01f;
+	// maximum change of the slope of |Z| over frequency (both logarithmic) between neighbouring intervals
+	constexpr float MaxSlopeChange = 0.5f;
+
+	auto usable = [this](uint16_t i) -> bool {
+		return points[i].valid && points[i].type == Frontend::ResultType::Valid;
+	};
+	// mark intervals that need refinement, points[i].refine refers to the interval [i, i+1]
+	for (uint16_t i = 0; i < numPoints; i++) {
+		points[i].refine = false;
+	}
+	for (uint16_t i = 0; i + 1 < numPoints; i++) {
+		if (!usable(i) || !usable(i + 1)) {
+			continue;
+		}
+		float p1 = arg(Impedance(i));
+		float p2 = arg(Impedance(i + 1));
+		if ((p1 < 0.0f) != (p2 < 0.0f) && (abs(p1) > MinPhase || abs(p2) > MinPhase)) {
+			// phase zero crossing (resonance)
+			points[i].refine = true;
+		}
+		if (i == 0 || !usable(i - 1)) {
+			continue;
+		}
+		float m0 = log(abs(Impedance(i - 1)));
+		float m1 = log(abs(Impedance(i)));
+		float m2 = log(abs(Impedance(i + 1)));
+		float s1 = (m1 - m0) / log((float) points[i].frequency / points[i - 1].frequency);
+		float s2 = (m2 - m1) / log((float) points[i + 1].frequency / points[i].frequency);
+		bool extremum = (m1 - m0) * (m2 - m1) < 0.0f && abs(m1 - m0) > MinExtremumChange
+				&& abs(m2 - m1) > MinExtremumChange;
+		if (extremum || abs(s2 - s1) > MaxSlopeChange) {
+			points[i - 1].refine = true;
+			points[i].refine = true;
+		}
+	}
+	// insert the geometric center of every marked interval, starting at the end to keep the indices valid
+	uint16_t inserted = 0;
+	for (int16_t i = numPoints - 2; i >= 0 && numPoints < MaxDataPoints; i--) {
+		if (!points[i].refine) {
+			continue;
+		}
+		uint32_t f1 = points[i].frequency;
+		uint32_t f2 = points[i + 1].frequency;
+		if ((uint64_t) (f2 - f1) * 100000000ULL <= (uint64_t) f1 * config.X.resolution) {
+			// resolution already reached
+			continue;
+		}
+		uint32_t f = sqrt((float) f1 * f2);
+		if (f <= f1 || f >= f2) {
+			continue;
+		}
+		for (uint16_t j = numPoints; j > i + 1; j--) {
+			points[j] = points[j - 1];
+		}
+		numPoints++;
+		Datapoint &p = points[i + 1];
+		SetFrequency(i + 1, f);
+		// start with the range of the neighbouring point
+		p.rtia = points[i].rtia;
+		p.noise = points[i].noise;
+		p.valid = false;
+		p.pending = true;
+		p.refine = false;
+		if (marker > i) {
+			marker++;
+		}
+		if (lastPoint > i) {
+			lastPoint++;
+		}
+		inserted++;
+	}
+	if (inserted) {
+		LOG(Log_Sweep, LevelDebug, "Refinement added %u points, %u in total", inserted, numPoints);
+	}
+	return inserted;
+}
+
+std::complex<float> Sweep::Impedance(uint16_t point) {
+	return Compensation::Apply(points[point].Z, points[point].frequency);
+}
+
+float Sweep::GetValue(uint16_t point, Variable var) {
+	Frontend::Result f;
+	f.Z = Impedance(point);
+	f.frequency = points[point].frequency;
+	auto r = LCR::ComponentValues(f);
+	switch(var) {
+	case Variable::Magnitude:
+		return abs(r.frontend.Z);
+	case Variable::Phase:
+		return 180.0f / M_PI * arg(r.frontend.Z);
+	case Variable::Resistance:
+		return real(r.Z);
+	case Variable::Capacitance:
+		return r.C.capacitance;
+	case Variable::Inductance:
+		return r.L.inductance;
+	case Variable::ESR:
+		return real(r.frontend.Z);
+	case Variable::Quality:
+		return r.qualityFactor;
+	default:
+		return 0.0f;
+	}
+}
+
 void Sweep::draw(coords_t offset) {
 	size = getSize();
 	auto pos = offset;
 	coords_t graphTopLeft = pos + COORDS(Font_Medium.height + 2, 0);
 	coords_t graphBottomRight = pos + size - COORDS(Font_Medium.height + 2, 2 * Font_Medium.height + 2);
 
-	uint16_t markerX = util_Map(marker, 0, config.X.points - 1, graphTopLeft.x + 1, graphBottomRight.x - 1);
+	uint16_t markerX = FrequencyToX(points[marker].frequency, graphTopLeft.x + 1, graphBottomRight.x - 1);
 
 	auto GetPointCoordinate = [this, graphTopLeft, graphBottomRight](uint8_t axis, uint16_t point) -> coords_t {
 		coords_t p;
-		float val = points[point].y[axis];
+		float val = GetValue(point, config.axis[axis].var);
 		// constrain value to limits
 		if (val < config.axis[axis].min) {
 			val = config.axis[axis].min;
@@ -166,7 +417,7 @@ void Sweep::draw(coords_t offset) {
 		if (val > config.axis[axis].max) {
 			val = config.axis[axis].max;
 		}
-		p.x = util_Map(point, 0, config.X.points - 1, graphTopLeft.x + 1, graphBottomRight.x - 1);
+		p.x = FrequencyToX(points[point].frequency, graphTopLeft.x + 1, graphBottomRight.x - 1);
 		if (config.axis[axis].type == ScaleType::Linear) {
 			p.y = util_MapF(val, config.axis[axis].min, config.axis[axis].max, graphBottomRight.y - 1,
 					graphTopLeft.y + 1);
@@ -235,7 +486,7 @@ void Sweep::draw(coords_t offset) {
 		display_SetForeground(COLOR_BLACK);
 		display_String(2, pos.y + size.y - Font_Medium.height, "Marker:");
 		char freq[10];
-		Unit::StringFromValue(freq, 8, PointToFrequency(marker), Unit::Frequency);
+		Unit::StringFromValue(freq, 8, points[marker].frequency, Unit::Frequency);
 		display_SetForeground(ColorAxis);
 		display_String(50, pos.y + size.y - Font_Medium.height, freq);
 
@@ -250,51 +501,86 @@ void Sweep::draw(coords_t offset) {
 			} else {
 				display_SetForeground(ColorSecondary);
 			}
-			uint16_t highestPoint = initialSweep ? pointCnt : config.X.points;
-			for (uint16_t i = 1; i < highestPoint; i++) {
-				coords_t from = GetPointCoordinate(axis, i - 1);
-				coords_t to = GetPointCoordinate(axis, i);
-				display_Line(from.x, from.y, to.x, to.y);
+			int16_t prev = -1;
+			for (uint16_t i = 0; i < numPoints; i++) {
+				if (!points[i].valid) {
+					continue;
+				}
+				if (prev >= 0) {
+					coords_t from = GetPointCoordinate(axis, prev);
+					coords_t to = GetPointCoordinate(axis, i);
+					display_Line(from.x, from.y, to.x, to.y);
+				}
+				prev = i;
 			}
 		}
 	} else {
-		// only update latest datapoint
-		if (pointCnt > 1) {
-			bool cleared = false;
+		// only update latest datapoint and its connections to the neighbouring points
+		int16_t prev = lastPoint - 1;
+		while (prev >= 0 && !points[prev].valid) {
+			prev--;
+		}
+		int16_t next = lastPoint + 1;
+		while (next < numPoints && !points[next].valid) {
+			next++;
+		}
+		if (next >= numPoints) {
+			next = -1;
+		}
+		if (lastPoint >= 0 && (prev >= 0 || next >= 0)) {
+			// clear the old lines
+			int16_t x0 = graphTopLeft.x + 1;
+			int16_t x1 = GetPointCoordinate(0, lastPoint).x + 5;
+			if (prev >= 0) {
+				x0 = GetPointCoordinate(0, prev).x + 1;
+			}
+			if (next >= 0) {
+				x1 = GetPointCoordinate(0, next).x - 1;
+			}
+			if (x1 >= graphBottomRight.x) {
+				x1 = graphBottomRight.x - 1;
+			}
+			if (x1 >= x0) {
+				display_SetForeground(ColorBackground);
+				display_RectangleFull(x0, graphTopLeft.y + 1, x1, graphBottomRight.y - 1);
+				if (markerX >= x0 && markerX <= x1) {
+					// marker has been cleared, redraw
+					display_SetForeground(ColorMarker);
+					display_VerticalLine(markerX, graphTopLeft.y, graphBottomRight.y - graphTopLeft.y);
+				}
+			}
 			for (uint8_t axis = 0; axis < 2; axis++) {
 				if (config.axis[axis].var == Variable::None) {
 					// this axis is not active
 					continue;
 				}
-				coords_t from = GetPointCoordinate(axis, pointCnt - 2);
-				coords_t to = GetPointCoordinate(axis, pointCnt - 1);
-				if (!cleared) {
-					display_SetForeground(ColorBackground);
-					uint16_t x1 = GetPointCoordinate(axis, pointCnt).x;
-					if (x1 - from.x < 5) {
-						x1 = from.x + 5;
-					}
-					if (x1 >= graphBottomRight.x) {
-						x1 = graphBottomRight.x - 1;
-					}
-					display_RectangleFull(from.x + 1, graphTopLeft.y + 1, x1, graphBottomRight.y - 1);
-					if (markerX >= from.x + 1 && markerX <= x1) {
-						// marker has been cleared, redraw
-						display_SetForeground(ColorMarker);
-						display_VerticalLine(markerX, graphTopLeft.y, graphBottomRight.y - graphTopLeft.y);
-					}
-					cleared = true;
-				}
 				if (axis == 0) {
 					display_SetForeground(ColorPrimary);
 				} else {
 					display_SetForeground(ColorSecondary);
 				}
-				display_Line(from.x, from.y, to.x, to.y);
+				coords_t point = GetPointCoordinate(axis, lastPoint);
+				if (prev >= 0) {
+					coords_t from = GetPointCoordinate(axis, prev);
+					display_Line(from.x, from.y, point.x, point.y);
+				}
+				if (next >= 0) {
+					coords_t to = GetPointCoordinate(axis, next);
+					display_Line(point.x, point.y, to.x, to.y);
+				}
 			}
 		}
 	}
 
+	// remaining time of the current pass
+	uint32_t eta = RemainingTime() / 1000;
+	char etaString[12];
+	snprintf(etaString, sizeof(etaString), "ETA %3lu:%02lu", eta / 60, eta % 60);
+	display_SetFont(Font_Medium);
+	display_SetForeground(ColorAxis);
+	display_String(graphBottomRight.x - strlen(etaString) * Font_Medium.width - 2, graphTopLeft.y + 2,
+			etaString);
+
 	// always update the marker variables
 	display_SetFont(Font_Medium);
 	for (uint8_t i = 0; i < 2; i++) {
@@ -304,21 +590,22 @@ void Sweep::draw(coords_t offset) {
 			display_SetForeground(ColorSecondary);
 		}
 		char buf[10];
-		if (pointCnt <= marker && initialSweep) {
+		if (!points[marker].valid) {
 			// no data available at marker position yet
 			strcpy(buf, "?.???");
 		} else {
-			Unit::SIStringFromFloat(buf, 7, points[marker].y[i]);
+			Unit::SIStringFromFloat(buf, 7, GetValue(marker, config.axis[i].var));
 		}
 		display_String(120 + i * 70, pos.y + size.y - Font_Medium.height, buf);
 	}
 }
 
 void Sweep::MayorSettingChanged(Widget *w) {
-	initialSweep = true;
-	pointCnt = 0;
-	if (marker >= config.X.points) {
-		marker = config.X.points - 1;
+	// frequencies of the points have changed
+	ResetPoints();
+	BuildPlan();
+	if (marker >= numPoints) {
+		marker = numPoints - 1;
 	}
 	// TODO check settings
 	requestRedrawFull();
@@ -344,11 +631,15 @@ void Sweep::input(GUIEvent_t *ev) {
 		// Calculate new marker position
 		uint16_t xLeft = Font_Medium.height + 3;
 		uint16_t xRight = size.x - (Font_Medium.height + 3);
-		int16_t marker_new = util_Map(ev->pos.x, xLeft, xRight, 0, config.X.points - 1);
-		if (marker_new < 0) {
-			marker_new = 0;
-		} else if (marker_new >= config.X.points) {
-			marker_new = config.X.points - 1;
+		// select the closest point, points are not equally spaced in adaptive mode
+		uint16_t marker_new = 0;
+		uint16_t distance = UINT16_MAX;
+		for (uint16_t i = 0; i < numPoints; i++) {
+			uint16_t d = abs(FrequencyToX(points[i].frequency, xLeft, xRight) - ev->pos.x);
+			if (d < distance) {
+				distance = d;
+				marker_new = i;
+			}
 		}
 		if (marker_new != marker) {
 			marker = marker_new;
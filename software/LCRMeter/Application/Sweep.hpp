@@ -34,15 +34,25 @@ public:
 			uint32_t f_max;
 			ScaleType type;
 			uint16_t points;
+			// adaptive mode: refine the sweep around resonances (points is the number of coarse points)
+			bool adaptive;
+			// smallest relative frequency step of the refinement (1% = 1000000)
+			int32_t resolution;
 		} X;
 		YAxis axis[2];
 		uint32_t biasVoltage;
 		uint32_t excitationVoltage;
 		Frontend::Range range;
 		uint16_t averages;
+		// target error for adaptive averaging (1% = 1000000, 0 disables adaptive averaging)
+		int32_t targetError;
+		// time budget of one sweep pass in us, distributes the averages across the points (0 uses
+		// the configured averages for every point)
+		int32_t sweepTime;
 	};
 	static constexpr Config defaultConfig = {
-			.X = {.f_min = 100, .f_max = 100000, .type = ScaleType::Linear, .points=101},
+			.X = {.f_min = 100, .f_max = 100000, .type = ScaleType::Linear, .points=101, .adaptive = false,
+					.resolution = 1000000},
 			.axis = {
 					{.min = 0.0f, .max = 10.0f, .type = ScaleType::Linear, .var = Variable::Magnitude},
 					{.min = 0.0f, .max = 10.0f, .type = ScaleType::Linear, .var = Variable::ESR},
@@ -51,12 +61,14 @@ public:
 			.excitationVoltage = 100000,
 			.range = Frontend::Range::AUTO,
 			.averages = 1,
+			.targetError = 0,
+			.sweepTime = 0,
 	};
 
 	Sweep(coords_t size, Menu &menu, Config c = defaultConfig);
 	~Sweep();
 	Frontend::settings GetAcquisitionSettings();
-	bool AddResult(LCR::Result r);
+	bool AddResult(const Frontend::Result &r);
 private:
 	static constexpr color_t ColorBackground = COLOR_BG_DEFAULT;
 	static constexpr color_t ColorAxis = COLOR_BLACK;
@@ -65,9 +77,27 @@ private:
 	static constexpr color_t ColorMarker = COLOR_LIGHTGRAY;
 	static constexpr uint16_t MaxDataPoints = 250;
 
+	// Measurement result, the displayed variables are derived when needed
 	using Datapoint = struct {
-		float y[2];
+		// measured impedance, the lead compensation is applied when it is used
+		std::complex<float> Z;
+		uint32_t frequency;
+		// settled TIA gain, used as starting range in the following sweeps
+		ad5940_hsrtia_t rtia : 8;
+		Frontend::ResultType type;
+		// point contains a measurement result
+		bool valid : 1;
+		// point has to be measured in the current pass
+		bool pending : 1;
+		// the interval to the next point has to be refined
+		bool refine : 1;
+		// relative standard error of |Z| for a single sample (0 if unknown)
+		float noise;
+		// expected duration of one sample in us (Frontend::SampleTime), used for the time scheduling
+		uint32_t sampleTime;
 	};
+	// the acquisition parameters are only prepared for the point being measured
+	static_assert(sizeof(Datapoint) <= 24, "Datapoint grew, check the heap usage of the sweep");
 
 	Widget::Type getType() override { return Widget::Type::Custom; };
 
@@ -77,6 +107,25 @@ private:
 	void MinorSettingChanged(Widget *w);
 
 	uint32_t PointToFrequency(uint16_t point);
+	int16_t FrequencyToX(uint32_t frequency, int16_t left, int16_t right);
+	uint16_t NextPoint();
+	// Inserts points where the impedance changes rapidly, returns the number of inserted points
+	uint16_t Refine();
+	// Sets frequency and sample time of a point
+	void SetFrequency(uint16_t point, uint32_t frequency);
+	void ResetPoints();
+	void StartPass();
+	uint32_t ScheduledAverages(uint16_t point);
+	// Estimated remaining time of the current pass in ms
+	uint32_t RemainingTime();
+	// Lead compensated impedance of a point
+	std::complex<float> Impedance(uint16_t point);
+	float GetValue(uint16_t point, Variable var);
+	/*
+	 * Sets the frequency and sample time of all points. The acquisition parameters are not kept per
+	 * point, GetAcquisitionSettings() prepares them lazily for the point being measured
+	 */
+	void BuildPlan();
 
 	void draw(coords_t offset) override;
 	void input(GUIEvent_t *ev) override;
@@ -86,7 +135,19 @@ private:
 	Menu *mConfig;
 	Config config;
 	Datapoint points[MaxDataPoints];
+	// Acquisition parameters of the point being measured (see GetAcquisitionSettings)
+	Frontend::PlanEntry plan;
+	// number of points, exceeds the configured points when adaptive refinement has added points
+	uint16_t numPoints;
+	// point that is currently being measured
 	uint16_t pointCnt;
-	bool initialSweep;
+	// point that has been updated since the last redraw
+	int16_t lastPoint;
 	uint16_t marker;
+	// time scheduling
+	static constexpr uint16_t MaxScheduledAverages = 1000;
+	uint32_t passStart;
+	uint32_t pointStart;
+	// ratio of actual measurement time to the expected sample time
+	float timeScale;
 };
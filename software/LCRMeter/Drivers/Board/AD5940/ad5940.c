@@ -1,7 +1,14 @@
 #include "ad5940.h"
 
 #include "log.h"
+#ifdef AD5940_SIMULATION
+#include "ad5940_sim.h"
+#endif
+#ifdef AD5940_USE_INTERRUPT
+#include "exti.h"
+#endif
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <math.h>
 #include <util.h>
@@ -105,10 +112,14 @@ void ad5940_release_mutex(ad5940_t *a) {
 }
 
 static void cs_low(ad5940_t *a) {
+#ifndef AD5940_SIMULATION
 	a->CSport->BSRR = a->CSpin << 16;
+#endif
 }
 static void cs_high(ad5940_t *a) {
+#ifndef AD5940_SIMULATION
 	a->CSport->BSRR = a->CSpin;
+#endif
 }
 
 static uint8_t get_reg_length(ad5940_reg_t reg) {
@@ -119,73 +130,499 @@ static uint8_t get_reg_length(ad5940_reg_t reg) {
 	}
 }
 
-void ad5940_write_reg(ad5940_t *a, ad5940_reg_t reg, uint32_t val) {
-#ifdef AD5940_USE_SPI_MUTEX
-	xSemaphoreTake(AD5940_SPI_MUTEX, portMAX_DELAY);
+#ifdef AD5940_USE_SHADOW_REGISTERS
+// Configuration registers that only change when written by the driver or a sequence
+static const ad5940_reg_t shadow_regs[AD5940_SHADOW_REGISTERS] = {
+	AD5940_REG_AFECON,
+	AD5940_REG_SEQCON,
+	AD5940_REG_FIFOCON,
+	AD5940_REG_SWCON,
+	AD5940_REG_HSDACCON,
+	AD5940_REG_WGCON,
+	AD5940_REG_WGFCW,
+	AD5940_REG_WGAMPLITUDE,
+	AD5940_REG_ADCFILTERCON,
+	AD5940_REG_DFTCON,
+	AD5940_REG_LPTIASW0,
+	AD5940_REG_LPTIACON0,
+	AD5940_REG_HSRTIACON,
+	AD5940_REG_DE0RESCON,
+	AD5940_REG_HSTIACON,
+	AD5940_REG_LPDACDAT0,
+	AD5940_REG_LPDACSW0,
+	AD5940_REG_LPDACCON0,
+	AD5940_REG_DSWFULLCON,
+	AD5940_REG_NSWFULLCON,
+	AD5940_REG_PSWFULLCON,
+	AD5940_REG_TSWFULLCON,
+	AD5940_REG_STATSCON,
+	AD5940_REG_ADCCON,
+	AD5940_REG_CMDDATACON,
+	AD5940_REG_INTCSEL0,
+	AD5940_REG_INTCSEL1,
+	AD5940_REG_GP0CON,
+};
+
+static int8_t shadow_index(ad5940_reg_t reg) {
+	for (uint8_t i = 0; i < AD5940_SHADOW_REGISTERS; i++) {
+		if (shadow_regs[i] == reg) {
+			return i;
+		}
+	}
+	return -1;
+}
 #endif
-	// set register address
-	cs_low(a);
-	{
-		uint8_t data[3] = { AD5940_SPICMD_SETADDR, (uint32_t) reg >> 8,
-				(uint32_t) reg & 0xFF };
-		HAL_SPI_Transmit(a->spi, data, 3, 100);
+
+static void shadow_store(ad5940_t *a, ad5940_reg_t reg, uint32_t val) {
+#ifdef AD5940_USE_SHADOW_REGISTERS
+	int8_t i = shadow_index(reg);
+	if (i >= 0) {
+		a->shadow[i] = get_reg_length(reg) == 2 ? val & 0xFFFF : val;
+		a->shadow_valid |= 1UL << i;
 	}
-	cs_high(a);
-	asm volatile("NOP");
-	cs_low(a);
-	{
-		uint8_t reglength = get_reg_length(reg);
-		uint8_t data[5];
-		data[0] = AD5940_SPICMD_WRITEREG;
+#endif
+}
+
+/*
+ * Transfer queue
+ *
+ * A register access consists of two SPI frames: SETADDR followed by READREG or WRITEREG. A FIFO burst is a
+ * single frame with the READFIFO header and the data words. The queue is executed as a series of segments
+ * (one SPI transfer each, with the chip select toggled as required), either by polling or from the DMA
+ * interrupt. The state of the queue lives on the stack of ad5940_execute.
+ */
+typedef struct {
+	ad5940_t *a;
+	ad5940_xfer_t *xfers;
+	uint16_t num;
+	uint16_t index;
+	uint8_t phase;
+	uint8_t tx[7];
+	uint8_t rx[7];
+#ifdef AD5940_USE_DMA
+	bool dma;
+	// words of the current FIFO burst transferred together with its header
+	uint16_t merged;
+	bool end_frame;
+	volatile bool busy;
+	volatile bool error;
+#endif
+} queue_t;
+
+static void xfer_complete(ad5940_t *a, ad5940_xfer_t *x) {
+	switch (x->type) {
+	case AD5940_XFER_WRITE:
+		a->stats.writes++;
+#ifdef AD5940_USE_SHADOW_REGISTERS
+		if (x->reg == AD5940_REG_SWRSTCON) {
+			ad5940_invalidate_shadow(a);
+			break;
+		}
+#endif
+		shadow_store(a, x->reg, x->val);
+		break;
+	case AD5940_XFER_READ:
+		a->stats.reads++;
+		shadow_store(a, x->reg, x->val);
+		break;
+	case AD5940_XFER_FIFO:
+		a->stats.reads++;
+		break;
+	}
+}
+
+/*
+ * Skips transfers not requiring SPI access (reads answered by the shadow copy, empty FIFO reads).
+ * Returns false if the end of the queue has been reached
+ */
+static bool queue_skip(queue_t *q) {
+	while (q->index < q->num) {
+		ad5940_xfer_t *x = &q->xfers[q->index];
+		if (x->type == AD5940_XFER_FIFO && !x->num) {
+			q->index++;
+			continue;
+		}
+#ifdef AD5940_USE_SHADOW_REGISTERS
+		if (x->type == AD5940_XFER_READ) {
+			int8_t i = shadow_index(x->reg);
+			if (i >= 0 && (q->a->shadow_valid & (1UL << i))) {
+				x->val = q->a->shadow[i];
+				q->a->stats.cached++;
+				q->index++;
+				continue;
+			}
+		}
+#endif
+		return true;
+	}
+	return false;
+}
+
+#ifndef AD5940_SIMULATION
+typedef struct {
+	uint8_t *tx;
+	uint8_t *rx;
+	uint16_t len;
+	bool start_frame;
+	bool end_frame;
+} segment_t;
+
+static bool is_FIFO_burst(const ad5940_xfer_t *x) {
+	return x->type == AD5940_XFER_FIFO && x->num >= 2;
+}
+
+static ad5940_reg_t xfer_reg(const ad5940_xfer_t *x) {
+	// single FIFO words are read through the data register
+	return x->type == AD5940_XFER_FIFO ? AD5940_REG_DATAFIFORD : x->reg;
+}
+
+#ifdef AD5940_USE_DMA
+/*
+ * Header and the first words of a FIFO burst are transferred through this buffer, saving the separate
+ * DMA transfer of the 7 byte header. The header starts at offset 1, keeping the data words aligned
+ */
+static uint32_t dma_buf[2 + AD5940_DMA_BURST_WORDS];
+#endif
+
+/*
+ * Prepares the data bytes of FIFO burst words first to first+num-1, the last two words of the burst have
+ * to be clocked out with 0x44 bytes
+ */
+static void FIFO_burst_tx(const ad5940_xfer_t *x, uint8_t *tx, uint16_t first, uint16_t num) {
+	for (uint16_t i = first; i < first + num; i++) {
+		memset(tx, i + 2 >= x->num ? 0x44 : 0x00, 4);
+		tx += 4;
+	}
+}
+
+static void queue_segment(queue_t *q, segment_t *s) {
+	ad5940_xfer_t *x = &q->xfers[q->index];
+	uint8_t *tx = q->tx;
+	s->tx = tx;
+	s->rx = q->rx;
+	s->start_frame = true;
+	s->end_frame = true;
+	if (is_FIFO_burst(x)) {
+		uint16_t merged = 0;
+#ifdef AD5940_USE_DMA
+		merged = q->merged;
+#endif
+		if (q->phase == 0) {
+#ifdef AD5940_USE_DMA
+			if (q->dma) {
+				merged = x->num < AD5940_DMA_BURST_WORDS ? x->num : AD5940_DMA_BURST_WORDS;
+				q->merged = merged;
+				tx = (uint8_t*) dma_buf + 1;
+				s->tx = tx;
+				s->rx = tx;
+			}
+#endif
+			// Read FIFO cmd followed by 6 dummy bytes
+			memset(tx, 0, 7);
+			tx[0] = AD5940_SPICMD_READFIFO;
+			FIFO_burst_tx(x, tx + 7, 0, merged);
+			s->len = 7 + merged * 4;
+			s->end_frame = merged == x->num;
+		} else {
+			// remaining words are received in place
+			FIFO_burst_tx(x, (uint8_t*) &x->data[merged], merged, x->num - merged);
+			s->tx = (uint8_t*) &x->data[merged];
+			s->rx = (uint8_t*) &x->data[merged];
+			s->len = (x->num - merged) * 4;
+			s->start_frame = false;
+		}
+		return;
+	}
+	ad5940_reg_t reg = xfer_reg(x);
+	uint8_t reglength = get_reg_length(reg);
+	if (q->phase == 0) {
+		// set register address
+		tx[0] = AD5940_SPICMD_SETADDR;
+		tx[1] = (uint32_t) reg >> 8;
+		tx[2] = (uint32_t) reg & 0xFF;
+		s->len = 3;
+	} else if (x->type == AD5940_XFER_WRITE) {
+		tx[0] = AD5940_SPICMD_WRITEREG;
 		if (reglength == 2) {
-			data[1] = (val >> 8) & 0xFF;
-			data[2] = val & 0xFF;
+			tx[1] = (x->val >> 8) & 0xFF;
+			tx[2] = x->val & 0xFF;
 		} else {
-			data[1] = (val >> 24) & 0xFF;
-			data[2] = (val >> 16) & 0xFF;
-			data[3] = (val >> 8) & 0xFF;
-			data[4] = val & 0xFF;
+			tx[1] = (x->val >> 24) & 0xFF;
+			tx[2] = (x->val >> 16) & 0xFF;
+			tx[3] = (x->val >> 8) & 0xFF;
+			tx[4] = x->val & 0xFF;
 		}
-		HAL_SPI_Transmit(a->spi, data, reglength + 1, 100);
+		s->len = reglength + 1;
+	} else {
+		memset(tx, 0, reglength + 2);
+		tx[0] = AD5940_SPICMD_READREG;
+		s->len = reglength + 2;
 	}
-	cs_high(a);
-#ifdef AD5940_USE_SPI_MUTEX
-	xSemaphoreGive(AD5940_SPI_MUTEX);
+}
+
+/*
+ * Evaluates the finished segment and advances to the next one. Returns false if the queue is done
+ */
+static bool queue_next(queue_t *q) {
+	ad5940_xfer_t *x = &q->xfers[q->index];
+	if (is_FIFO_burst(x)) {
+		// received big endian
+		uint16_t merged = 0;
+#ifdef AD5940_USE_DMA
+		merged = q->merged;
+#endif
+		if (q->phase == 0) {
+#ifdef AD5940_USE_DMA
+			for (uint16_t i = 0; i < merged; i++) {
+				x->data[i] = __REV(dma_buf[2 + i]);
+			}
+#endif
+			if (merged < x->num) {
+				q->phase = 1;
+				return true;
+			}
+		} else {
+			for (uint16_t i = merged; i < x->num; i++) {
+				x->data[i] = __REV(x->data[i]);
+			}
+		}
+	} else if (q->phase == 0) {
+		q->phase = 1;
+		return true;
+	} else if (x->type != AD5940_XFER_WRITE) {
+		const uint8_t *rec = q->rx;
+		uint32_t val;
+		if (get_reg_length(xfer_reg(x)) == 2) {
+			val = (uint32_t) (rec[2]) << 8 | (uint32_t) (rec[3]);
+		} else {
+			val = (uint32_t) (rec[2]) << 24 | (uint32_t) (rec[3]) << 16
+					| (uint32_t) (rec[4]) << 8 | (uint32_t) (rec[5]);
+		}
+		if (x->type == AD5940_XFER_FIFO) {
+			*x->data = val;
+		} else {
+			x->val = val;
+		}
+	}
+	xfer_complete(q->a, x);
+	q->phase = 0;
+#ifdef AD5940_USE_DMA
+	q->merged = 0;
 #endif
+	q->index++;
+	return queue_skip(q);
 }
 
-uint32_t ad5940_read_reg(ad5940_t *a, ad5940_reg_t reg) {
+static ad5940_result_t queue_poll(queue_t *q) {
+	segment_t s;
+	do {
+		queue_segment(q, &s);
+		if (s.start_frame) {
+			cs_low(q->a);
+		}
+		HAL_StatusTypeDef res = HAL_SPI_TransmitReceive(q->a->spi, s.tx, s.rx, s.len, 100);
+		if (s.end_frame || res != HAL_OK) {
+			cs_high(q->a);
+			asm volatile("NOP");
+		}
+		if (res != HAL_OK) {
+			return AD5940_RES_ERROR;
+		}
+	} while (queue_next(q));
+	return AD5940_RES_OK;
+}
+
+#ifdef AD5940_USE_DMA
+static uint16_t xfer_bytes(const ad5940_xfer_t *x) {
+	if (is_FIFO_burst(x)) {
+		return 7 + x->num * 4;
+	} else if (x->type == AD5940_XFER_WRITE) {
+		return 3 + 1 + get_reg_length(x->reg);
+	} else {
+		return 3 + 2 + get_reg_length(xfer_reg(x));
+	}
+}
+
+// queue of the active DMA transfer
+static queue_t *volatile dma_queue;
+// given by the DMA interrupt when the queue is done
+static StaticSemaphore_t dma_done_buffer;
+static SemaphoreHandle_t dma_done;
+
+static void dma_start(queue_t *q, const segment_t *s) {
+	SPI_TypeDef *spi = q->a->spi->Instance;
+	if (s->start_frame) {
+		cs_low(q->a);
+	}
+	q->end_frame = s->end_frame;
+	// discard stale data in the receive FIFO
+	while (spi->SR & SPI_SR_FRLVL) {
+		(void) *(__IO uint8_t*) &spi->DR;
+	}
+	AD5940_DMA_CLEAR_FLAGS();
+	AD5940_DMA_RX_CHANNEL->CPAR = (uint32_t) &spi->DR;
+	AD5940_DMA_RX_CHANNEL->CMAR = (uint32_t) s->rx;
+	AD5940_DMA_RX_CHANNEL->CNDTR = s->len;
+	AD5940_DMA_RX_CHANNEL->CCR = DMA_CCR_MINC | DMA_CCR_TCIE | DMA_CCR_TEIE | DMA_CCR_EN;
+	AD5940_DMA_TX_CHANNEL->CPAR = (uint32_t) &spi->DR;
+	AD5940_DMA_TX_CHANNEL->CMAR = (uint32_t) s->tx;
+	AD5940_DMA_TX_CHANNEL->CNDTR = s->len;
+	AD5940_DMA_TX_CHANNEL->CCR = DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_EN;
+	// RX request has to be enabled first
+	spi->CR2 |= SPI_CR2_RXDMAEN;
+	spi->CR1 |= SPI_CR1_SPE;
+	spi->CR2 |= SPI_CR2_TXDMAEN;
+}
+
+static void dma_stop(queue_t *q) {
+	q->a->spi->Instance->CR2 &= ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+	AD5940_DMA_RX_CHANNEL->CCR = 0;
+	AD5940_DMA_TX_CHANNEL->CCR = 0;
+}
+
+void AD5940_DMA_RX_IRQHandler(void) {
+	bool error = AD5940_DMA_ERROR();
+	AD5940_DMA_CLEAR_FLAGS();
+	queue_t *q = dma_queue;
+	if (!q || !q->busy) {
+		return;
+	}
+	// receive complete -> the whole segment has been transferred
+	dma_stop(q);
+	if (q->end_frame || error) {
+		cs_high(q->a);
+	}
+	if (!error && queue_next(q)) {
+		segment_t s;
+		queue_segment(q, &s);
+		dma_start(q, &s);
+		return;
+	}
+	q->error = error;
+	q->busy = false;
+	dma_queue = NULL;
+	BaseType_t woken = pdFALSE;
+	xSemaphoreGiveFromISR(dma_done, &woken);
+	portYIELD_FROM_ISR(woken);
+}
+
+static ad5940_result_t queue_dma(queue_t *q) {
+	q->dma = true;
+	q->error = false;
+	q->busy = true;
+	dma_queue = q;
+	segment_t s;
+	queue_segment(q, &s);
+	dma_start(q, &s);
+	const TickType_t timeout = 100 / portTICK_PERIOD_MS;
+	TickType_t start = xTaskGetTickCount();
+	while (q->busy) {
+		TickType_t elapsed = xTaskGetTickCount() - start;
+		if (elapsed >= timeout) {
+			HAL_NVIC_DisableIRQ(AD5940_DMA_RX_IRQn);
+			if (q->busy) {
+				dma_stop(q);
+				cs_high(q->a);
+				q->busy = false;
+				q->error = true;
+				dma_queue = NULL;
+			}
+			HAL_NVIC_EnableIRQ(AD5940_DMA_RX_IRQn);
+			break;
+		}
+		// a late completion of a timed out transfer might have left the semaphore given, check again
+		xSemaphoreTake(dma_done, timeout - elapsed);
+	}
+	return q->error ? AD5940_RES_ERROR : AD5940_RES_OK;
+}
+#endif
+#else
+static ad5940_result_t queue_simulate(queue_t *q) {
+	do {
+		ad5940_xfer_t *x = &q->xfers[q->index];
+		switch (x->type) {
+		case AD5940_XFER_WRITE:
+			ad5940_sim_write_reg(x->reg, x->val);
+			break;
+		case AD5940_XFER_READ:
+			x->val = ad5940_sim_read_reg(x->reg);
+			break;
+		case AD5940_XFER_FIFO:
+			for (uint16_t i = 0; i < x->num; i++) {
+				x->data[i] = ad5940_sim_read_reg(AD5940_REG_DATAFIFORD);
+			}
+			break;
+		}
+		xfer_complete(q->a, x);
+		q->index++;
+	} while (queue_skip(q));
+	return AD5940_RES_OK;
+}
+#endif
+
+ad5940_result_t ad5940_execute(ad5940_t *a, ad5940_xfer_t *xfers, uint16_t num) {
+	queue_t q = { .a = a, .xfers = xfers, .num = num, .index = 0, .phase = 0 };
+	// the queue holds the instance (and the DMA channels) until it is done
+	ad5940_take_mutex(a);
+	if (!queue_skip(&q)) {
+		// nothing to transfer
+		ad5940_release_mutex(a);
+		return AD5940_RES_OK;
+	}
+	ad5940_result_t res;
+#ifdef AD5940_SIMULATION
+	res = queue_simulate(&q);
+#else
 #ifdef AD5940_USE_SPI_MUTEX
 	xSemaphoreTake(AD5940_SPI_MUTEX, portMAX_DELAY);
 #endif
-	// set register address
-	cs_low(a);
-	{
-		uint8_t data[3] = { AD5940_SPICMD_SETADDR, (uint32_t) reg >> 8,
-				(uint32_t) reg & 0xFF };
-		HAL_SPI_Transmit(a->spi, data, 3, 100);
+#ifdef AD5940_USE_DMA
+	uint32_t bytes = 0;
+	for (uint16_t i = q.index; i < num; i++) {
+		bytes += xfer_bytes(&xfers[i]);
 	}
-	cs_high(a);
-	asm volatile("NOP");
-	cs_low(a);
-	uint32_t ret = 0;
+	if (bytes >= AD5940_DMA_MIN_BYTES
+			&& xTaskGetSchedulerState() == taskSCHEDULER_RUNNING) {
+		res = queue_dma(&q);
+	} else
+#endif
 	{
-		uint8_t reglength = get_reg_length(reg);
-		uint8_t send[6] = { AD5940_SPICMD_READREG, 0, 0, 0, 0, 0 };
-		uint8_t rec[6];
-		HAL_SPI_TransmitReceive(a->spi, send, rec, reglength + 2, 100);
-		if (reglength == 2) {
-			ret = (uint32_t) (rec[2]) << 8 | (uint32_t) (rec[3]);
-		} else {
-			ret = (uint32_t) (rec[2]) << 24 | (uint32_t) (rec[3]) << 16
-					| (uint32_t) (rec[4]) << 8 | (uint32_t) (rec[5]);
-		}
+		res = queue_poll(&q);
 	}
-	cs_high(a);
 #ifdef AD5940_USE_SPI_MUTEX
 	xSemaphoreGive(AD5940_SPI_MUTEX);
 #endif
-	return ret;
+	if (res != AD5940_RES_OK) {
+		LOG(Log_AD5940, LevelError, "SPI transfer failed (%u of %u done)", q.index, num);
+	}
+#endif
+	ad5940_release_mutex(a);
+	return res;
+}
+
+void ad5940_write_reg(ad5940_t *a, ad5940_reg_t reg, uint32_t val) {
+	ad5940_xfer_t x = { .type = AD5940_XFER_WRITE, .reg = reg, .val = val };
+	ad5940_execute(a, &x, 1);
+}
+
+uint32_t ad5940_read_reg(ad5940_t *a, ad5940_reg_t reg) {
+	ad5940_xfer_t x = { .type = AD5940_XFER_READ, .reg = reg, .val = 0 };
+	ad5940_execute(a, &x, 1);
+	return x.val;
+}
+
+void ad5940_invalidate_shadow(ad5940_t *a) {
+#ifdef AD5940_USE_SHADOW_REGISTERS
+	a->shadow_valid = 0;
+	a->shadow_seq = 0;
+#endif
+}
+
+void ad5940_get_spi_stats(ad5940_t *a, ad5940_spi_stats_t *stats, bool reset) {
+	*stats = a->stats;
+	if (reset) {
+		memset(&a->stats, 0, sizeof(a->stats));
+	}
 }
 
 void ad5940_set_bits(ad5940_t *a, ad5940_reg_t reg, uint32_t bits) {
@@ -217,6 +654,7 @@ ad5940_result_t ad5940_init(ad5940_t *a) {
 		LOG(Log_AD5940, LevelCrit, "Null pointer given for CS port");
 		return AD5940_RES_ERROR;
 	}
+#ifndef AD5940_SIMULATION
 	// initialize CS pin
 	GPIO_InitTypeDef gpio;
 	gpio.Mode = GPIO_MODE_OUTPUT_PP;
@@ -231,6 +669,23 @@ ad5940_result_t ad5940_init(ad5940_t *a) {
 	gpio.Pull = GPIO_NOPULL;
 	HAL_GPIO_Init(a->CSport, &gpio);
 	cs_high(a);
+#ifdef AD5940_USE_DMA
+	if (!dma_done) {
+		dma_done = xSemaphoreCreateBinaryStatic(&dma_done_buffer);
+	}
+	AD5940_DMA_CLK_ENABLE();
+	HAL_NVIC_SetPriority(AD5940_DMA_RX_IRQn, 5, 0);
+	HAL_NVIC_EnableIRQ(AD5940_DMA_RX_IRQn);
+#endif
+#else
+	ad5940_sim_reset();
+#endif
+	// register content is unknown after a reset
+	ad5940_invalidate_shadow(a);
+	memset(&a->stats, 0, sizeof(a->stats));
+#ifdef AD5940_USE_INTERRUPT
+	a->int_task = NULL;
+#endif
 
 	a->autoranging = true;
 
@@ -290,6 +745,63 @@ ad5940_result_t ad5940_init(ad5940_t *a) {
 	// enable statistics, 128 samples
 	ad5940_set_bits(a, AD5940_REG_STATSCON, 0x0001);
 
+#ifdef AD5940_USE_INTERRUPT
+	if (a->INTport) {
+		// GPIO0 as interrupt output, active low
+		ad5940_modify_reg(a, AD5940_REG_GP0CON, 0x0000, 0x0003);
+		ad5940_write_reg(a, AD5940_REG_INTCPOL, 0x0000);
+		if (exti_set_callback(a->INTport, a->INTpin, EXTI_TYPE_FALLING,
+				EXTI_PULL_UP, ad5940_interrupt_handler, a) != EXTI_RES_OK) {
+			LOG(Log_AD5940, LevelWarn, "Failed to set interrupt callback, falling back to polling");
+			a->INTport = NULL;
+		}
+	}
+#endif
+
+	return AD5940_RES_OK;
+}
+
+#ifdef AD5940_USE_INTERRUPT
+void ad5940_interrupt_handler(void *ptr) {
+	ad5940_t *a = (ad5940_t*) ptr;
+	if (a->int_task) {
+		BaseType_t woken = pdFALSE;
+		vTaskNotifyGiveFromISR(a->int_task, &woken);
+		portYIELD_FROM_ISR(woken);
+	}
+}
+#endif
+
+ad5940_result_t ad5940_wait_for_flag(ad5940_t *a, uint32_t flags, uint32_t timeout_ms, uint32_t *intflags) {
+#ifdef AD5940_USE_INTERRUPT
+	// has to be set before reading the flags, otherwise an interrupt between the read and waiting for the notification gets lost
+	a->int_task = xTaskGetCurrentTaskHandle();
+#endif
+	uint32_t start = HAL_GetTick();
+	uint32_t val;
+	while (1) {
+		ad5940_take_mutex(a);
+		val = ad5940_read_reg(a, AD5940_REG_INTCFLAG0);
+		ad5940_release_mutex(a);
+		if (val & flags) {
+			break;
+		}
+		uint32_t elapsed = HAL_GetTick() - start;
+		if (elapsed > timeout_ms) {
+			return AD5940_RES_ERROR;
+		}
+#ifdef AD5940_USE_INTERRUPT
+		if (a->INTport) {
+			ulTaskNotifyTake(pdTRUE, (timeout_ms - elapsed) / portTICK_PERIOD_MS + 1);
+		} else
+#endif
+		{
+			vTaskDelay(1);
+		}
+	}
+	if (intflags) {
+		*intflags = val;
+	}
 	return AD5940_RES_OK;
 }
 
@@ -633,31 +1145,241 @@ uint16_t ad5940_get_FIFO_level(ad5940_t *a) {
 	uint32_t raw = ad5940_read_reg(a, AD5940_REG_FIFOCNTSTA);
 	return ((raw&0x07FF0000) >> 16);
 }
-static uint16_t readFIFO(ad5940_t *a, uint32_t offset)
-{
-	uint8_t recv[4];
-	HAL_SPI_TransmitReceive(a->spi, (uint8_t*) &offset, recv, 4, 100);
-	return recv[3] | (uint16_t) recv[2] << 8;
-}
 void ad5940_FIFO_read(ad5940_t *a, uint16_t *dest, uint16_t num) {
-	if (!num) {
-		return;
+	uint32_t buf[16];
+	while (num) {
+		uint16_t words = num > ARRAY_SIZE(buf) ? ARRAY_SIZE(buf) : num;
+		ad5940_FIFO_read32(a, buf, words);
+		for (uint16_t i = 0; i < words; i++) {
+			*dest++ = buf[i] & 0x0000FFFF;
+		}
+		num -= words;
 	}
-	if (num < 2) {
-		*dest = ad5940_read_reg(a, AD5940_REG_DATAFIFORD) & 0x0000FFFF;
-		return;
+}
+void ad5940_FIFO_read32(ad5940_t *a, uint32_t *dest, uint16_t num) {
+	ad5940_xfer_t x = { .type = AD5940_XFER_FIFO, .data = dest, .num = num };
+	ad5940_execute(a, &x, 1);
+}
+
+void ad5940_seq_clear(ad5940_seq_t *s) {
+	s->len = 0;
+}
+
+ad5940_result_t ad5940_seq_add_write(ad5940_seq_t *s, ad5940_reg_t reg, uint32_t val) {
+	if (reg < 0x2000 || reg > 0x21FC) {
+		LOG(Log_AD5940, LevelError, "Register 0x%04x not writable by sequencer", reg);
+		return AD5940_RES_ERROR;
 	}
-	cs_low(a);
-	// Read FIFO cmd followed by 6 dummy bytes
-	uint8_t data[7] = { AD5940_SPICMD_READFIFO, 0, 0, 0, 0, 0, 0 };
-	HAL_SPI_Transmit(a->spi, data, 7, 100);
-	while (num > 2) {
-		*dest++ = readFIFO(a, 0);
-		num--;
+	if (val & 0xFF000000) {
+		LOG(Log_AD5940, LevelError, "Value 0x%08x exceeds 24 bit sequencer limit", val);
+		return AD5940_RES_ERROR;
 	}
-	*dest++ = readFIFO(a, 0x44444444);
-	*dest = readFIFO(a, 0x44444444);
-	cs_high(a);
+	if (s->len >= AD5940_SEQ_MAX_COMMANDS) {
+		LOG(Log_AD5940, LevelError, "Sequence too long");
+		return AD5940_RES_ERROR;
+	}
+	s->cmd[s->len++] = AD5940_SEQ_WRITE(reg, val);
+	return AD5940_RES_OK;
+}
+
+ad5940_result_t ad5940_seq_add_wait(ad5940_seq_t *s, uint32_t cycles) {
+	if (s->len >= AD5940_SEQ_MAX_COMMANDS) {
+		LOG(Log_AD5940, LevelError, "Sequence too long");
+		return AD5940_RES_ERROR;
+	}
+	s->cmd[s->len++] = AD5940_SEQ_WAIT(cycles);
+	return AD5940_RES_OK;
+}
+
+static const ad5940_reg_t seq_info_regs[] = {
+	AD5940_REG_SEQ0INFO,
+	AD5940_REG_SEQ1INFO,
+	AD5940_REG_SEQ2INFO,
+	AD5940_REG_SEQ3INFO,
+};
+
+ad5940_result_t ad5940_seq_upload(ad5940_t *a, uint8_t id, uint16_t start, const ad5940_seq_t *s) {
+	if (id >= sizeof(seq_info_regs) / sizeof(seq_info_regs[0])) {
+		LOG(Log_AD5940, LevelError, "Invalid sequence ID %u", id);
+		return AD5940_RES_ERROR;
+	}
+	if (start + s->len > AD5940_SEQ_MEMORY_WORDS) {
+		LOG(Log_AD5940, LevelError, "Sequence exceeds command memory");
+		return AD5940_RES_ERROR;
+	}
+	ad5940_take_mutex(a);
+	// command memory in memory mode with 2kB
+	ad5940_modify_reg(a, AD5940_REG_CMDDATACON, 0x00000001, 0x0000003F);
+	// transfer the commands in larger blocks
+	ad5940_xfer_t xfers[16];
+	uint8_t n = 0;
+	ad5940_result_t res = AD5940_RES_OK;
+	for (uint8_t i = 0; i < s->len; i++) {
+		xfers[n].type = AD5940_XFER_WRITE;
+		xfers[n].reg = AD5940_REG_CMDFIFOWADDR;
+		xfers[n++].val = start + i;
+		xfers[n].type = AD5940_XFER_WRITE;
+		xfers[n].reg = AD5940_REG_CMDFIFOWRITE;
+		xfers[n++].val = s->cmd[i];
+		if (n >= ARRAY_SIZE(xfers)) {
+			if (ad5940_execute(a, xfers, n) != AD5940_RES_OK) {
+				res = AD5940_RES_ERROR;
+			}
+			n = 0;
+		}
+#ifdef AD5940_USE_SHADOW_REGISTERS
+		if (s->cmd[i] & 0x80000000) {
+			// the sequence changes this register, the shadow copy is no longer valid once it runs
+			int8_t index = shadow_index(0x2000 | ((s->cmd[i] >> 24) & 0x7F) << 2);
+			if (index >= 0) {
+				a->shadow_seq |= 1UL << index;
+			}
+		}
+#endif
+	}
+	xfers[n].type = AD5940_XFER_WRITE;
+	xfers[n].reg = seq_info_regs[id];
+	xfers[n++].val = ((uint32_t) s->len << 16) | start;
+	if (ad5940_execute(a, xfers, n) != AD5940_RES_OK) {
+		res = AD5940_RES_ERROR;
+	}
+	ad5940_release_mutex(a);
+	if (res == AD5940_RES_OK) {
+		LOG(Log_AD5940, LevelDebug, "Uploaded sequence %u (%u commands at 0x%03x)", id,
+				s->len, start);
+	}
+	return res;
+}
+
+ad5940_result_t ad5940_seq_enable(ad5940_t *a, bool enable) {
+	ad5940_take_mutex(a);
+	if (enable) {
+		ad5940_set_bits(a, AD5940_REG_INTCSEL0, AD5940_INT_ENDSEQ);
+		ad5940_set_bits(a, AD5940_REG_SEQCON, 0x0001);
+	} else {
+		ad5940_clear_bits(a, AD5940_REG_SEQCON, 0x0001);
+		ad5940_clear_bits(a, AD5940_REG_INTCSEL0, AD5940_INT_ENDSEQ);
+	}
+	ad5940_release_mutex(a);
+	return AD5940_RES_OK;
+}
+
+ad5940_result_t ad5940_seq_trigger(ad5940_t *a, uint8_t id) {
+	if (id >= sizeof(seq_info_regs) / sizeof(seq_info_regs[0])) {
+		return AD5940_RES_ERROR;
+	}
+	ad5940_take_mutex(a);
+#ifdef AD5940_USE_SHADOW_REGISTERS
+	a->shadow_valid &= ~a->shadow_seq;
+#endif
+	ad5940_write_reg(a, AD5940_REG_TRIGSEQ, 1UL << id);
+	ad5940_release_mutex(a);
+	return AD5940_RES_OK;
+}
+
+ad5940_result_t ad5940_seq_build_dft(ad5940_t *a, ad5940_seq_t *s,
+		const ad5940_seq_dft_step_t *steps, uint8_t num, uint32_t settle_cycles,
+		uint32_t dft_cycles) {
+	ad5940_take_mutex(a);
+	// ADC powered but not converting, DFT disabled
+	uint32_t afecon = (ad5940_read_reg(a, AD5940_REG_AFECON)
+			& ~((1UL << 8) | (1UL << 15))) | (1UL << 7);
+	// keep PGA gain and everything else, only the mux is changed by the sequence
+	uint32_t adccon = ad5940_read_reg(a, AD5940_REG_ADCCON) & ~0x1FFFUL;
+	ad5940_release_mutex(a);
+
+	ad5940_result_t res = AD5940_RES_OK;
+	for (uint8_t i = 0; i < num; i++) {
+		ad5940_seq_clear(&s[i]);
+		res |= ad5940_seq_add_write(&s[i], AD5940_REG_AFECON, afecon);
+		res |= ad5940_seq_add_write(&s[i], AD5940_REG_ADCCON,
+				adccon | steps[i].p | steps[i].n);
+		res |= ad5940_seq_add_wait(&s[i], settle_cycles);
+		// start conversions and DFT
+		res |= ad5940_seq_add_write(&s[i], AD5940_REG_AFECON,
+				afecon | (1UL << 8) | (1UL << 15));
+		res |= ad5940_seq_add_wait(&s[i], dft_cycles);
+		// stop again, the DFT result is already in the FIFO
+		res |= ad5940_seq_add_write(&s[i], AD5940_REG_AFECON, afecon);
+	}
+	return res;
+}
+
+static void flush_FIFO(ad5940_t *a) {
+	uint32_t fifocon = ad5940_read_reg(a, AD5940_REG_FIFOCON);
+	ad5940_write_reg(a, AD5940_REG_FIFOCON, 0x0000);
+	ad5940_write_reg(a, AD5940_REG_FIFOCON, fifocon);
+}
+
+ad5940_result_t ad5940_seq_run_dft(ad5940_t *a, uint8_t id, uint32_t duration_ms,
+		ad5940_dftraw_t *results, uint8_t num, uint32_t *flags) {
+	for (uint8_t i = 0; i < num; i++) {
+		ad5940_take_mutex(a);
+		// clear flags of the previous step, the ADC min/max flags are collected per DFT
+		ad5940_write_reg(a, AD5940_REG_INTCCLR,
+				AD5940_INT_ENDSEQ | AD5940_INT_ADCMIN | AD5940_INT_ADCMAX);
+		ad5940_release_mutex(a);
+		if (ad5940_seq_trigger(a, id + i) != AD5940_RES_OK) {
+			return AD5940_RES_ERROR;
+		}
+		uint32_t timeout = 1000;
+#ifdef AD5940_USE_INTERRUPT
+		if (a->INTport) {
+			timeout += duration_ms;
+		} else
+#endif
+		{
+			// the sequence runs autonomously, no need to poll before it is expected to be done
+			vTaskDelay(duration_ms / portTICK_PERIOD_MS);
+		}
+
+		uint32_t intflags;
+		ad5940_result_t res = ad5940_wait_for_flag(a, AD5940_INT_ENDSEQ, timeout, &intflags);
+		ad5940_take_mutex(a);
+#ifdef AD5940_USE_SHADOW_REGISTERS
+		// registers might have been accessed while the sequence was running
+		a->shadow_valid &= ~a->shadow_seq;
+#endif
+		if (res != AD5940_RES_OK) {
+			LOG(Log_AD5940, LevelWarn, "Timed out waiting for sequence %u", id + i);
+			flush_FIFO(a);
+			ad5940_release_mutex(a);
+			return AD5940_RES_ERROR;
+		}
+		if (flags) {
+			// flags not used as interrupt source are selected in INTCSEL1
+			flags[i] = intflags | ad5940_read_reg(a, AD5940_REG_INTCFLAG1);
+		}
+		ad5940_release_mutex(a);
+	}
+	ad5940_take_mutex(a);
+	uint16_t level = ad5940_get_FIFO_level(a);
+	if (level != num * 2) {
+		LOG(Log_AD5940, LevelWarn, "Expected %u FIFO words, got %u", num * 2,
+				level);
+		flush_FIFO(a);
+		ad5940_write_reg(a, AD5940_REG_INTCCLR, AD5940_INT_ENDSEQ);
+		ad5940_release_mutex(a);
+		return AD5940_RES_ERROR;
+	}
+	// all results in a single burst, received in place
+	uint32_t *words = (uint32_t*) results;
+	ad5940_FIFO_read32(a, words, num * 2);
+	for (uint8_t i = 0; i < num; i++) {
+		results[i].real = util_sign_extend_32(words[2 * i] & 0x3FFFF, 18);
+		results[i].imag = util_sign_extend_32(words[2 * i + 1] & 0x3FFFF, 18);
+	}
+	ad5940_write_reg(a, AD5940_REG_INTCCLR, AD5940_INT_ENDSEQ);
+	ad5940_release_mutex(a);
+	return AD5940_RES_OK;
+}
+
+uint32_t ad5940_frequency_to_FCW(uint32_t frequency) {
+	/*
+	 * Calculate frequency word. F_out = F_ACLK(16MHz) * F_CW / 2^30
+	 * -> F_CW = F_out * 2^30 / 16MHz.
+	 */
+	return (uint64_t) frequency * (1UL << 30) / 16000000000ULL;
 }
 
 ad5940_result_t ad5940_generate_waveform(ad5940_t *a, ad5940_waveinfo_t *w) {
@@ -671,12 +1393,7 @@ ad5940_result_t ad5940_generate_waveform(ad5940_t *a, ad5940_waveinfo_t *w) {
 	switch (w->type) {
 	case AD5940_WAVE_SINE: {
 		LOG(Log_AD5940, LevelDebug, "Setting sinewave generation of %luHz", w->sine.frequency/1000);
-		/*
-		 * Calculate frequency word. F_out = F_ACLK(16MHz) * F_CW / 2^30
-		 * -> F_CW = F_out * 2^30 / 16MHz.
-		 */
-		uint32_t f_cw = (uint64_t) w->sine.frequency * (1UL << 30)
-				/ 16000000000ULL;
+		uint32_t f_cw = ad5940_frequency_to_FCW(w->sine.frequency);
 		ad5940_write_reg(a, AD5940_REG_WGFCW, f_cw);
 		LOG(Log_AD5940, LevelDebug, "Frequency control word: 0x%08x", f_cw);
 		/*
@@ -882,8 +1599,6 @@ ad5940_result_t ad5940_set_dft(ad5940_t *a, ad5940_dftconfig_t *dft) {
 	ad5940_result_t res = AD5940_RES_ERROR;
 	ad5940_set_bits(a, AD5940_REG_ADCFILTERCON, (1UL << 18));
 	ad5940_clear_bits(a, AD5940_REG_AFECON, (1UL << 15));
-	// disable interrupt
-	ad5940_clear_bits(a, AD5940_REG_INTCSEL0, 0x02);
 	if (dft->source != AD5940_DFTSRC_DISABLED) {
 		if (dft->hanning) {
 			ad5940_set_bits(a, AD5940_REG_DFTCON, 0x0001);
@@ -922,9 +1637,9 @@ ad5940_result_t ad5940_set_dft(ad5940_t *a, ad5940_dftconfig_t *dft) {
 		}
 		uint32_t status = ad5940_read_reg(a, AD5940_REG_DFTCON);
 		LOG(Log_AD5940, LevelDebug, "DFTCON status: 0x%08x", status);
-		// enable interrupt and clear possible old flag
-		ad5940_set_bits(a, AD5940_REG_INTCSEL0, 0x02);
-		ad5940_write_reg(a, AD5940_REG_INTCCLR, 0x02);
+		// clear possible old flag. Results are collected through the data FIFO, DFT ready is not
+		// selected as an interrupt source
+		ad5940_write_reg(a, AD5940_REG_INTCCLR, AD5940_INT_DFTRDY);
 		// enable dft
 		ad5940_clear_bits(a, AD5940_REG_ADCFILTERCON, (1UL << 18));
 		ad5940_set_bits(a, AD5940_REG_AFECON, (1UL << 15));
@@ -933,36 +1648,29 @@ ad5940_result_t ad5940_set_dft(ad5940_t *a, ad5940_dftconfig_t *dft) {
 	return res;
 }
 
-ad5940_result_t ad5940_get_dft_result(ad5940_t *a, uint8_t avg, ad5940_dftresult_t *data) {
-	ad5940_take_mutex(a);
-	data->mag = 0.0f;
-	data->phase = 0.0f;
-	for (uint8_t i = 0; i < avg; i++) {
-		// clear possible previous interrupt
-		ad5940_write_reg(a, AD5940_REG_INTCCLR, 0x02);
-		// wait for DFT to finish
-		uint32_t start = HAL_GetTick();
-		while (!(ad5940_read_reg(a, AD5940_REG_INTCFLAG0) & 0x02)) {
-			portYIELD();
-			if (HAL_GetTick() - start > 1000) {
-				LOG(Log_AD5940, LevelWarn, "Timed out waiting for DFT result");
-				ad5940_release_mutex(a);
-				return AD5940_RES_ERROR;
-			}
-		}
+void ad5940_dftacc_reset(ad5940_dftacc_t *acc) {
+	acc->real = 0;
+	acc->imag = 0;
+	acc->count = 0;
+}
+
+void ad5940_dftacc_add(ad5940_dftacc_t *acc, const ad5940_dftraw_t *raw) {
+	acc->real += raw->real;
+	acc->imag += raw->imag;
+	acc->count++;
+}
 
-		int32_t real = util_sign_extend_32(ad5940_read_reg(a, AD5940_REG_DFTREAL), 18);
-		int32_t imag = util_sign_extend_32(ad5940_read_reg(a, AD5940_REG_DFTIMAG), 18);
-		LOG(Log_AD5940, LevelDebug, "DFT raw R: %ld, I: %ld", real, imag);
-		float f_real = (float) real / (1UL << 17);
-		float f_imag = (float) imag / (1UL << 17);
-		data->mag += sqrt(f_real * f_real + f_imag * f_imag);
-		data->phase += atan2(-f_imag, f_real);
+void ad5940_dftacc_to_polar(const ad5940_dftacc_t *acc, ad5940_dftresult_t *res) {
+	if (!acc->count) {
+		res->mag = 0.0f;
+		res->phase = 0.0f;
+		return;
 	}
-	data->mag /= avg;
-	data->phase /= avg;
-	ad5940_release_mutex(a);
-	return AD5940_RES_OK;
+	float f_real = (float) acc->real / ((float) acc->count * (1UL << 17));
+	float f_imag = (float) acc->imag / ((float) acc->count * (1UL << 17));
+	res->mag = sqrtf(f_real * f_real + f_imag * f_imag);
+	// the AD5941 reports the imaginary part with inverted sign
+	res->phase = atan2f(-f_imag, f_real);
 }
 
 ad5940_result_t ad5940_setup_four_wire(ad5940_t *a, uint32_t frequency,
@@ -1071,35 +1779,6 @@ ad5940_result_t ad5940_setup_four_wire(ad5940_t *a, uint32_t frequency,
 	return AD5940_RES_OK;
 }
 
-ad5940_result_t ad5940_measure_four_wire(ad5940_t *a, ad5940_adc_muxp_t p_sense,
-		ad5940_adc_muxn_t n_sense, uint8_t avg, ad5940_dftresult_t *data) {
-	ad5940_take_mutex(a);
-	ad5940_result_t res = AD5940_RES_OK;
-//	res |= ad5940_set_ADC_mux(a, p_sense, n_sense);
-//	ad5940_set_PGA_gain(a, a->impedance.gain_voltage);
-//	res |= ad5940_ADC_start(a);
-//	ad5940_dftresult_t dft_voltage;
-//	res |= ad5940_get_dft_result(a, 1, &dft_voltage);
-//	res |= ad5940_get_dft_result(a, avg, &dft_voltage);
-//	res |= ad5940_ADC_stop(a);
-	res |= ad5940_set_ADC_mux(a, AD5940_ADC_MUXP_HSTIAP, AD5940_ADC_MUXN_HSTIAN);
-	ad5940_set_PGA_gain(a, a->impedance.gain_current);
-	res |= ad5940_ADC_start(a);
-	ad5940_dftresult_t dft_current;
-	res |= ad5940_get_dft_result(a, 1, &dft_current);
-	res |= ad5940_get_dft_result(a, avg, &dft_current);
-	res |= ad5940_ADC_stop(a);
-//	dft_voltage.mag /= (float) ad5940_PGA_gain_to_value10(
-//			a->impedance.gain_voltage) / 10;
-	dft_current.mag /= (float) ad5940_PGA_gain_to_value10(
-			a->impedance.gain_current) / 10
-			* ad5940_HSTIA_gain_to_value(a->impedance.rtia);
-	data->mag = /*dft_voltage.mag*/ 1.0f / dft_current.mag;
-	data->phase = /*dft_voltage.phase*/ 0 - dft_current.phase;
-
-	return res;
-}
-
 ad5940_result_t ad5940_disable_HS_loop(ad5940_t *a) {
 	ad5940_result_t res = AD5940_RES_OK;
 	ad5940_take_mutex(a);
@@ -1115,7 +1794,18 @@ ad5940_result_t ad5940_disable_HS_loop(ad5940_t *a) {
 ad5940_result_t ad5940_gpio_configure(ad5940_t *a, uint8_t gpio, ad5940_gpio_config_t config) {
 	ad5940_take_mutex(a);
 	// general purpose I/O on all GPIOs
-	ad5940_write_reg(a, AD5940_REG_GP0CON, 0x0023);
+	uint32_t gp0con = 0x0023;
+#ifdef AD5940_USE_INTERRUPT
+	if (a->INTport) {
+		// GPIO0 is used as interrupt output
+		gp0con &= ~0x0003;
+		if (gpio & AD5940_GPIO0) {
+			LOG(Log_AD5940, LevelWarn, "GPIO0 is reserved for the interrupt output");
+			gpio &= ~AD5940_GPIO0;
+		}
+	}
+#endif
+	ad5940_write_reg(a, AD5940_REG_GP0CON, gp0con);
 	switch(config) {
 	case AD5940_GPIO_DISABLED:
 		ad5940_clear_bits(a, AD5940_REG_GP0OEN, gpio);
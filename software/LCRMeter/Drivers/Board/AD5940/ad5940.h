@@ -5,6 +5,7 @@
 #include "stm.h"
 #include "FreeRTOS.h"
 #include "semphr.h"
+#include "task.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -19,6 +20,36 @@ extern "C" {
 // If an instance of ad5940_t will be accessed by multiple tasks, this mutex is required
 #define AD5940_USE_MUTEX
 
+// Wait for DFT results and finished sequences on the interrupt output of the AD5941 (GPIO0) instead of polling
+// the interrupt flags over SPI. Only active if INTport/INTpin are set in ad5940_t, otherwise the flags are polled
+#define AD5940_USE_INTERRUPT
+
+// Transfer larger queues of register accesses and FIFO reads (see ad5940_execute) with DMA while the calling task
+// is blocked. The channels have to match the SPI peripheral of the AD5941 (SPI3: DMA2 channel 1 (RX) and 2 (TX))
+#define AD5940_USE_DMA
+#ifdef AD5940_USE_DMA
+#define AD5940_DMA_CLK_ENABLE()		__HAL_RCC_DMA2_CLK_ENABLE()
+#define AD5940_DMA_RX_CHANNEL		DMA2_Channel1
+#define AD5940_DMA_TX_CHANNEL		DMA2_Channel2
+#define AD5940_DMA_RX_IRQn			DMA2_Channel1_IRQn
+#define AD5940_DMA_RX_IRQHandler	DMA2_Channel1_IRQHandler
+#define AD5940_DMA_CLEAR_FLAGS()	(DMA2->IFCR = DMA_IFCR_CGIF1 | DMA_IFCR_CGIF2)
+#define AD5940_DMA_ERROR()			(DMA2->ISR & (DMA_ISR_TEIF1 | DMA_ISR_TEIF2))
+// Smaller queues are transferred by polling, waiting for the DMA would take longer than the transfer itself
+#define AD5940_DMA_MIN_BYTES		64
+// Words of a FIFO burst transferred together with the burst header, larger bursts need a second DMA transfer
+#define AD5940_DMA_BURST_WORDS		32
+#endif
+
+// Keep a copy of the configuration registers in ad5940_t. Read-modify-write accesses to these registers only
+// need the SPI write, status and data registers are always read over SPI. Registers written by uploaded
+// sequences are re-read after the sequence ran. Optional, the default reads every register over SPI
+//#define AD5940_USE_SHADOW_REGISTERS
+
+// Replaces the SPI communication with a register-level model of the AD5941 (see ad5940_sim.h).
+// Only intended for host builds, usually defined by the build system
+//#define AD5940_SIMULATION
+
 /***************************************
  * Don't change anything below this line
  **************************************/
@@ -433,10 +464,71 @@ typedef struct {
 	float mag, phase;
 } ad5940_dftresult_t;
 
+// DFT result as reported by the AD5941 (18 bit signed values, imaginary part with inverted sign)
+typedef struct {
+	int32_t real, imag;
+} ad5940_dftraw_t;
+
+// Sum of raw DFT results, averaging in the complex domain
+typedef struct {
+	int64_t real, imag;
+	uint32_t count;
+} ad5940_dftacc_t;
+
+// Interrupt sources, bitmasks for the INTCSEL0, INTCFLAG0 and INTCCLR registers
+#define AD5940_INT_DFTRDY			0x00000002
+#define AD5940_INT_ADCMIN			0x00000010
+#define AD5940_INT_ADCMAX			0x00000020
+#define AD5940_INT_ENDSEQ			0x00008000
+
+typedef enum {
+	AD5940_XFER_WRITE,
+	AD5940_XFER_READ,
+	AD5940_XFER_FIFO,
+} ad5940_xfer_type_t;
+
+// Entry of a transfer queue, see ad5940_execute
+typedef struct {
+	ad5940_xfer_type_t type;
+	// register address of reads and writes
+	ad5940_reg_t reg;
+	// value to write, receives the register content on reads
+	uint32_t val;
+	// FIFO reads: destination of num words from the data FIFO
+	uint32_t *data;
+	uint16_t num;
+} ad5940_xfer_t;
+
+// Number of configuration registers in the shadow copy (see shadow_regs in ad5940.c)
+#define AD5940_SHADOW_REGISTERS		28
+
+typedef struct {
+	// register accesses and FIFO bursts sent over SPI
+	uint32_t reads;
+	uint32_t writes;
+	// register reads answered from the shadow copy
+	uint32_t cached;
+} ad5940_spi_stats_t;
+
 typedef struct {
 	SPI_HandleTypeDef *spi;
 	GPIO_TypeDef *CSport;
 	uint16_t CSpin;
+#ifdef AD5940_USE_INTERRUPT
+	// MCU pin connected to GPIO0 of the AD5941, set to NULL if not connected
+	GPIO_TypeDef *INTport;
+	uint16_t INTpin;
+	// task waiting for the interrupt
+	TaskHandle_t int_task;
+#endif
+#ifdef AD5940_USE_SHADOW_REGISTERS
+	uint32_t shadow[AD5940_SHADOW_REGISTERS];
+	// bit n set if shadow[n] matches the register content
+	uint32_t shadow_valid;
+	// shadow entries overwritten by uploaded sequences, invalidated when a sequence is triggered
+	uint32_t shadow_seq;
+#endif
+	ad5940_spi_stats_t stats;
 	uint8_t vzero_code;
 	bool autoranging;
 	struct {
@@ -475,6 +567,27 @@ typedef enum {
 
 ad5940_result_t ad5940_init(ad5940_t *a);
 
+#ifdef AD5940_USE_INTERRUPT
+/*
+ * Called from the EXTI interrupt of INTpin, registered by ad5940_init
+ */
+void ad5940_interrupt_handler(void *ptr);
+#endif
+
+/**
+ * \brief Waits until at least one of the given flags is set in INTCFLAG0
+ *
+ * Blocks on the interrupt output if available, otherwise the flags are polled once per tick.
+ * The mutex is only taken for reading the flags, do not hold it while calling this function. Only sources selected in INTCSEL0 are reported in
+ * INTCFLAG0 and drive the interrupt output, keep flags that are not waited for (e.g. the ADC
+ * min/max flags) in INTCSEL1 to avoid blocking the interrupt line.
+ *
+ * \param flags Bitmask of the flags to wait for (AD5940_INT_xxx)
+ * \param timeout_ms Maximum time to wait
+ * \param intflags If not NULL, receives the INTCFLAG0 value
+ */
+ad5940_result_t ad5940_wait_for_flag(ad5940_t *a, uint32_t flags, uint32_t timeout_ms, uint32_t *intflags);
+
 /*
  * Functions (mostly) related to electrode measurements
  */
@@ -507,12 +620,102 @@ ad5940_result_t ad5940_enable_FIFO(ad5940_t *a, ad5940_fifosrc_t src);
 ad5940_result_t ad5940_disable_FIFO(ad5940_t *a);
 uint16_t ad5940_get_FIFO_level(ad5940_t *a);
 void ad5940_FIFO_read(ad5940_t *a, uint16_t *dest, uint16_t num);
+// Reads complete 32 bit FIFO words (required for DFT results which are wider than 16 bit)
+void ad5940_FIFO_read32(ad5940_t *a, uint32_t *dest, uint16_t num);
+
+/*
+ * Sequencer functions
+ */
+// Maximum number of commands in a sequence assembled by the MCU
+#define AD5940_SEQ_MAX_COMMANDS		32
+// Size of the command memory (2kB)
+#define AD5940_SEQ_MEMORY_WORDS		512
+// The sequencer runs on the 16MHz system clock, wait commands are specified in cycles of this clock
+#define AD5940_SEQ_CLK				16000000UL
+
+// Sequencer command encoding. Only registers from 0x2000 to 0x21FC can be written by the sequencer
+#define AD5940_SEQ_WRITE(reg, val)	(0x80000000UL | (((((uint32_t) (reg)) >> 2) & 0x7F) << 24) \
+										| ((uint32_t) (val) & 0x00FFFFFF))
+#define AD5940_SEQ_WAIT(cycles)		((uint32_t) (cycles) & 0x3FFFFFFF)
+
+typedef struct {
+	uint32_t cmd[AD5940_SEQ_MAX_COMMANDS];
+	uint8_t len;
+} ad5940_seq_t;
+
+typedef struct {
+	ad5940_adc_muxp_t p;
+	ad5940_adc_muxn_t n;
+} ad5940_seq_dft_step_t;
+
+void ad5940_seq_clear(ad5940_seq_t *s);
+ad5940_result_t ad5940_seq_add_write(ad5940_seq_t *s, ad5940_reg_t reg, uint32_t val);
+ad5940_result_t ad5940_seq_add_wait(ad5940_seq_t *s, uint32_t cycles);
+
+/**
+ * \brief Writes a sequence into the command memory of the AD5941
+ *
+ * \param id Sequence slot (0-3)
+ * \param start Start address of the sequence in the command memory (in words)
+ * \param s Sequence to upload
+ */
+ad5940_result_t ad5940_seq_upload(ad5940_t *a, uint8_t id, uint16_t start, const ad5940_seq_t *s);
+/*
+ * \brief Enables/disables the sequencer
+ *
+ * The end of sequence interrupt is routed to INTCSEL0, it is the only event on the interrupt output while
+ * the sequencer is in use.
+ */
+ad5940_result_t ad5940_seq_enable(ad5940_t *a, bool enable);
+ad5940_result_t ad5940_seq_trigger(ad5940_t *a, uint8_t id);
+
+/**
+ * \brief Assembles one sequence per ADC mux setting, each calculating a single DFT
+ *
+ * Every sequence switches the ADC mux, waits for the analog path to settle and runs a single DFT.
+ * The results are written into the data FIFO (which has to be enabled with AD5940_FIFOSRC_DFT).
+ * The steps are separate sequences so that the ADC min/max flags can be read back for each DFT.
+ * The current AFECON and ADCCON register values are used as the base for the sequences, they
+ * have to be rebuilt if anything other than the ADC mux changes in them.
+ *
+ * \param s Destination for the sequences, one per step
+ * \param steps ADC mux settings, one DFT per step
+ * \param num Number of steps
+ * \param settle_cycles Settling time after switching the mux in sequencer clock cycles
+ * \param dft_cycles Time required for a DFT in sequencer clock cycles. Must be longer than the DFT
+ * 			but shorter than two DFTs
+ */
+ad5940_result_t ad5940_seq_build_dft(ad5940_t *a, ad5940_seq_t *s,
+		const ad5940_seq_dft_step_t *steps, uint8_t num, uint32_t settle_cycles,
+		uint32_t dft_cycles);
+
+/**
+ * \brief Runs previously uploaded DFT sequences and collects their results from the data FIFO
+ *
+ * The sequences id to id + num - 1 are triggered one after the other. The calling task sleeps
+ * while a sequence is executed, the SPI bus is only used to start the sequences, read their flags
+ * and read back the results.
+ *
+ * \param id First sequence to trigger
+ * \param duration_ms Expected execution time of a single sequence
+ * \param results Destination for the DFT results, in the order they were calculated. Also used as the
+ * 			FIFO read buffer, same restrictions as for FIFO destinations in ad5940_execute
+ * \param num Number of sequences, each produces one DFT result
+ * \param flags If not NULL, receives the combined INTCFLAG0 and INTCFLAG1 values at the end of each
+ * 			sequence (e.g. ADC min/max flags of that DFT), one entry per result
+ */
+ad5940_result_t ad5940_seq_run_dft(ad5940_t *a, uint8_t id, uint32_t duration_ms,
+		ad5940_dftraw_t *results, uint8_t num, uint32_t *flags);
 
 
 /*
  * Functions (mostly) related to impedance measurements
  */
 ad5940_result_t ad5940_generate_waveform(ad5940_t *a, ad5940_waveinfo_t *w);
+/*
+ * Calculates the frequency control word (WGFCW) of the waveform generator, frequency in mHz
+ */
+uint32_t ad5940_frequency_to_FCW(uint32_t frequency);
 ad5940_result_t ad5940_set_excitation_amplifier(ad5940_t *a,
 		ad5940_ex_amp_dsw_t dsw, ad5940_ex_amp_psw_t psw,
 		ad5940_ex_amp_nsw_t nsw, bool dc_bias);
@@ -535,12 +738,16 @@ uint32_t ad5940_HSTIA_gain_to_value(ad5940_hsrtia_t g);
 ad5940_hsrtia_t ad5940_value_to_HSTIA_gain(uint32_t value);
 
 ad5940_result_t ad5940_set_dft(ad5940_t *a, ad5940_dftconfig_t *dft);
-ad5940_result_t ad5940_get_dft_result(ad5940_t *a, uint8_t avg, ad5940_dftresult_t *data);
+
+void ad5940_dftacc_reset(ad5940_dftacc_t *acc);
+void ad5940_dftacc_add(ad5940_dftacc_t *acc, const ad5940_dftraw_t *raw);
+/*
+ * Converts the mean of the accumulated DFT results to magnitude (relative to 2^17) and phase
+ */
+void ad5940_dftacc_to_polar(const ad5940_dftacc_t *acc, ad5940_dftresult_t *res);
 ad5940_result_t ad5940_setup_four_wire(ad5940_t *a, uint32_t frequency,
 		uint32_t nS_min, uint32_t nS_max, ad5940_ex_amp_dsw_t amp,
 		ad5940_hstsw_t hstsw, uint16_t rseries);
-ad5940_result_t ad5940_measure_four_wire(ad5940_t *a, ad5940_adc_muxp_t p_sense,
-		ad5940_adc_muxn_t n_sense, uint8_t avg, ad5940_dftresult_t *data);
 
 /*
  * \brief Disables all peripherals used in the high speed loop
@@ -575,6 +782,19 @@ uint8_t ad5940_gpio_get(ad5940_t *a, uint8_t gpio);
  */
 void ad5940_take_mutex(ad5940_t *a);
 void ad5940_release_mutex(ad5940_t *a);
+/*
+ * Executes a queue of register writes, register reads and FIFO reads in the given order. Queues with at least
+ * AD5940_DMA_MIN_BYTES are transferred with DMA, the calling task is blocked until the transfer is complete.
+ * The instance mutex is held during the transfer, concurrent calls from other tasks wait for the queue to finish.
+ * Reads of registers in the shadow copy are answered without SPI access.
+ * The other register access functions are wrappers around this function.
+ *
+ * \param xfers Transfers to execute, read results are stored in the entries. FIFO destinations are used as DMA
+ * buffers and must not be placed in the CCM RAM
+ * \param num Number of transfers
+ * \return AD5940_RES_OK on success, AD5940_RES_ERROR on SPI errors or timeouts
+ */
+ad5940_result_t ad5940_execute(ad5940_t *a, ad5940_xfer_t *xfers, uint16_t num);
 void ad5940_write_reg(ad5940_t *a, ad5940_reg_t reg, uint32_t val);
 uint32_t ad5940_read_reg(ad5940_t *a, ad5940_reg_t reg);
 void ad5940_set_bits(ad5940_t *a, ad5940_reg_t reg, uint32_t bits);
@@ -582,6 +802,19 @@ void ad5940_clear_bits(ad5940_t *a, ad5940_reg_t reg, uint32_t bits);
 void ad5940_modify_reg(ad5940_t *a, ad5940_reg_t reg, uint32_t val,
 		uint32_t mask);
 
+/*
+ * Marks all registers in the shadow copy as unknown, the next access reads them over SPI again.
+ * Only required if registers were changed without using the functions above (e.g. reset of the AD5941)
+ */
+void ad5940_invalidate_shadow(ad5940_t *a);
+/*
+ * Returns the number of SPI transactions since the last reset of the statistics
+ *
+ * \param stats Filled with the statistics
+ * \param reset Restarts counting after reading the statistics
+ */
+void ad5940_get_spi_stats(ad5940_t *a, ad5940_spi_stats_t *stats, bool reset);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,579 @@
+#include "ad5940_sim.h"
+
+#ifdef AD5940_SIMULATION
+
+#include "ad5940.h"
+#include "FreeRTOS.h"
+#include "task.h"
+#include <math.h>
+#include <string.h>
+
+#define SIM_MAX_REGISTERS		128
+#define SIM_ACLK				16000000.0f
+#define SIM_ADC_CLK				1600000.0f
+#define SIM_ADC_REFERENCE		1.835f
+#define SIM_RCAL				1500.0f
+// DFT results are 18 bit signed, the ADC fullscale corresponds to 2^17
+#define SIM_DFT_FULLSCALE		131072.0f
+
+// INTCFLAG0/INTCSEL0 bits
+#define SIM_INT_DFT				0x02
+#define SIM_INT_ADCMIN			0x10
+#define SIM_INT_ADCMAX			0x20
+#define SIM_INT_ENDSEQ			0x8000
+
+#define SIM_CMD_MEMORY_WORDS	512
+#define SIM_FIFO_WORDS			512
+
+typedef struct {
+	uint16_t addr;
+	uint32_t val;
+} sim_register_t;
+
+static sim_register_t regs[SIM_MAX_REGISTERS];
+static uint16_t num_regs;
+
+static ad5940_sim_impedance_t dut = { 1000.0f, 0.0f };
+static ad5940_sim_dut_model_t dut_model;
+static void *dut_ctx;
+static float noise;
+static float offset;
+static uint32_t rng_state = 0x12345678;
+
+static ad5940_sim_stats_t stats;
+
+// DFT timing state
+static TickType_t dft_start;
+static uint32_t dft_completed_at_clear;
+static int32_t dft_real, dft_imag;
+
+// Sequencer and data FIFO state
+static uint32_t cmd_memory[SIM_CMD_MEMORY_WORDS];
+static uint32_t fifo[SIM_FIFO_WORDS];
+static uint16_t fifo_read_pos, fifo_cnt;
+/*
+ * A triggered sequence is executed immediately, but its results (FIFO words and flags)
+ * only become visible once the execution time of the sequence has passed
+ */
+static bool seq_running;
+static TickType_t seq_start;
+static uint32_t seq_ticks;
+static uint32_t seq_flags;
+static uint16_t seq_fifo_pending;
+// Level of the interrupt output at the last tick
+static bool int_active;
+
+static sim_register_t* find_reg(uint16_t addr, bool create) {
+	for (uint16_t i = 0; i < num_regs; i++) {
+		if (regs[i].addr == addr) {
+			return &regs[i];
+		}
+	}
+	if (!create || num_regs >= SIM_MAX_REGISTERS) {
+		return NULL;
+	}
+	regs[num_regs].addr = addr;
+	regs[num_regs].val = 0;
+	return &regs[num_regs++];
+}
+
+static uint32_t get(uint16_t addr) {
+	sim_register_t *r = find_reg(addr, false);
+	return r ? r->val : 0;
+}
+
+static void set(uint16_t addr, uint32_t val) {
+	sim_register_t *r = find_reg(addr, true);
+	if (r) {
+		r->val = val;
+	}
+}
+
+static float random_gaussian() {
+	// sum of uniform distributions, good enough to approximate gaussian noise
+	float sum = 0.0f;
+	for (uint8_t i = 0; i < 4; i++) {
+		rng_state = rng_state * 1664525UL + 1013904223UL;
+		sum += (float) (rng_state >> 8) / (1UL << 24);
+	}
+	return (sum - 2.0f) * 1.732f;
+}
+
+static float excitation_frequency() {
+	return (float) get(AD5940_REG_WGFCW) * SIM_ACLK / (1UL << 30);
+}
+
+static float excitation_amplitude() {
+	uint32_t afecon = get(AD5940_REG_AFECON);
+	if (!(afecon & (1UL << 14)) || (get(AD5940_REG_WGCON) & 0x06) != 0x04) {
+		// waveform generator disabled or not in sine mode
+		return 0.0f;
+	}
+	if (!(afecon & (1UL << 20))) {
+		// excitation amplifier disabled
+		return 0.0f;
+	}
+	// see ad5940_generate_waveform for the HSDACCON fullscale options
+	float fullscale;
+	switch (get(AD5940_REG_HSDACCON) & 0x1001) {
+	case 0x0000: fullscale = 0.6f; break;
+	case 0x0001: fullscale = 0.12f; break;
+	case 0x1000: fullscale = 0.075f; break;
+	default: fullscale = 0.015f; break;
+	}
+	return (float) (get(AD5940_REG_WGAMPLITUDE) & 0x07FF) * fullscale / 2047;
+}
+
+static float rtia_value() {
+	static const float values[] = { 200.0f, 1000.0f, 5000.0f, 10000.0f,
+			20000.0f, 40000.0f, 80000.0f, 160000.0f };
+	uint8_t rtia = get(AD5940_REG_HSRTIACON) & 0x0F;
+	if (rtia >= sizeof(values) / sizeof(values[0])) {
+		return 0.0f;
+	}
+	return values[rtia];
+}
+
+static float pga_gain() {
+	switch (get(AD5940_REG_ADCCON) & 0x00070000) {
+	case AD5940_PGA_GAIN_1_5: return 1.5f;
+	case AD5940_PGA_GAIN_2: return 2.0f;
+	case AD5940_PGA_GAIN_4: return 4.0f;
+	case AD5940_PGA_GAIN_9: return 9.0f;
+	default: return 1.0f;
+	}
+}
+
+/*
+ * Calculates the complex peak voltage at the ADC input (after the PGA)
+ */
+static void adc_signal(float *re, float *im) {
+	*re = 0.0f;
+	*im = 0.0f;
+	float amplitude = excitation_amplitude();
+	float rtia = rtia_value();
+	if (amplitude == 0.0f || rtia == 0.0f) {
+		return;
+	}
+	// select impedance in the measurement path based on the switch matrix
+	uint32_t swcon = get(AD5940_REG_SWCON);
+	ad5940_sim_impedance_t z;
+	if ((swcon & 0x0F) == AD5940_EXAMP_DSW_RCAL0
+			&& (swcon & 0xF000) == AD5940_HSTSW_RCAL1) {
+		z.real = SIM_RCAL;
+		z.imag = 0.0f;
+	} else if ((swcon & 0x0F) == AD5940_EXAMP_DSW_CE0
+			&& (swcon & 0xF000) == AD5940_HSTSW_DE0_DIRECT) {
+		z = dut_model ? dut_model(dut_ctx, excitation_frequency()) : dut;
+	} else {
+		// no closed path
+		return;
+	}
+	// excitation current I = U / Z
+	float norm = z.real * z.real + z.imag * z.imag;
+	if (norm < 1e-12f) {
+		norm = 1e-12f;
+	}
+	float i_re = amplitude * z.real / norm;
+	float i_im = -amplitude * z.imag / norm;
+
+	uint32_t adccon = get(AD5940_REG_ADCCON);
+	uint32_t muxp = adccon & 0x003F;
+	uint32_t muxn = adccon & 0x1F00;
+	if (muxp == AD5940_ADC_MUXP_HSTIAP && muxn == AD5940_ADC_MUXN_HSTIAN) {
+		// current measurement through the TIA
+		*re = i_re * rtia;
+		*im = i_im * rtia;
+	} else if ((muxp == AD5940_ADC_MUXP_AIN1 && muxn == AD5940_ADC_MUXN_AIN0)
+			|| (muxp == AD5940_ADC_MUXP_AIN2 && muxn == AD5940_ADC_MUXN_AIN3)) {
+		// voltage across the impedance
+		*re = i_re * z.real - i_im * z.imag;
+		*im = i_re * z.imag + i_im * z.real;
+	}
+	float gain = pga_gain();
+	*re *= gain;
+	*im *= gain;
+}
+
+static bool adc_running() {
+	uint32_t afecon = get(AD5940_REG_AFECON);
+	return (afecon & 0x0180) == 0x0180;
+}
+
+static float adc_rate() {
+	return get(AD5940_REG_ADCFILTERCON) & 0x01 ? SIM_ADC_CLK / 2 : SIM_ADC_CLK;
+}
+
+static float dft_duration_ms() {
+	uint32_t dftcon = get(AD5940_REG_DFTCON);
+	uint32_t filtercon = get(AD5940_REG_ADCFILTERCON);
+	float rate = adc_rate();
+	if (filtercon & (1UL << 7)) {
+		// averaging filter as DFT source
+		rate /= 2 << ((filtercon >> 14) & 0x03);
+	} else {
+		switch ((dftcon >> 20) & 0x03) {
+		case 0: // SINC2 output
+			rate /= 4 * 178;
+			break;
+		case 1: // SINC3 output
+			if (!(filtercon & (1UL << 6))) {
+				rate /= 4;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	uint32_t points = 4UL << ((dftcon >> 4) & 0x0F);
+	return 1000.0f * points / rate;
+}
+
+static uint32_t dft_completions() {
+	float elapsed = (xTaskGetTickCount() - dft_start) * portTICK_PERIOD_MS;
+	return elapsed / dft_duration_ms();
+}
+
+static void restart_dft() {
+	dft_start = xTaskGetTickCount();
+	dft_completed_at_clear = 0;
+}
+
+/*
+ * Checks the current ADC signal against the min/max limits
+ */
+static uint32_t adc_limit_flags() {
+	uint32_t flags = 0;
+	float re, im;
+	adc_signal(&re, &im);
+	float peak = sqrtf(re * re + im * im);
+	int32_t code_max = 32768 + peak / SIM_ADC_REFERENCE * 32768;
+	int32_t code_min = 32768 - peak / SIM_ADC_REFERENCE * 32768;
+	uint32_t adcmax = get(AD5940_REG_ADCMAX);
+	uint32_t adcmin = get(AD5940_REG_ADCMIN);
+	if (adcmax && code_max > (int32_t) adcmax) {
+		flags |= SIM_INT_ADCMAX;
+	}
+	if (adcmin && code_min < (int32_t) adcmin) {
+		flags |= SIM_INT_ADCMIN;
+	}
+	return flags;
+}
+
+/*
+ * Sets interrupt flags in INTCFLAG0/INTCFLAG1, depending on the sources selected in INTCSEL0/INTCSEL1
+ */
+static void raise_flags(uint32_t flags) {
+	set(AD5940_REG_INTCFLAG0, get(AD5940_REG_INTCFLAG0)
+			| (flags & get(AD5940_REG_INTCSEL0)));
+	set(AD5940_REG_INTCFLAG1, get(AD5940_REG_INTCFLAG1)
+			| (flags & get(AD5940_REG_INTCSEL1)));
+}
+
+static void update_sequencer() {
+	if (seq_running && xTaskGetTickCount() - seq_start >= seq_ticks) {
+		seq_running = false;
+		seq_fifo_pending = 0;
+		raise_flags(seq_flags | SIM_INT_ENDSEQ);
+	}
+}
+
+static void update_flags() {
+	update_sequencer();
+	if (!adc_running()) {
+		return;
+	}
+	// check the ADC limits
+	uint32_t flags = adc_limit_flags();
+	// check for finished DFT
+	if ((get(AD5940_REG_AFECON) & (1UL << 15))
+			&& dft_completions() > dft_completed_at_clear) {
+		flags |= SIM_INT_DFT;
+	}
+	raise_flags(flags);
+}
+
+static void latch_dft_result() {
+	float re, im;
+	adc_signal(&re, &im);
+	float real = re / SIM_ADC_REFERENCE * SIM_DFT_FULLSCALE;
+	float imag = im / SIM_ADC_REFERENCE * SIM_DFT_FULLSCALE;
+	bool hanning = get(AD5940_REG_DFTCON) & 0x01;
+	if (offset != 0.0f) {
+		/*
+		 * Leakage of the ADC offset into the DFT, vanishes for an integer number of periods k. The
+		 * rectangular window responds with 2*sin(pi*k)/(pi*k)*e^(-j*pi*k), the Hann window additionally
+		 * attenuates by 1/(1-k^2)
+		 */
+		float periods = excitation_frequency() * dft_duration_ms() / 1000.0f;
+		float frac = periods - floorf(periods);
+		float leakage = 2 * offset * SIM_DFT_FULLSCALE * sinf(M_PI * frac) / (M_PI * periods);
+		if (hanning) {
+			leakage /= 1.0f - periods * periods;
+		}
+		real += leakage * cosf(M_PI * frac);
+		imag -= leakage * sinf(M_PI * frac);
+	}
+	if (noise > 0.0f) {
+		// noise of the captured ADC samples, reduced by the DFT depending on the noise bandwidth of the window
+		float samples = dft_duration_ms() / 1000.0f * adc_rate();
+		float sigma = noise * sqrtf(2 * (hanning ? 1.5f : 1.0f) / samples) * SIM_DFT_FULLSCALE;
+		real += random_gaussian() * sigma;
+		imag += random_gaussian() * sigma;
+	}
+	// the DFT reports the imaginary part with inverted sign
+	imag = -imag;
+	// saturate to 18 bit range
+	if (real > 131071.0f) {
+		real = 131071.0f;
+	} else if (real < -131072.0f) {
+		real = -131072.0f;
+	}
+	if (imag > 131071.0f) {
+		imag = 131071.0f;
+	} else if (imag < -131072.0f) {
+		imag = -131072.0f;
+	}
+	dft_real = real;
+	dft_imag = imag;
+	stats.dft_results++;
+}
+
+static void fifo_flush() {
+	fifo_read_pos = 0;
+	fifo_cnt = 0;
+	seq_fifo_pending = 0;
+}
+
+static void fifo_push(uint32_t word) {
+	uint32_t fifocon = get(AD5940_REG_FIFOCON);
+	if (!(fifocon & (1UL << 11)) || ((fifocon >> 13) & 0x07) != AD5940_FIFOSRC_DFT) {
+		// FIFO disabled or not fed by the DFT
+		return;
+	}
+	if (fifo_cnt >= SIM_FIFO_WORDS) {
+		return;
+	}
+	fifo[(fifo_read_pos + fifo_cnt) % SIM_FIFO_WORDS] = word;
+	fifo_cnt++;
+}
+
+static uint32_t fifo_pop() {
+	update_sequencer();
+	if (fifo_cnt <= seq_fifo_pending) {
+		return 0;
+	}
+	uint32_t word = fifo[fifo_read_pos];
+	fifo_read_pos = (fifo_read_pos + 1) % SIM_FIFO_WORDS;
+	fifo_cnt--;
+	stats.fifo_reads++;
+	return word;
+}
+
+static bool dft_active(uint32_t afecon) {
+	// ADC powered, converting and DFT enabled
+	return (afecon & 0x8180) == 0x8180;
+}
+
+static void run_sequence(uint8_t id) {
+	static const uint16_t info_regs[] = { AD5940_REG_SEQ0INFO,
+			AD5940_REG_SEQ1INFO, AD5940_REG_SEQ2INFO, AD5940_REG_SEQ3INFO };
+	if (!(get(AD5940_REG_SEQCON) & 0x01) || id >= 4) {
+		// sequencer disabled
+		return;
+	}
+	uint32_t info = get(info_regs[id]);
+	uint16_t start = info & 0x07FF;
+	uint16_t len = (info >> 16) & 0x07FF;
+	float time_ms = 0.0f;
+	float dft_started = -1.0f;
+	uint16_t fifo_before = fifo_cnt;
+	seq_flags = 0;
+	for (uint16_t i = start; i < start + len && i < SIM_CMD_MEMORY_WORDS; i++) {
+		uint32_t cmd = cmd_memory[i];
+		if (cmd & 0x80000000UL) {
+			// register write
+			uint16_t addr = 0x2000 + (((cmd >> 24) & 0x7F) << 2);
+			uint32_t data = cmd & 0x00FFFFFF;
+			if (addr == AD5940_REG_AFECON) {
+				bool was_active = dft_active(get(AD5940_REG_AFECON));
+				if (!was_active && dft_active(data)) {
+					dft_started = time_ms;
+				} else if (was_active && !dft_active(data) && dft_started >= 0.0f) {
+					seq_flags |= adc_limit_flags();
+					uint32_t completed = (time_ms - dft_started) / dft_duration_ms();
+					while (completed--) {
+						latch_dft_result();
+						fifo_push((uint32_t) dft_real & 0x3FFFF);
+						fifo_push((uint32_t) dft_imag & 0x3FFFF);
+					}
+					dft_started = -1.0f;
+				}
+			}
+			set(addr, data);
+		} else if (!(cmd & 0x40000000UL)) {
+			// wait command
+			time_ms += (cmd & 0x3FFFFFFF) * 1000.0f / SIM_ACLK;
+		}
+		// timeout commands are not modeled
+	}
+	seq_running = true;
+	seq_start = xTaskGetTickCount();
+	seq_ticks = ceilf(time_ms / portTICK_PERIOD_MS);
+	seq_fifo_pending = fifo_cnt - fifo_before;
+}
+
+void ad5940_sim_reset(void) {
+	num_regs = 0;
+	memset(regs, 0, sizeof(regs));
+	memset(cmd_memory, 0, sizeof(cmd_memory));
+	fifo_flush();
+	seq_running = false;
+	int_active = false;
+	set(AD5940_REG_ADIID, 0x4144);
+	set(AD5940_REG_CHIPID, 0x5502);
+	set(AD5940_REG_ADCMAX, 0);
+	set(AD5940_REG_ADCMIN, 0);
+	restart_dft();
+	dft_real = 0;
+	dft_imag = 0;
+}
+
+void ad5940_sim_set_dut(ad5940_sim_impedance_t z) {
+	dut = z;
+	dut_model = NULL;
+}
+
+void ad5940_sim_set_dut_model(ad5940_sim_dut_model_t model, void *ctx) {
+	dut_model = model;
+	dut_ctx = ctx;
+}
+
+void ad5940_sim_set_noise(float relative) {
+	noise = relative;
+}
+
+void ad5940_sim_set_offset(float relative) {
+	offset = relative;
+}
+
+bool ad5940_sim_tick(void) {
+	if (!num_regs) {
+		return false;
+	}
+	update_flags();
+	// GPIO0 is the INT0 output unless another function is selected in GP0CON, the polarity
+	// (INTCPOL) is not modeled
+	bool active = !(get(AD5940_REG_GP0CON) & 0x03) && get(AD5940_REG_INTCFLAG0);
+	bool edge = active && !int_active;
+	int_active = active;
+	return edge;
+}
+
+void ad5940_sim_get_stats(ad5940_sim_stats_t *s) {
+	*s = stats;
+}
+
+void ad5940_sim_reset_stats(void) {
+	memset(&stats, 0, sizeof(stats));
+}
+
+void ad5940_sim_write_reg(uint16_t reg, uint32_t val) {
+	stats.writes++;
+	if (!num_regs) {
+		ad5940_sim_reset();
+	}
+	switch (reg) {
+	case AD5940_REG_INTCCLR:
+		update_flags();
+		set(AD5940_REG_INTCFLAG0, get(AD5940_REG_INTCFLAG0) & ~val);
+		set(AD5940_REG_INTCFLAG1, get(AD5940_REG_INTCFLAG1) & ~val);
+		if (val & SIM_INT_DFT) {
+			dft_completed_at_clear = dft_completions();
+		}
+		break;
+	case AD5940_REG_AFECON: {
+		uint32_t old = get(AD5940_REG_AFECON);
+		set(reg, val);
+		// starting the ADC or the DFT restarts the DFT calculation
+		uint32_t started = val & ~old;
+		if (started & ((1UL << 8) | (1UL << 15))) {
+			restart_dft();
+		}
+	}
+		break;
+	case AD5940_REG_ADCCON:
+		set(reg, val);
+		restart_dft();
+		break;
+	case AD5940_REG_CMDFIFOWRITE: {
+		uint32_t addr = get(AD5940_REG_CMDFIFOWADDR);
+		if (addr < SIM_CMD_MEMORY_WORDS) {
+			cmd_memory[addr] = val;
+		}
+	}
+		break;
+	case AD5940_REG_TRIGSEQ:
+		for (uint8_t i = 0; i < 4; i++) {
+			if (val & (1UL << i)) {
+				run_sequence(i);
+			}
+		}
+		break;
+	case AD5940_REG_FIFOCON:
+		if (!(val & (1UL << 11))) {
+			// disabling the FIFO flushes it
+			fifo_flush();
+		}
+		set(reg, val);
+		break;
+	case AD5940_REG_GP0SET:
+		set(AD5940_REG_GP0OUT, get(AD5940_REG_GP0OUT) | val);
+		break;
+	case AD5940_REG_GP0CLR:
+		set(AD5940_REG_GP0OUT, get(AD5940_REG_GP0OUT) & ~val);
+		break;
+	case AD5940_REG_GP0TGL:
+		set(AD5940_REG_GP0OUT, get(AD5940_REG_GP0OUT) ^ val);
+		break;
+	default:
+		set(reg, val);
+		break;
+	}
+}
+
+uint32_t ad5940_sim_read_reg(uint16_t reg) {
+	stats.reads++;
+	if (!num_regs) {
+		ad5940_sim_reset();
+	}
+	switch (reg) {
+	case AD5940_REG_INTCFLAG0:
+	case AD5940_REG_INTCFLAG1:
+		update_flags();
+		return get(reg);
+	case AD5940_REG_DFTREAL:
+		latch_dft_result();
+		return (uint32_t) dft_real & 0x3FFFF;
+	case AD5940_REG_DFTIMAG:
+		return (uint32_t) dft_imag & 0x3FFFF;
+	case AD5940_REG_DATAFIFORD:
+		return fifo_pop();
+	case AD5940_REG_FIFOCNTSTA:
+		update_sequencer();
+		return (uint32_t) (fifo_cnt - seq_fifo_pending) << 16;
+	case AD5940_REG_ADCDAT:
+	case AD5940_REG_SINC2DAT:
+		// no DC signal in the model, ADC sits at midscale
+		return 32768;
+	case AD5940_REG_OSCCON:
+		// external crystal always reported as running
+		return get(reg) | 0x0400;
+	case AD5940_REG_GP0IN:
+		return get(AD5940_REG_GP0OUT);
+	default:
+		return get(reg);
+	}
+}
+
+#endif
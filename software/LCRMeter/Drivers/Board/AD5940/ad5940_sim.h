@@ -0,0 +1,84 @@
+#ifndef IOX_AD5940_AD5940_SIM_H_
+#define IOX_AD5940_AD5940_SIM_H_
+
+/*
+ * Register-level model of the AD5941 analog frontend.
+ *
+ * Only compiled when AD5940_SIMULATION is defined (host builds). In that case
+ * the SPI register access in ad5940.c is replaced by the functions below. The
+ * model covers the parts of the chip used by the LCR frontend:
+ * - waveform generator frequency/amplitude (WGFCW, WGAMPLITUDE, HSDACCON)
+ * - high speed TIA gain (HSRTIACON) and the switch matrix (SWCON)
+ * - ADC mux and PGA gain (ADCCON)
+ * - DFT timing (DFTCON, ADCFILTERCON) and results (DFTREAL, DFTIMAG)
+ * - DFT ready, end of sequence and ADC min/max flags (INTCSELx, INTCFLAGx, INTCCLR) and the
+ *   interrupt output on GPIO0 (see ad5940_sim_tick)
+ * - sequencer write/wait commands (CMDFIFOWADDR, CMDFIFOWRITE, SEQxINFO, TRIGSEQ) and
+ *   DFT results in the data FIFO (FIFOCON, FIFOCNTSTA, DATAFIFORD)
+ * The signal levels are derived from a configurable complex impedance of the
+ * device under test. Optional ADC noise and offset reach the DFT results depending on the capture
+ * length and window (DFTCON, ADCFILTERCON), like on the real chip.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct {
+	float real, imag;
+} ad5940_sim_impedance_t;
+
+/*
+ * Optional frequency dependent DUT model, frequency in Hz
+ */
+typedef ad5940_sim_impedance_t (*ad5940_sim_dut_model_t)(void *ctx, float frequency);
+
+typedef struct {
+	// number of register accesses handled by the model
+	uint32_t reads;
+	uint32_t writes;
+	// number of words read from the data FIFO
+	uint32_t fifo_reads;
+	// number of DFT results read back
+	uint32_t dft_results;
+} ad5940_sim_stats_t;
+
+/*
+ * Resets all registers to their power-on values. DUT configuration and statistics are kept.
+ */
+void ad5940_sim_reset(void);
+
+void ad5940_sim_set_dut(ad5940_sim_impedance_t z);
+void ad5940_sim_set_dut_model(ad5940_sim_dut_model_t model, void *ctx);
+/*
+ * Sets the RMS noise of the ADC samples, relative to the ADC fullscale (0 disables noise). The noise of
+ * a DFT result decreases with the number of captured samples.
+ */
+void ad5940_sim_set_noise(float relative);
+/*
+ * Sets the ADC offset, relative to the ADC fullscale. It leaks into DFT results that do not cover an
+ * integer number of periods.
+ */
+void ad5940_sim_set_offset(float relative);
+
+/*
+ * Advances the model to the current tick, has to be called on every tick (vApplicationTickHook).
+ * Returns true if the interrupt output (GPIO0, active low while a flag in INTCFLAG0 is set) had a
+ * falling edge since the last call, the caller then runs the EXTI interrupt of the INT pin
+ */
+bool ad5940_sim_tick(void);
+
+void ad5940_sim_get_stats(ad5940_sim_stats_t *stats);
+void ad5940_sim_reset_stats(void);
+
+void ad5940_sim_write_reg(uint16_t reg, uint32_t val);
+uint32_t ad5940_sim_read_reg(uint16_t reg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
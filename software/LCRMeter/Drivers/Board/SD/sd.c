@@ -0,0 +1,470 @@
+#include "sd.h"
+
+#ifndef SD_IMAGE
+
+#include "stm.h"
+#include "main.h"
+#include "log.h"
+#include "FreeRTOS.h"
+#include "semphr.h"
+#include "task.h"
+
+#define Log_SD		(LevelDebug|LevelInfo|LevelWarn|LevelError|LevelCrit)
+
+extern SPI_HandleTypeDef hspi1;
+extern SemaphoreHandle_t xMutexSPI1;
+
+// application specific commands are sent after CMD55
+#define SD_ACMD			0x80
+
+typedef enum {
+	SD_CMD0 = 0,	// GO_IDLE_STATE
+	SD_CMD1 = 1,	// SEND_OP_COND (MMC)
+	SD_CMD8 = 8,	// SEND_IF_COND
+	SD_CMD9 = 9,	// SEND_CSD
+	SD_CMD12 = 12,	// STOP_TRANSMISSION
+	SD_CMD16 = 16,	// SET_BLOCKLEN
+	SD_CMD17 = 17,	// READ_SINGLE_BLOCK
+	SD_CMD18 = 18,	// READ_MULTIPLE_BLOCK
+	SD_CMD24 = 24,	// WRITE_BLOCK
+	SD_CMD25 = 25,	// WRITE_MULTIPLE_BLOCK
+	SD_CMD55 = 55,	// APP_CMD
+	SD_CMD58 = 58,	// READ_OCR
+	SD_ACMD23 = SD_ACMD | 23,	// SET_WR_BLK_ERASE_COUNT
+	SD_ACMD41 = SD_ACMD | 41,	// SD_SEND_OP_COND
+} sd_cmd_t;
+
+// data tokens
+#define SD_TOKEN_START_BLOCK		0xFE
+#define SD_TOKEN_START_MULTIPLE		0xFC
+#define SD_TOKEN_STOP_MULTIPLE		0xFD
+#define SD_DATA_RESPONSE_MASK		0x1F
+#define SD_DATA_ACCEPTED			0x05
+
+// timeouts in ms
+#define SD_TIMEOUT_INIT				1000
+#define SD_TIMEOUT_READY			500
+#define SD_TIMEOUT_READ_TOKEN		200
+
+static sd_type_t type = SD_TYPE_NONE;
+static uint32_t sectors;
+// SPI configuration of the previous user of SPI1
+static uint16_t savedCR1;
+
+static void cs_low(void) {
+	SD_CS_GPIO_Port->BRR = SD_CS_Pin;
+}
+
+static void cs_high(void) {
+	SD_CS_GPIO_Port->BSRR = SD_CS_Pin;
+}
+
+static bool timed_out(TickType_t start, uint32_t timeout_ms) {
+	return xTaskGetTickCount() - start >= timeout_ms / portTICK_PERIOD_MS;
+}
+
+static uint8_t xchg(uint8_t byte) {
+	SPI_TypeDef *spi = hspi1.Instance;
+	while (!(spi->SR & SPI_SR_TXE));
+	*(__IO uint8_t*) &spi->DR = byte;
+	while (!(spi->SR & SPI_SR_RXNE));
+	return *(__IO uint8_t*) &spi->DR;
+}
+
+#ifdef SD_USE_DMA
+static volatile bool dmaBusy, dmaError;
+// given by the DMA interrupt when the transfer is done
+static StaticSemaphore_t dmaDoneBuffer;
+static SemaphoreHandle_t dmaDone;
+
+static void dma_stop(void) {
+	hspi1.Instance->CR2 &= ~(SPI_CR2_RXDMAEN | SPI_CR2_TXDMAEN);
+	SD_DMA_RX_CHANNEL->CCR = 0;
+	SD_DMA_TX_CHANNEL->CCR = 0;
+}
+
+void SD_DMA_RX_IRQHandler(void) {
+	bool error = SD_DMA_ERROR();
+	SD_DMA_CLEAR_FLAGS();
+	if (!dmaBusy) {
+		return;
+	}
+	// receive complete -> all bytes have been transmitted as well
+	dma_stop();
+	dmaError = error;
+	dmaBusy = false;
+	BaseType_t woken = pdFALSE;
+	xSemaphoreGiveFromISR(dmaDone, &woken);
+	portYIELD_FROM_ISR(woken);
+}
+#endif
+
+/*
+ * Transfers a data block. Without tx, 0xFF is transmitted, without rx the received data is discarded
+ */
+static bool transfer(const uint8_t *tx, uint8_t *rx, uint16_t len) {
+#ifdef SD_USE_DMA
+	static const uint8_t idle = 0xFF;
+	static uint8_t discard;
+	SPI_TypeDef *spi = hspi1.Instance;
+	// discard stale data in the receive FIFO
+	while (spi->SR & SPI_SR_FRLVL) {
+		(void) *(__IO uint8_t*) &spi->DR;
+	}
+	dmaError = false;
+	dmaBusy = true;
+	SD_DMA_CLEAR_FLAGS();
+	SD_DMA_RX_CHANNEL->CPAR = (uint32_t) &spi->DR;
+	SD_DMA_RX_CHANNEL->CMAR = rx ? (uint32_t) rx : (uint32_t) &discard;
+	SD_DMA_RX_CHANNEL->CNDTR = len;
+	SD_DMA_RX_CHANNEL->CCR = (rx ? DMA_CCR_MINC : 0) | DMA_CCR_TCIE | DMA_CCR_TEIE | DMA_CCR_EN;
+	SD_DMA_TX_CHANNEL->CPAR = (uint32_t) &spi->DR;
+	SD_DMA_TX_CHANNEL->CMAR = tx ? (uint32_t) tx : (uint32_t) &idle;
+	SD_DMA_TX_CHANNEL->CNDTR = len;
+	SD_DMA_TX_CHANNEL->CCR = (tx ? DMA_CCR_MINC : 0) | DMA_CCR_DIR | DMA_CCR_EN;
+	// RX request has to be enabled first
+	spi->CR2 |= SPI_CR2_RXDMAEN;
+	spi->CR2 |= SPI_CR2_TXDMAEN;
+	const TickType_t timeout = 100 / portTICK_PERIOD_MS;
+	TickType_t start = xTaskGetTickCount();
+	while (dmaBusy) {
+		TickType_t elapsed = xTaskGetTickCount() - start;
+		if (elapsed >= timeout) {
+			HAL_NVIC_DisableIRQ(SD_DMA_RX_IRQn);
+			if (dmaBusy) {
+				dma_stop();
+				dmaBusy = false;
+				dmaError = true;
+			}
+			HAL_NVIC_EnableIRQ(SD_DMA_RX_IRQn);
+			break;
+		}
+		// a late completion of a timed out transfer might have left the semaphore given, check again
+		xSemaphoreTake(dmaDone, timeout - elapsed);
+	}
+	return !dmaError;
+#else
+	for (uint16_t i = 0; i < len; i++) {
+		uint8_t r = xchg(tx ? tx[i] : 0xFF);
+		if (rx) {
+			rx[i] = r;
+		}
+	}
+	return true;
+#endif
+}
+
+/*
+ * Waits until the card releases the busy signal (DO high)
+ */
+static bool wait_ready(uint32_t timeout_ms) {
+	TickType_t start = xTaskGetTickCount();
+	while (xchg(0xFF) != 0xFF) {
+		if (timed_out(start, timeout_ms)) {
+			return false;
+		}
+		if (xTaskGetTickCount() != start) {
+			// long busy phase (e.g. erasing), let the other tasks run
+			vTaskDelay(1);
+		}
+	}
+	return true;
+}
+
+static void deselect(void) {
+	cs_high();
+	// the card only releases DO with the next clock
+	xchg(0xFF);
+}
+
+static bool select(void) {
+	cs_low();
+	if (wait_ready(SD_TIMEOUT_READY)) {
+		return true;
+	}
+	deselect();
+	return false;
+}
+
+static bool bus_acquire(uint16_t prescaler) {
+	if (!xSemaphoreTake(xMutexSPI1, SD_MUTEX_TIMEOUT / portTICK_PERIOD_MS)) {
+		return false;
+	}
+	SPI_TypeDef *spi = hspi1.Instance;
+	savedCR1 = spi->CR1;
+	spi->CR1 = (savedCR1 & ~SPI_BAUDRATEPRESCALER_256) | prescaler | SPI_CR1_SPE;
+	// RXNE after every byte
+	spi->CR2 |= SPI_CR2_FRXTH;
+	return true;
+}
+
+static void bus_release(void) {
+	deselect();
+	hspi1.Instance->CR1 = savedCR1;
+	xSemaphoreGive(xMutexSPI1);
+}
+
+/*
+ * Sends a command frame, returns the R1 response (0xFF on timeout)
+ */
+static uint8_t send_cmd(uint8_t cmd, uint32_t arg) {
+	if (cmd & SD_ACMD) {
+		cmd &= ~SD_ACMD;
+		uint8_t r1 = send_cmd(SD_CMD55, 0);
+		if (r1 > 1) {
+			return r1;
+		}
+	}
+	if (cmd != SD_CMD12) {
+		// CMD12 is sent during a transfer, the card is never ready at this point
+		deselect();
+		if (!select()) {
+			return 0xFF;
+		}
+	}
+	uint8_t frame[6];
+	frame[0] = 0x40 | cmd;
+	frame[1] = arg >> 24;
+	frame[2] = arg >> 16;
+	frame[3] = arg >> 8;
+	frame[4] = arg;
+	// CRC is only checked for CMD0 and CMD8
+	frame[5] = cmd == SD_CMD0 ? 0x95 : cmd == SD_CMD8 ? 0x87 : 0x01;
+	for (uint8_t i = 0; i < sizeof(frame); i++) {
+		xchg(frame[i]);
+	}
+	if (cmd == SD_CMD12) {
+		// skip stuff byte
+		xchg(0xFF);
+	}
+	uint8_t r1;
+	uint8_t tries = 10;
+	do {
+		r1 = xchg(0xFF);
+	} while ((r1 & 0x80) && --tries);
+	return r1;
+}
+
+static bool receive_block(uint8_t *buf, uint16_t len) {
+	TickType_t start = xTaskGetTickCount();
+	uint8_t token;
+	while ((token = xchg(0xFF)) == 0xFF) {
+		if (timed_out(start, SD_TIMEOUT_READ_TOKEN)) {
+			return false;
+		}
+	}
+	if (token != SD_TOKEN_START_BLOCK) {
+		return false;
+	}
+	if (!transfer(NULL, buf, len)) {
+		return false;
+	}
+	// CRC is not checked
+	xchg(0xFF);
+	xchg(0xFF);
+	return true;
+}
+
+static bool transmit_block(const uint8_t *buf, uint8_t token) {
+	if (!wait_ready(SD_TIMEOUT_READY)) {
+		return false;
+	}
+	xchg(token);
+	if (token == SD_TOKEN_STOP_MULTIPLE) {
+		return true;
+	}
+	if (!transfer(buf, NULL, SD_SECTOR_SIZE)) {
+		return false;
+	}
+	// dummy CRC
+	xchg(0xFF);
+	xchg(0xFF);
+	return (xchg(0xFF) & SD_DATA_RESPONSE_MASK) == SD_DATA_ACCEPTED;
+}
+
+static uint32_t csd_sectors(const uint8_t *csd) {
+	if ((csd[0] >> 6) == 1) {
+		// CSD version 2.0 (SDHC/SDXC)
+		uint32_t csize = csd[9] + ((uint32_t) csd[8] << 8) + ((uint32_t) (csd[7] & 0x3F) << 16) + 1;
+		return csize << 10;
+	} else {
+		// CSD version 1.0 (SDSC/MMC)
+		uint8_t n = (csd[5] & 0x0F) + ((csd[10] & 0x80) >> 7) + ((csd[9] & 0x03) << 1) + 2;
+		uint32_t csize = (csd[8] >> 6) + ((uint16_t) csd[7] << 2) + ((uint16_t) (csd[6] & 0x03) << 10) + 1;
+		return csize << (n - 9);
+	}
+}
+
+sd_result_t sd_init(void) {
+#ifdef SD_USE_DMA
+	static bool dmaInitialized = false;
+	if (!dmaInitialized) {
+		dmaDone = xSemaphoreCreateBinaryStatic(&dmaDoneBuffer);
+		SD_DMA_CLK_ENABLE();
+		HAL_NVIC_SetPriority(SD_DMA_RX_IRQn, 5, 0);
+		HAL_NVIC_EnableIRQ(SD_DMA_RX_IRQn);
+		dmaInitialized = true;
+	}
+#endif
+	if (!bus_acquire(SD_SPI_PRESCALER_INIT)) {
+		return SD_RES_BUSY;
+	}
+	type = SD_TYPE_NONE;
+	sectors = 0;
+	// at least 74 clocks with CS high to enter the native mode
+	cs_high();
+	for (uint8_t i = 0; i < 10; i++) {
+		xchg(0xFF);
+	}
+	sd_type_t t = SD_TYPE_NONE;
+	uint8_t ocr[4];
+	if (send_cmd(SD_CMD0, 0) == 1) {
+		TickType_t start = xTaskGetTickCount();
+		if (send_cmd(SD_CMD8, 0x1AA) == 1) {
+			// SD version 2, check the voltage range
+			for (uint8_t i = 0; i < 4; i++) {
+				ocr[i] = xchg(0xFF);
+			}
+			if (ocr[2] == 0x01 && ocr[3] == 0xAA) {
+				// initialize with HCS bit set
+				while (send_cmd(SD_ACMD41, 1UL << 30) && !timed_out(start, SD_TIMEOUT_INIT)) {
+					vTaskDelay(1);
+				}
+				if (!timed_out(start, SD_TIMEOUT_INIT) && send_cmd(SD_CMD58, 0) == 0) {
+					for (uint8_t i = 0; i < 4; i++) {
+						ocr[i] = xchg(0xFF);
+					}
+					// CCS bit: block addressing
+					t = (ocr[0] & 0x40) ? SD_TYPE_SDHC : SD_TYPE_SDV2;
+				}
+			}
+		} else {
+			// SD version 1 or MMC
+			uint8_t cmd;
+			if (send_cmd(SD_ACMD41, 0) <= 1) {
+				t = SD_TYPE_SDV1;
+				cmd = SD_ACMD41;
+			} else {
+				t = SD_TYPE_MMC;
+				cmd = SD_CMD1;
+			}
+			while (send_cmd(cmd, 0) && !timed_out(start, SD_TIMEOUT_INIT)) {
+				vTaskDelay(1);
+			}
+			if (timed_out(start, SD_TIMEOUT_INIT) || send_cmd(SD_CMD16, SD_SECTOR_SIZE) != 0) {
+				t = SD_TYPE_NONE;
+			}
+		}
+	}
+	if (t != SD_TYPE_NONE) {
+		// identification complete, switch to the fast clock
+		SPI_TypeDef *spi = hspi1.Instance;
+		spi->CR1 = (spi->CR1 & ~SPI_BAUDRATEPRESCALER_256) | SD_SPI_PRESCALER_FAST;
+		uint8_t csd[16];
+		if (send_cmd(SD_CMD9, 0) == 0 && receive_block(csd, sizeof(csd))) {
+			sectors = csd_sectors(csd);
+		} else {
+			t = SD_TYPE_NONE;
+		}
+	}
+	bus_release();
+	type = t;
+	if (type == SD_TYPE_NONE) {
+		LOG(Log_SD, LevelWarn, "No card detected");
+		return SD_RES_NOCARD;
+	}
+	LOG(Log_SD, LevelInfo, "Card type %u, %lu sectors", type, sectors);
+	return SD_RES_OK;
+}
+
+bool sd_initialized(void) {
+	return type != SD_TYPE_NONE;
+}
+
+sd_type_t sd_type(void) {
+	return type;
+}
+
+uint32_t sd_sector_count(void) {
+	return sectors;
+}
+
+sd_result_t sd_read(uint8_t *buf, uint32_t sector, uint32_t count) {
+	if (type == SD_TYPE_NONE) {
+		return SD_RES_NOCARD;
+	}
+	if (!count) {
+		return SD_RES_OK;
+	}
+	if (type != SD_TYPE_SDHC) {
+		// byte addressing
+		sector *= SD_SECTOR_SIZE;
+	}
+	if (!bus_acquire(SD_SPI_PRESCALER_FAST)) {
+		return SD_RES_BUSY;
+	}
+	if (count == 1) {
+		if (send_cmd(SD_CMD17, sector) == 0 && receive_block(buf, SD_SECTOR_SIZE)) {
+			count = 0;
+		}
+	} else if (send_cmd(SD_CMD18, sector) == 0) {
+		while (count && receive_block(buf, SD_SECTOR_SIZE)) {
+			buf += SD_SECTOR_SIZE;
+			count--;
+		}
+		send_cmd(SD_CMD12, 0);
+	}
+	bus_release();
+	return count ? SD_RES_ERROR : SD_RES_OK;
+}
+
+sd_result_t sd_write(const uint8_t *buf, uint32_t sector, uint32_t count) {
+	if (type == SD_TYPE_NONE) {
+		return SD_RES_NOCARD;
+	}
+	if (!count) {
+		return SD_RES_OK;
+	}
+	if (type != SD_TYPE_SDHC) {
+		// byte addressing
+		sector *= SD_SECTOR_SIZE;
+	}
+	if (!bus_acquire(SD_SPI_PRESCALER_FAST)) {
+		return SD_RES_BUSY;
+	}
+	if (count == 1) {
+		if (send_cmd(SD_CMD24, sector) == 0 && transmit_block(buf, SD_TOKEN_START_BLOCK)) {
+			count = 0;
+		}
+	} else {
+		if (type != SD_TYPE_MMC) {
+			// lets the card pre-erase the blocks
+			send_cmd(SD_ACMD23, count);
+		}
+		if (send_cmd(SD_CMD25, sector) == 0) {
+			while (count && transmit_block(buf, SD_TOKEN_START_MULTIPLE)) {
+				buf += SD_SECTOR_SIZE;
+				count--;
+			}
+			if (!transmit_block(NULL, SD_TOKEN_STOP_MULTIPLE)) {
+				count = 1;
+			}
+		}
+	}
+	bus_release();
+	return count ? SD_RES_ERROR : SD_RES_OK;
+}
+
+sd_result_t sd_sync(void) {
+	if (type == SD_TYPE_NONE) {
+		return SD_RES_NOCARD;
+	}
+	if (!bus_acquire(SD_SPI_PRESCALER_FAST)) {
+		return SD_RES_BUSY;
+	}
+	bool ready = select();
+	bus_release();
+	return ready ? SD_RES_OK : SD_RES_TIMEOUT;
+}
+
+#endif
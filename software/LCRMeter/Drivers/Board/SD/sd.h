@@ -0,0 +1,99 @@
+#ifndef BOARD_SD_SD_H_
+#define BOARD_SD_SD_H_
+
+/*
+ * SD card in SPI mode, used as the FatFs disk (see user_diskio.c).
+ *
+ * The card is on SPI1, shared with the touch controller. Every access takes xMutexSPI1 and restores the
+ * SPI configuration afterwards. The card is initialized with a slow clock (<400kHz), data is transferred
+ * with the fast clock. Multiple sectors are read/written with CMD18/CMD25.
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// SPI prescalers (SPI1 on APB2: 72MHz). Identification mode: 281kHz, data transfer: 18MHz
+#define SD_SPI_PRESCALER_INIT		SPI_BAUDRATEPRESCALER_256
+#define SD_SPI_PRESCALER_FAST		SPI_BAUDRATEPRESCALER_4
+
+// Maximum time to wait for xMutexSPI1 (in ms)
+#define SD_MUTEX_TIMEOUT			100
+
+// Transfer the data blocks with DMA while the calling task is blocked. The channels have to match SPI1
+// (DMA1 channel 2 (RX) and 3 (TX))
+#define SD_USE_DMA
+#ifdef SD_USE_DMA
+#define SD_DMA_CLK_ENABLE()			__HAL_RCC_DMA1_CLK_ENABLE()
+#define SD_DMA_RX_CHANNEL			DMA1_Channel2
+#define SD_DMA_TX_CHANNEL			DMA1_Channel3
+#define SD_DMA_RX_IRQn				DMA1_Channel2_IRQn
+#define SD_DMA_RX_IRQHandler		DMA1_Channel2_IRQHandler
+#define SD_DMA_CLEAR_FLAGS()		(DMA1->IFCR = DMA_IFCR_CGIF2 | DMA_IFCR_CGIF3)
+#define SD_DMA_ERROR()				(DMA1->ISR & (DMA_ISR_TEIF2 | DMA_ISR_TEIF3))
+#endif
+
+// Replaces the card with an image file (see sd_image.c), e.g. to benchmark FatFs on the host.
+// Only intended for host builds, usually defined by the build system
+//#define SD_IMAGE
+
+/***************************************
+ * Don't change anything below this line
+ **************************************/
+
+#define SD_SECTOR_SIZE				512
+
+typedef enum {
+	SD_RES_OK,
+	SD_RES_ERROR,
+	SD_RES_TIMEOUT,
+	// no card inserted or card not initialized
+	SD_RES_NOCARD,
+	// SPI1 is used by another module
+	SD_RES_BUSY,
+} sd_result_t;
+
+typedef enum {
+	SD_TYPE_NONE,
+	SD_TYPE_MMC,
+	SD_TYPE_SDV1,
+	SD_TYPE_SDV2,
+	// SDHC/SDXC, block addressing
+	SD_TYPE_SDHC,
+} sd_type_t;
+
+// Identifies the card and switches to the fast clock. Must be called again after the card has been replaced
+sd_result_t sd_init(void);
+bool sd_initialized(void);
+sd_type_t sd_type(void);
+// Capacity in sectors of SD_SECTOR_SIZE bytes
+uint32_t sd_sector_count(void);
+sd_result_t sd_read(uint8_t *buf, uint32_t sector, uint32_t count);
+sd_result_t sd_write(const uint8_t *buf, uint32_t sector, uint32_t count);
+// Waits until the card has finished all internal write operations
+sd_result_t sd_sync(void);
+
+#ifdef SD_IMAGE
+typedef struct {
+	uint32_t reads;
+	uint32_t writes;
+	uint32_t syncs;
+	uint32_t sectorsRead;
+	uint32_t sectorsWritten;
+} sd_image_stats_t;
+
+// Selects the image file, its size is the capacity of the card. Must be called before sd_init
+bool sd_image_open(const char *path);
+void sd_image_close(void);
+void sd_image_get_stats(sd_image_stats_t *stats);
+void sd_image_reset_stats(void);
+#endif
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BOARD_SD_SD_H_ */
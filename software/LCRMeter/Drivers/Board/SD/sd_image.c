@@ -0,0 +1,111 @@
+#include "sd.h"
+
+#ifdef SD_IMAGE
+
+/*
+ * Card backed by an image file on the host. Implements the same interface as the SPI driver in sd.c,
+ * so FatFs (and everything above it) can be run and benchmarked without the hardware. Create the
+ * image e.g. with "truncate -s 64M sd.img", f_mkfs formats it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+static FILE *image;
+static uint32_t sectors;
+static bool initialized;
+static sd_image_stats_t stats;
+
+bool sd_image_open(const char *path) {
+	sd_image_close();
+	image = fopen(path, "r+b");
+	if (!image) {
+		return false;
+	}
+	if (fseek(image, 0, SEEK_END)) {
+		sd_image_close();
+		return false;
+	}
+	long size = ftell(image);
+	if (size < SD_SECTOR_SIZE) {
+		sd_image_close();
+		return false;
+	}
+	sectors = size / SD_SECTOR_SIZE;
+	return true;
+}
+
+void sd_image_close(void) {
+	if (image) {
+		fclose(image);
+		image = NULL;
+	}
+	initialized = false;
+	sectors = 0;
+}
+
+void sd_image_get_stats(sd_image_stats_t *s) {
+	*s = stats;
+}
+
+void sd_image_reset_stats(void) {
+	memset(&stats, 0, sizeof(stats));
+}
+
+static bool seek(uint32_t sector, uint32_t count) {
+	if (!initialized || sector >= sectors || count > sectors - sector) {
+		return false;
+	}
+	return fseek(image, (long) sector * SD_SECTOR_SIZE, SEEK_SET) == 0;
+}
+
+sd_result_t sd_init(void) {
+	initialized = image != NULL;
+	return initialized ? SD_RES_OK : SD_RES_NOCARD;
+}
+
+bool sd_initialized(void) {
+	return initialized;
+}
+
+sd_type_t sd_type(void) {
+	return initialized ? SD_TYPE_SDHC : SD_TYPE_NONE;
+}
+
+uint32_t sd_sector_count(void) {
+	return initialized ? sectors : 0;
+}
+
+sd_result_t sd_read(uint8_t *buf, uint32_t sector, uint32_t count) {
+	if (!initialized) {
+		return SD_RES_NOCARD;
+	}
+	if (!seek(sector, count) || fread(buf, SD_SECTOR_SIZE, count, image) != count) {
+		return SD_RES_ERROR;
+	}
+	stats.reads++;
+	stats.sectorsRead += count;
+	return SD_RES_OK;
+}
+
+sd_result_t sd_write(const uint8_t *buf, uint32_t sector, uint32_t count) {
+	if (!initialized) {
+		return SD_RES_NOCARD;
+	}
+	if (!seek(sector, count) || fwrite(buf, SD_SECTOR_SIZE, count, image) != count) {
+		return SD_RES_ERROR;
+	}
+	stats.writes++;
+	stats.sectorsWritten += count;
+	return SD_RES_OK;
+}
+
+sd_result_t sd_sync(void) {
+	if (!initialized) {
+		return SD_RES_NOCARD;
+	}
+	stats.syncs++;
+	return fflush(image) == 0 ? SD_RES_OK : SD_RES_ERROR;
+}
+
+#endif
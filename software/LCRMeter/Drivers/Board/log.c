@@ -56,6 +56,7 @@ static StaticSemaphore_t xMutex;
 static SemaphoreHandle_t mutex;
 #endif
 
+#ifndef LOG_DEFERRED
 static const char lvl_strings[][4] = {
 	"DBG",
 	"INF",
@@ -63,6 +64,9 @@ static const char lvl_strings[][4] = {
 	"ERR",
 	"CRT",
 };
+#endif
+
+static log_statistics_t stats;
 
 #define INC_FIFO_POS(pos, inc) do { pos = (pos + inc) % LOG_SENDBUF_LENGTH; } while(0)
 
@@ -76,9 +80,125 @@ static uint16_t fifo_space() {
 	return LOG_SENDBUF_LENGTH - used - 1;
 }
 
+#ifdef LOG_DEFERRED
+static uint8_t* put_word(uint8_t *p, uint32_t word) {
+	memcpy(p, &word, sizeof(word));
+	return p + sizeof(word);
+}
+
+/*
+ * Builds the binary frame of a message (see LOG_DEFERRED). The arguments are taken as indicated by the
+ * conversion specifiers of the format string, but not formatted. Returns the frame length
+ */
+static int encode(uint8_t *frame, const char *module, uint8_t lvl, const char *fmt, va_list args) {
+	uint8_t *p = frame;
+	const uint8_t *end = frame + MAX_LINE_LENGTH;
+	*p++ = LOG_FRAME_SYNC;
+	// length is set at the end
+	p++;
+	*p++ = lvl;
+	p = put_word(p, HAL_GetTick());
+	p = put_word(p, (uint32_t) (uintptr_t) fmt);
+	p = put_word(p, (uint32_t) (uintptr_t) module);
+	while (*fmt) {
+		if (*fmt++ != '%') {
+			continue;
+		}
+		// remaining arguments are dropped if the frame is full (room for '*' width/precision and a 64 bit value)
+		if (end - p < 4 * sizeof(uint32_t)) {
+			break;
+		}
+		// flags, field width, precision and length modifiers
+		uint8_t longs = 0;
+		char c;
+		while ((c = *fmt) && strchr("-+ #0123456789.*hlLjzt", c)) {
+			if (c == '*') {
+				p = put_word(p, va_arg(args, int));
+			} else if (c == 'l') {
+				longs++;
+			} else if (c == 'j') {
+				longs = 2;
+			}
+			fmt++;
+		}
+		if (!c) {
+			break;
+		}
+		fmt++;
+		switch (c) {
+		case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+			if (longs >= 2) {
+				unsigned long long v = va_arg(args, unsigned long long);
+				memcpy(p, &v, sizeof(v));
+				p += sizeof(v);
+			} else if (longs == 1) {
+				p = put_word(p, va_arg(args, unsigned long));
+			} else {
+				p = put_word(p, va_arg(args, unsigned int));
+			}
+			break;
+		case 'c':
+			p = put_word(p, va_arg(args, int));
+			break;
+		case 'p':
+			p = put_word(p, (uint32_t) (uintptr_t) va_arg(args, void*));
+			break;
+		case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A': {
+			double v = va_arg(args, double);
+			memcpy(p, &v, sizeof(v));
+			p += sizeof(v);
+		}
+			break;
+		case 's': {
+			const char *str = va_arg(args, const char*);
+			if (!str) {
+				str = "(null)";
+			}
+			uint32_t addr = (uint32_t) (uintptr_t) str;
+			if (addr >= LOG_ROM_START && addr < LOG_ROM_END) {
+				// constant string, the decoder reads it from the ELF file
+				*p++ = 0xFF;
+				p = put_word(p, addr);
+			} else {
+				size_t len = strlen(str);
+				size_t max = end - p - 1;
+				if (len > max) {
+					len = max;
+				}
+				if (len > 0xFE) {
+					len = 0xFE;
+				}
+				*p++ = len;
+				memcpy(p, str, len);
+				p += len;
+			}
+		}
+			break;
+		default:
+			// %% and unsupported conversions have no argument
+			break;
+		}
+	}
+	frame[1] = p - frame - 2;
+	return p - frame;
+}
+#endif
+
+static void update_statistics(uint32_t start) {
+	uint32_t cycles = DWT->CYCCNT - start;
+	stats.calls++;
+	stats.cycles += cycles;
+	if (cycles > stats.maxCycles) {
+		stats.maxCycles = cycles;
+	}
+}
+
 void log_init() {
 	fifo_write = 0;
 	fifo_read = 0;
+	// cycle counter for the statistics
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
 #ifdef LOG_USE_MUTEXES
 	mutex = xSemaphoreCreateMutexStatic(&xMutex);
 #endif
@@ -89,6 +209,7 @@ void log_init() {
 }
 
 void log_write(const char *module, uint8_t level, const char *fmt, ...) {
+	uint32_t start = DWT->CYCCNT;
 	int written = 0;
 	va_list args;
 	va_start(args, fmt);
@@ -98,12 +219,17 @@ void log_write(const char *module, uint8_t level, const char *fmt, ...) {
 		xSemaphoreTake(mutex, portMAX_DELAY);
 	}
 #endif
+#ifdef LOG_DEFERRED
+	written = encode((uint8_t*) &fifo[fifo_write], module, lvl, fmt, args);
+#else
 	written = snprintf(&fifo[fifo_write], MAX_LINE_LENGTH, "%05lu [%6.6s,%s]: ",
 			HAL_GetTick(), module + 4, lvl_strings[lvl]);
 	written += vsnprintf(&fifo[fifo_write + written], MAX_LINE_LENGTH - written,
 			fmt, args);
 	written += snprintf(&fifo[fifo_write + written], MAX_LINE_LENGTH - written,
 			"\r\n");
+#endif
+	va_end(args);
 	// check if line still fits into ring buffer
 #ifdef LOG_BLOCKING
 	while (written > fifo_space()) {
@@ -112,6 +238,7 @@ void log_write(const char *module, uint8_t level, const char *fmt, ...) {
 #else
 	if (written > fifo_space()) {
 		// unable to fit line, skip
+		update_statistics(start);
 #ifdef LOG_USE_MUTEXES
 		if (!stm_in_interrupt()) {
 			xSemaphoreGive(mutex);
@@ -133,6 +260,7 @@ void log_write(const char *module, uint8_t level, const char *fmt, ...) {
 		PD_PREVENT_STOP();
 	}
 	USART_BASE->CR1 |= USART_CR1_TXEIE | USART_CR1_TCIE;
+	update_statistics(start);
 #ifdef LOG_USE_MUTEXES
 	if (!stm_in_interrupt()) {
 		xSemaphoreGive(mutex);
@@ -143,6 +271,14 @@ void log_write(const char *module, uint8_t level, const char *fmt, ...) {
 #endif
 }
 
+void log_get_statistics(log_statistics_t *s) {
+	*s = stats;
+}
+
+void log_reset_statistics() {
+	memset(&stats, 0, sizeof(stats));
+}
+
 void log_flush() {
 	while (USART_BASE->CR1 & USART_CR1_TCIE)
 		;
@@ -22,6 +22,22 @@ extern "C" {
 #define USE_ASSERT
 #define LOG_USE_MUTEXES
 
+/*
+ * Deferred formatting: instead of the formatted text, a binary frame with the address of the format
+ * string and the raw arguments is sent. Strings located in flash are sent as address as well. This
+ * takes printf (especially %f) out of the calling task, Tools/logdecode.py reconstructs the text with
+ * the ELF file of the firmware. Comment out (or define LOG_TEXT) for plain text output.
+ * Frame: LOG_FRAME_SYNC, length of the remaining frame, level, timestamp, format, module (32 bit
+ * little endian each), arguments (32 bit, 64 bit for %ll and floating point, strings as length byte
+ * followed by the characters or 0xFF followed by the address)
+ */
+#ifndef LOG_TEXT
+#define LOG_DEFERRED
+#endif
+#define LOG_FRAME_SYNC		0xFE
+#define LOG_ROM_START		0x08000000
+#define LOG_ROM_END			0x08080000
+
 // log levels
 #define LevelDebug 0x01
 #define LevelInfo  0x02
@@ -71,6 +87,16 @@ void log_flush();
 
 void log_force(const char *fmt, ...);
 
+typedef struct {
+	uint32_t calls;
+	// total and longest duration of log_write calls (in CPU cycles)
+	uint64_t cycles;
+	uint32_t maxCycles;
+} log_statistics_t;
+
+void log_get_statistics(log_statistics_t *stats);
+void log_reset_statistics();
+
 #ifdef __cplusplus
 }
 #endif
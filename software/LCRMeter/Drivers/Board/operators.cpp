@@ -1,5 +1,6 @@
 #include "FreeRTOS.h"
 #include <cstdio>
+#include <new>
 #include "log.h"
 
 void * operator new(size_t size)
@@ -16,6 +17,24 @@ void * operator new[](size_t size)
 	return ptr;
 }
 
+/*
+ * pvPortMalloc returns nullptr when the heap is exhausted. The compiler assumes that the plain
+ * operator new never does, use new (std::nothrow) wherever the result is checked
+ */
+void * operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	void *ptr = pvPortMalloc(size);
+	LOG(Log_System, LevelDebug, "New: allocating %d bytes: %p", size, ptr);
+	return ptr;
+}
+
+void * operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+	void *ptr = pvPortMalloc(size);
+	LOG(Log_System, LevelDebug, "New: allocating %d bytes: %p", size, ptr);
+	return ptr;
+}
+
 void operator delete(void* ptr)
 {
 	LOG(Log_System, LevelDebug, "Delete: freeing pointer: %p", ptr);
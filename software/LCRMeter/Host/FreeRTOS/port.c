@@ -0,0 +1,117 @@
+/*
+ * FreeRTOS port for host builds (Linux/POSIX)
+ *
+ * All tasks run in a single host thread and switch with swapcontext(). The firmware uses the cooperative
+ * scheduler, so a context switch only happens in portYIELD and there are no interrupts to synchronize
+ * with. Interrupt handlers of simulated peripherals are called from task context.
+ *
+ * Time is simulated: the tick only advances while all tasks are blocked (the idle task is running), a
+ * task busy waiting for the tick count to change never returns. Timing results (e.g. the acquisition
+ * time of a measurement) only depend on the delays modeled by the firmware and the simulated hardware,
+ * not on the speed of the host.
+ */
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include <ucontext.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Host stack of every task. The firmware stack only holds the pointer to the host context
+#define HOST_STACK_SIZE			(256 * 1024)
+
+typedef struct {
+	ucontext_t context;
+	void *stack;
+	TaskFunction_t code;
+	void *parameters;
+} host_task_t;
+
+// first member of the TCB in tasks.c
+typedef struct {
+	volatile StackType_t *pxTopOfStack;
+} host_tcb_t;
+extern host_tcb_t * volatile pxCurrentTCB;
+
+static ucontext_t scheduler_context;
+static UBaseType_t critical_nesting;
+
+static host_task_t *task_of(const host_tcb_t *tcb) {
+	return *(host_task_t**) tcb->pxTopOfStack;
+}
+
+static void task_entry(void) {
+	host_task_t *t = task_of(pxCurrentTCB);
+	t->code(t->parameters);
+	// tasks must not return
+	vTaskDelete(NULL);
+}
+
+StackType_t *pxPortInitialiseStack(StackType_t *pxTopOfStack, TaskFunction_t pxCode, void *pvParameters) {
+	host_task_t *t = calloc(1, sizeof(host_task_t));
+	if (t) {
+		t->stack = malloc(HOST_STACK_SIZE);
+	}
+	if (!t || !t->stack) {
+		fprintf(stderr, "Failed to allocate host stack\n");
+		abort();
+	}
+	t->code = pxCode;
+	t->parameters = pvParameters;
+	getcontext(&t->context);
+	t->context.uc_stack.ss_sp = t->stack;
+	t->context.uc_stack.ss_size = HOST_STACK_SIZE;
+	t->context.uc_link = NULL;
+	makecontext(&t->context, task_entry, 0);
+	pxTopOfStack -= sizeof(host_task_t*) / sizeof(StackType_t);
+	*(host_task_t**) pxTopOfStack = t;
+	return pxTopOfStack;
+}
+
+void vPortCleanUpTCB(void *pxTCB) {
+	host_task_t *t = task_of(pxTCB);
+	free(t->stack);
+	free(t);
+}
+
+BaseType_t xPortStartScheduler(void) {
+	// returns once vTaskEndScheduler has been called
+	swapcontext(&scheduler_context, &task_of(pxCurrentTCB)->context);
+	return pdTRUE;
+}
+
+void vPortEndScheduler(void) {
+	swapcontext(&task_of(pxCurrentTCB)->context, &scheduler_context);
+}
+
+void vPortYield(void) {
+	host_task_t *prev = task_of(pxCurrentTCB);
+	vTaskSwitchContext();
+	host_task_t *next = task_of(pxCurrentTCB);
+	if (prev != next) {
+		swapcontext(&prev->context, &next->context);
+	}
+}
+
+void vPortEnterCritical(void) {
+	critical_nesting++;
+}
+
+void vPortExitCritical(void) {
+	configASSERT(critical_nesting);
+	critical_nesting--;
+}
+
+/*
+ * Tick interrupt, called by the idle task
+ */
+void xPortSysTickHandler(void) {
+	xTaskIncrementTick();
+}
+
+/*
+ * All tasks are blocked: advance the simulated time to the next tick
+ */
+void vApplicationIdleHook(void) {
+	xPortSysTickHandler();
+}
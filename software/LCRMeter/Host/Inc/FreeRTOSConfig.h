@@ -0,0 +1,28 @@
+#ifndef HOST_FREERTOS_CONFIG_H
+#define HOST_FREERTOS_CONFIG_H
+
+/*
+ * Configuration of the firmware with the changes required by the host port
+ */
+#include "../../Inc/FreeRTOSConfig.h"
+// replaces the Cortex-M4 intrinsics before cmsis_os.c includes them
+#include <stm32f3xx.h>
+
+// the generic task selection, the optimized one relies on the CLZ instruction
+#undef configUSE_PORT_OPTIMISED_TASK_SELECTION
+#define configUSE_PORT_OPTIMISED_TASK_SELECTION		0
+// advances the simulated time (see port.c)
+#undef configUSE_IDLE_HOOK
+#define configUSE_IDLE_HOOK							1
+// simulated peripherals are serviced on every tick (see hal.c)
+#undef configUSE_TICK_HOOK
+#define configUSE_TICK_HOOK							1
+
+#undef configASSERT
+#ifdef __cplusplus
+extern "C"
+#endif
+void vAssertCalled(const char *file, int line);
+#define configASSERT( x ) if ((x) == 0) { vAssertCalled(__FILE__, __LINE__); }
+
+#endif
@@ -0,0 +1,26 @@
+#ifndef HOST_USB_H
+#define HOST_USB_H
+
+/*
+ * USB CDC interface for host builds (see usb.c). The tests act as the USB host: they send commands
+ * to the remote control and read back what the firmware transmitted.
+ */
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Passes data to the firmware as if it had been received over USB
+void host_usb_write(const void *data, size_t len);
+// Copies up to len bytes of transmitted data, returns the number of bytes
+size_t host_usb_read(void *data, size_t len);
+// Number of transmitted bytes not read yet
+size_t host_usb_available(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef HOST_STM32F3XX_H
+#define HOST_STM32F3XX_H
+
+/*
+ * Device header for host builds: all register definitions of the real header are kept, the peripherals
+ * and core registers are moved into host memory (see hal.c)
+ */
+#include_next "stm32f3xx.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define HOST_PERIPHERAL_BUS_SIZE	0x10000UL
+extern uint8_t host_peripherals[5 * HOST_PERIPHERAL_BUS_SIZE];
+extern uint8_t host_core[0x11000];
+
+#ifdef __cplusplus
+}
+#endif
+
+#undef APB1PERIPH_BASE
+#undef APB2PERIPH_BASE
+#undef AHB1PERIPH_BASE
+#undef AHB2PERIPH_BASE
+#undef AHB3PERIPH_BASE
+#define APB1PERIPH_BASE			((uintptr_t) host_peripherals)
+#define APB2PERIPH_BASE			(APB1PERIPH_BASE + HOST_PERIPHERAL_BUS_SIZE)
+#define AHB1PERIPH_BASE			(APB1PERIPH_BASE + 2 * HOST_PERIPHERAL_BUS_SIZE)
+#define AHB2PERIPH_BASE			(APB1PERIPH_BASE + 3 * HOST_PERIPHERAL_BUS_SIZE)
+#define AHB3PERIPH_BASE			(APB1PERIPH_BASE + 4 * HOST_PERIPHERAL_BUS_SIZE)
+
+#undef ITM_BASE
+#undef DWT_BASE
+#undef TPI_BASE
+#undef SCS_BASE
+#undef CoreDebug_BASE
+#define ITM_BASE				((uintptr_t) host_core)
+#define DWT_BASE				(ITM_BASE + 0x1000UL)
+#define SCS_BASE				(ITM_BASE + 0xE000UL)
+#define CoreDebug_BASE			(ITM_BASE + 0xEDF0UL)
+#define TPI_BASE				(ITM_BASE + 0x10000UL)
+
+// no interrupts are active on the host (also used by cmsis_os.c, which includes cmsis_gcc.h again)
+#define __get_IPSR()			0U
+#undef __BKPT
+#define __BKPT(value)			__builtin_trap()
+#undef __DMB
+#undef __DSB
+#undef __ISB
+#define __DMB()					__sync_synchronize()
+#define __DSB()					__sync_synchronize()
+#define __ISB()					__sync_synchronize()
+
+#endif
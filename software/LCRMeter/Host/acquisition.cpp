@@ -0,0 +1,212 @@
+/*
+ * Acquisition time of the frontend on the simulated AD5941
+ *
+ * Measures a list of frequencies in continuous mode and prints for every point the time from Start()
+ * to the first valid result and the time between consecutive results. "sim" is the simulated time of
+ * the firmware (ticks of 1ms, includes the conversion times modeled by ad5940_sim), "host" the wall
+ * clock time the host needed to run the firmware code. The SPI columns count the register accesses
+ * of the first result.
+ *
+ * Every result is compared against the impedance of the simulated DUT, the run fails if |Z| or the
+ * phase deviate by more than MagnitudeTolerance/PhaseTolerance.
+ *
+ * Built twice: acquisition polls the interrupt flags of the AD5941, acquisition_int defines
+ * AD5941_INT_GPIO_Port/AD5941_INT_Pin and waits for the interrupt output of the model instead. That
+ * variant counts the calls of the EXTI callback registered by the driver and fails if a result was
+ * measured without them.
+ *
+ * Usage: acquisition [averages] [results per point]
+ */
+#include "Frontend.hpp"
+#include "ResultBus.hpp"
+#include "ad5940_sim.h"
+#include "log.h"
+#include "exti.h"
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <complex>
+
+static constexpr uint32_t Frequencies[] = {100, 1000, 3125, 10000, 50000, 100000, 200000};
+// Give up on a point after this (simulated) time
+static constexpr TickType_t Timeout = 10000;
+// Maximum deviation from the DUT impedance (relative for |Z|, in degrees for the phase)
+static constexpr float MagnitudeTolerance = 0.001f;
+static constexpr float PhaseTolerance = 0.1f;
+
+static uint32_t averages = 1;
+static uint32_t resultsPerPoint = 10;
+static int exitCode = EXIT_FAILURE;
+
+#ifdef AD5941_INT_Pin
+static exti_callback_t driverCallback;
+static void *driverPtr;
+static volatile uint32_t interrupts;
+
+static void CountInterrupt(void*) {
+	interrupts++;
+	driverCallback(driverPtr);
+}
+#endif
+
+// 100 Ohm in series with 1uF
+static std::complex<float> Dut(float frequency) {
+	return std::complex<float>(100.0f, -1.0f / (2 * (float) M_PI * frequency * 1e-6f));
+}
+
+static uint64_t HostMicroseconds() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+// Waits for the next result, returns false on timeout
+static bool WaitResult(int8_t subscriber, ResultBus::Record &r) {
+	TickType_t start = xTaskGetTickCount();
+	while (!ResultBus::Read(subscriber, r)) {
+		TickType_t elapsed = xTaskGetTickCount() - start;
+		if (elapsed >= Timeout) {
+			return false;
+		}
+		xTaskNotifyWait(0, 0, nullptr, Timeout - elapsed);
+	}
+	return true;
+}
+
+// Compares a result with the DUT impedance, returns false if it is outside of the tolerances
+static bool CheckImpedance(const Frontend::Result &r, float &magError, float &phaseError) {
+	auto expected = Dut(r.frequency);
+	magError = std::abs(r.Z) / std::abs(expected) - 1.0f;
+	phaseError = (std::arg(r.Z) - std::arg(expected)) * 180.0f / (float) M_PI;
+	return fabsf(magError) <= MagnitudeTolerance && fabsf(phaseError) <= PhaseTolerance;
+}
+
+static bool MeasurePoint(int8_t subscriber, uint32_t frequency) {
+	Frontend::Settings s;
+	s.biasVoltage = 0;
+	s.frequency = frequency;
+	s.plan = nullptr;
+	s.excitationVoltage = 100000;
+	s.range = Frontend::Range::AUTO;
+	s.rangeHint = AD5940_HSRTIA_OPEN;
+	s.averages = averages;
+	s.targetError = 0.0f;
+	s.abortInvalid = true;
+	s.id = frequency / 100;
+
+	ad5940_sim_reset_stats();
+	TickType_t startTick = xTaskGetTickCount();
+	uint64_t startHost = HostMicroseconds();
+	if (!Frontend::Start(s)) {
+		printf("%8lu Hz: failed to start\n", (unsigned long) frequency);
+		return false;
+	}
+	ResultBus::Record r;
+	do {
+		if (!WaitResult(subscriber, r)) {
+			printf("%8lu Hz: no valid result\n", (unsigned long) frequency);
+			Frontend::Stop();
+			return false;
+		}
+	} while (r.result.id != s.id || r.result.type != Frontend::ResultType::Valid);
+	TickType_t firstTick = xTaskGetTickCount() - startTick;
+	uint64_t firstHost = HostMicroseconds() - startHost;
+	ad5940_sim_stats_t stats;
+	ad5940_sim_get_stats(&stats);
+
+	float magError, phaseError, maxMagError = 0.0f, maxPhaseError = 0.0f;
+	bool passed = CheckImpedance(r.result, maxMagError, maxPhaseError);
+
+	startTick = xTaskGetTickCount();
+	startHost = HostMicroseconds();
+#ifdef AD5941_INT_Pin
+	uint32_t startInterrupts = interrupts;
+#endif
+	for (uint32_t i = 0; i < resultsPerPoint; i++) {
+		if (!WaitResult(subscriber, r)) {
+			printf("%8lu Hz: result stream stopped\n", (unsigned long) frequency);
+			Frontend::Stop();
+			return false;
+		}
+		if (r.result.type != Frontend::ResultType::Valid) {
+			printf("%8lu Hz: result %lu not valid\n", (unsigned long) frequency, (unsigned long) i);
+			passed = false;
+			continue;
+		}
+		passed &= CheckImpedance(r.result, magError, phaseError);
+		if (fabsf(magError) > fabsf(maxMagError)) {
+			maxMagError = magError;
+		}
+		if (fabsf(phaseError) > fabsf(maxPhaseError)) {
+			maxPhaseError = phaseError;
+		}
+	}
+	TickType_t streamTick = xTaskGetTickCount() - startTick;
+	uint64_t streamHost = HostMicroseconds() - startHost;
+	Frontend::Stop();
+#ifdef AD5941_INT_Pin
+	// every result takes at least one sequence, each ending with an interrupt
+	if (interrupts - startInterrupts < resultsPerPoint) {
+		printf("%8lu Hz: only %lu interrupts for %lu results\n", (unsigned long) frequency,
+				(unsigned long) (interrupts - startInterrupts), (unsigned long) resultsPerPoint);
+		passed = false;
+	}
+#endif
+
+	printf("%8lu Hz %6lu %8lu %8lu %8.1f %9.1f %6lu %6lu %8.2f %+7.3f%% %+7.3f%s\n",
+			(unsigned long) frequency, (unsigned long) r.result.averages, (unsigned long) firstTick,
+			(unsigned long) firstHost, (float) streamTick / resultsPerPoint,
+			(float) streamHost / resultsPerPoint, (unsigned long) stats.reads,
+			(unsigned long) stats.writes, std::abs(r.result.Z), maxMagError * 100, maxPhaseError,
+			passed ? "" : "  FAILED");
+	return passed;
+}
+
+static void Run(void*) {
+	log_init();
+	bool passed = Frontend::Init();
+#ifdef AD5941_INT_Pin
+	// count the interrupts on the way to the callback of the driver
+	exti_get_callback(AD5941_INT_GPIO_Port, AD5941_INT_Pin, &driverCallback, &driverPtr);
+	if (passed && !driverCallback) {
+		printf("Interrupt callback of the AD5941 not registered\n");
+		passed = false;
+	} else {
+		exti_set_callback(AD5941_INT_GPIO_Port, AD5941_INT_Pin, EXTI_TYPE_FALLING, EXTI_PULL_UP,
+				CountInterrupt, nullptr);
+	}
+#endif
+	if (!passed) {
+		printf("Frontend initialization failed\n");
+	} else {
+		int8_t subscriber = ResultBus::Subscribe(xTaskGetCurrentTaskHandle());
+		printf("   frequency    avg  first result      result interval     SPI access"
+				"     |Z|  max. error (%.1f%%, %.1fdeg)\n", MagnitudeTolerance * 100, PhaseTolerance);
+		printf("                      sim ms  host us   sim ms   host us  reads writes"
+				"             |Z|    phase\n");
+		for (auto f : Frequencies) {
+			passed &= MeasurePoint(subscriber, f);
+		}
+	}
+	exitCode = passed ? EXIT_SUCCESS : EXIT_FAILURE;
+	vTaskEndScheduler();
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1) {
+		averages = strtoul(argv[1], nullptr, 0);
+	}
+	if (argc > 2) {
+		resultsPerPoint = strtoul(argv[2], nullptr, 0);
+	}
+	ad5940_sim_set_dut_model([](void*, float f) -> ad5940_sim_impedance_t {
+		auto z = Dut(f);
+		return {z.real(), z.imag()};
+	}, nullptr);
+	xTaskCreate(Run, "Runner", 1024, nullptr, 2, nullptr);
+	vTaskStartScheduler();
+	return exitCode;
+}
@@ -0,0 +1,179 @@
+/*
+ * Fixed and planned DFT configuration on the simulated AD5941
+ *
+ * Measures every frequency twice: with the fixed configuration (HardwareLimits::DFTpoints, Hann window)
+ * and with the adaptive DFT plan of PreparePlanEntry (input, length and window per frequency). The
+ * model adds noise and an offset to the ADC samples, the frontend averages until TargetError is
+ * reached. For both configurations the planned capture (DFT points, ADC samples per point, window,
+ * expected offset leakage), the simulated time per result and the RMS deviation from the DUT impedance
+ * are printed.
+ *
+ * The run fails if the plan needs more time per result than the fixed configuration or if its error
+ * exceeds MaxErrorRatio times the error of the fixed configuration (and the target error).
+ *
+ * Usage: dftbench [results per point]
+ */
+#include "Frontend.hpp"
+#include "ResultBus.hpp"
+#include "ad5940_sim.h"
+#include "log.h"
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <complex>
+
+// coherent and non-coherent captures, SINC2, averaging and raw samples as DFT input
+static constexpr uint32_t Frequencies[] = {100, 120, 1000, 1234, 3125, 10000, 12345, 50000, 100000,
+		150000, 200000};
+// Give up on a point after this (simulated) time
+static constexpr TickType_t Timeout = 30000;
+// ADC noise and offset of the model, relative to the ADC fullscale
+static constexpr float Noise = 0.01f;
+static constexpr float Offset = 0.01f;
+static constexpr float TargetError = 0.0005f;
+static constexpr uint32_t MaxAverages = 100;
+// adaptive averaging stops at an estimated error, the actual error of few averages spreads around it
+static constexpr float MaxErrorRatio = 2.0f;
+
+static uint32_t resultsPerPoint = 50;
+static int exitCode = EXIT_FAILURE;
+
+// 100 Ohm in series with 1uF
+static std::complex<float> Dut(float frequency) {
+	return std::complex<float>(100.0f, -1.0f / (2 * (float) M_PI * frequency * 1e-6f));
+}
+
+// Waits for the next result, returns false on timeout
+static bool WaitResult(int8_t subscriber, ResultBus::Record &r) {
+	TickType_t start = xTaskGetTickCount();
+	while (!ResultBus::Read(subscriber, r)) {
+		TickType_t elapsed = xTaskGetTickCount() - start;
+		if (elapsed >= Timeout) {
+			return false;
+		}
+		xTaskNotifyWait(0, 0, nullptr, Timeout - elapsed);
+	}
+	return true;
+}
+
+using Statistics = struct {
+	// simulated time per result in ms
+	float time;
+	float averages;
+	// RMS deviation from the DUT (relative for |Z|, in degrees for the phase)
+	float magError, phaseError;
+};
+
+static bool Measure(int8_t subscriber, const Frontend::PlanEntry &e, Statistics &stats) {
+	Frontend::Settings s;
+	s.biasVoltage = 0;
+	s.frequency = e.frequency;
+	s.plan = &e;
+	s.excitationVoltage = 100000;
+	s.range = Frontend::Range::AUTO;
+	s.rangeHint = AD5940_HSRTIA_OPEN;
+	s.averages = MaxAverages;
+	s.targetError = TargetError;
+	s.abortInvalid = true;
+	s.id = e.frequency / 100;
+
+	if (!Frontend::Start(s)) {
+		return false;
+	}
+	ResultBus::Record r;
+	// the first result includes the range selection
+	do {
+		if (!WaitResult(subscriber, r)) {
+			Frontend::Stop();
+			return false;
+		}
+	} while (r.result.id != s.id || r.result.type != Frontend::ResultType::Valid);
+
+	TickType_t start = xTaskGetTickCount();
+	uint32_t averages = 0;
+	float magSquares = 0.0f, phaseSquares = 0.0f;
+	for (uint32_t i = 0; i < resultsPerPoint; i++) {
+		if (!WaitResult(subscriber, r) || r.result.type != Frontend::ResultType::Valid) {
+			Frontend::Stop();
+			return false;
+		}
+		auto expected = Dut(r.result.frequency);
+		float magError = std::abs(r.result.Z) / std::abs(expected) - 1.0f;
+		float phaseError = (std::arg(r.result.Z) - std::arg(expected)) * 180.0f / (float) M_PI;
+		magSquares += magError * magError;
+		phaseSquares += phaseError * phaseError;
+		averages += r.result.averages;
+	}
+	stats.time = (float) (xTaskGetTickCount() - start) / resultsPerPoint;
+	Frontend::Stop();
+	stats.averages = (float) averages / resultsPerPoint;
+	stats.magError = sqrtf(magSquares / resultsPerPoint);
+	stats.phaseError = sqrtf(phaseSquares / resultsPerPoint);
+	return true;
+}
+
+static void PrintConfiguration(const char *name, const Frontend::PlanEntry &e, const Statistics &stats) {
+	printf(" %-7s %5lu %4u %-4s %8.1e %7.1f %6.1f %7.4f%% %7.4f\n", name,
+			4UL << ((e.DFTCon >> 4) & 0x0F), e.decimation, e.DFTCon & 0x01 ? "Hann" : "rect",
+			Frontend::Leakage(e), stats.time, stats.averages, stats.magError * 100, stats.phaseError);
+}
+
+static bool MeasurePoint(int8_t subscriber, uint32_t frequency) {
+	Frontend::PlanEntry fixed, planned;
+	Frontend::PreparePlanEntry(frequency, fixed, false);
+	Frontend::PreparePlanEntry(frequency, planned);
+	Statistics fixedStats, plannedStats;
+	if (!Measure(subscriber, fixed, fixedStats) || !Measure(subscriber, planned, plannedStats)) {
+		printf("%7lu Hz: no valid results\n", (unsigned long) frequency);
+		return false;
+	}
+	// the error limit can not be tighter than the target of the averaging
+	float magLimit = fmaxf(fixedStats.magError, TargetError) * MaxErrorRatio;
+	float phaseLimit = fmaxf(fixedStats.phaseError, TargetError * 180.0f / (float) M_PI) * MaxErrorRatio;
+	bool passed = plannedStats.time <= fixedStats.time && plannedStats.magError <= magLimit
+			&& plannedStats.phaseError <= phaseLimit;
+	printf("%7lu Hz", (unsigned long) frequency);
+	PrintConfiguration("fixed", fixed, fixedStats);
+	printf("%10s", "");
+	PrintConfiguration("planned", planned, plannedStats);
+	if (!passed) {
+		printf("%7lu Hz: plan is slower or less accurate than the fixed configuration\n",
+				(unsigned long) frequency);
+	}
+	return passed;
+}
+
+static void Run(void*) {
+	log_init();
+	bool passed = Frontend::Init();
+	if (!passed) {
+		printf("Frontend initialization failed\n");
+	} else {
+		int8_t subscriber = ResultBus::Subscribe(xTaskGetCurrentTaskHandle());
+		printf("ADC noise %.1f%%, offset %.1f%%, target error %.2f%%, %lu results per point\n",
+				Noise * 100, Offset * 100, TargetError * 100, (unsigned long) resultsPerPoint);
+		printf("frequency config   points dec. win.  leakage  ms/res    avg  RMS |Z|   phase\n");
+		for (auto f : Frequencies) {
+			passed &= MeasurePoint(subscriber, f);
+		}
+	}
+	exitCode = passed ? EXIT_SUCCESS : EXIT_FAILURE;
+	vTaskEndScheduler();
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1) {
+		resultsPerPoint = strtoul(argv[1], nullptr, 0);
+	}
+	ad5940_sim_set_dut_model([](void*, float f) -> ad5940_sim_impedance_t {
+		auto z = Dut(f);
+		return {z.real(), z.imag()};
+	}, nullptr);
+	ad5940_sim_set_noise(Noise);
+	ad5940_sim_set_offset(Offset);
+	xTaskCreate(Run, "Runner", 1024, nullptr, 2, nullptr);
+	vTaskStartScheduler();
+	return exitCode;
+}
@@ -0,0 +1,144 @@
+/*
+ * Peripherals and HAL functions for host builds
+ *
+ * The peripheral registers are plain memory (see Inc/stm32f3xx.h), register accesses of the drivers
+ * have no effect. Peripherals the firmware waits for are serviced in the tick hook.
+ */
+#include "main.h"
+#include "ad5940_sim.h"
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint8_t host_peripherals[5 * HOST_PERIPHERAL_BUS_SIZE] __attribute__((aligned(8)));
+uint8_t host_core[0x11000] __attribute__((aligned(8)));
+
+uint32_t SystemCoreClock = 72000000;
+
+SPI_HandleTypeDef hspi1;
+SPI_HandleTypeDef hspi3;
+ADC_HandleTypeDef hadc1;
+TIM_HandleTypeDef htim8;
+
+void vAssertCalled(const char *file, int line) {
+	fprintf(stderr, "Assertion failed at %s:%d\n", file, line);
+	abort();
+}
+
+void vApplicationGetIdleTaskMemory(StaticTask_t **ppxIdleTaskTCBBuffer, StackType_t **ppxIdleTaskStackBuffer,
+		uint32_t *pulIdleTaskStackSize) {
+	static StaticTask_t xIdleTaskTCBBuffer;
+	static StackType_t xIdleStack[configMINIMAL_STACK_SIZE];
+	*ppxIdleTaskTCBBuffer = &xIdleTaskTCBBuffer;
+	*ppxIdleTaskStackBuffer = &xIdleStack[0];
+	*pulIdleTaskStackSize = configMINIMAL_STACK_SIZE;
+}
+
+void *pvPortCalloc(size_t num, size_t xSize) {
+	void *ret = pvPortMalloc(num * xSize);
+	if (ret) {
+		memset(ret, 0, num * xSize);
+	}
+	return ret;
+}
+
+void USART1_IRQHandler(void);
+
+#ifdef AD5941_INT_Pin
+void EXTI0_IRQHandler(void);
+void EXTI1_IRQHandler(void);
+void EXTI2_IRQHandler(void);
+void EXTI3_IRQHandler(void);
+void EXTI4_IRQHandler(void);
+void EXTI9_5_IRQHandler(void);
+void EXTI15_10_IRQHandler(void);
+
+/*
+ * Raises the EXTI interrupt of a pin. The pending register is plain memory, it is cleared here
+ * instead of by the write of the handler
+ */
+static void exti_interrupt(uint16_t pin) {
+	static void (*const handlers[16])(void) = {
+		EXTI0_IRQHandler, EXTI1_IRQHandler, EXTI2_IRQHandler, EXTI3_IRQHandler, EXTI4_IRQHandler,
+		EXTI9_5_IRQHandler, EXTI9_5_IRQHandler, EXTI9_5_IRQHandler, EXTI9_5_IRQHandler,
+		EXTI9_5_IRQHandler, EXTI15_10_IRQHandler, EXTI15_10_IRQHandler, EXTI15_10_IRQHandler,
+		EXTI15_10_IRQHandler, EXTI15_10_IRQHandler, EXTI15_10_IRQHandler,
+	};
+	EXTI->PR |= pin;
+	handlers[31 - __builtin_clz(pin)]();
+	EXTI->PR &= ~pin;
+}
+#endif
+
+/*
+ * Called on every simulated tick
+ */
+void vApplicationTickHook(void) {
+	// cycle counter used for the timing statistics of the drivers
+	DWT->CYCCNT += SystemCoreClock / configTICK_RATE_HZ;
+	if (ad5940_sim_tick()) {
+#ifdef AD5941_INT_Pin
+		// interrupt output of the AD5941 model wired to the INT pin
+		exti_interrupt(AD5941_INT_Pin);
+#endif
+	}
+	// the log USART sends its buffer instantly, the output is discarded
+	while (USART1->CR1 & (USART_CR1_TXEIE | USART_CR1_TCIE)) {
+		USART1->ISR |= USART_ISR_TXE | USART_ISR_TC;
+		USART1_IRQHandler();
+	}
+}
+
+uint32_t HAL_GetTick(void) {
+	return xTaskGetTickCount();
+}
+
+void HAL_Delay(uint32_t Delay) {
+	if (xTaskGetSchedulerState() == taskSCHEDULER_RUNNING) {
+		vTaskDelay(Delay);
+	}
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_Init) {
+	(void) GPIOx;
+	(void) GPIO_Init;
+}
+
+void HAL_NVIC_SetPriority(IRQn_Type IRQn, uint32_t PreemptPriority, uint32_t SubPriority) {
+	(void) IRQn;
+	(void) PreemptPriority;
+	(void) SubPriority;
+}
+
+void HAL_NVIC_EnableIRQ(IRQn_Type IRQn) {
+	(void) IRQn;
+}
+
+void HAL_NVIC_DisableIRQ(IRQn_Type IRQn) {
+	(void) IRQn;
+}
+
+// there is no flash memory, persistent data can not be saved
+HAL_StatusTypeDef HAL_FLASH_Unlock(void) {
+	return HAL_ERROR;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock(void) {
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError) {
+	(void) pEraseInit;
+	*PageError = 0xFFFFFFFF;
+	return HAL_ERROR;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t TypeProgram, uint32_t Address, uint64_t Data) {
+	(void) TypeProgram;
+	(void) Address;
+	(void) Data;
+	return HAL_ERROR;
+}
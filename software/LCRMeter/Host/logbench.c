@@ -0,0 +1,79 @@
+/*
+ * Cost of a log_write call for typical messages of the frontend
+ *
+ * Built twice: logbench uses the deferred binary frames (LOG_DEFERRED, the firmware default),
+ * logbench_text formats the text with snprintf/vsnprintf (LOG_TEXT). Only the call itself is timed,
+ * the log USART is emptied in between. Cycles are counted with the time stamp counter of the host,
+ * they show the ratio of both variants but not the cycle count of the Cortex-M4.
+ *
+ * Usage: logbench[_text] [calls per message]
+ */
+#include "log.h"
+#include "main.h"
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define Log_Frontend	(LevelDebug|LevelInfo|LevelWarn|LevelError|LevelCrit)
+#define Log_AD5940		(LevelDebug|LevelInfo|LevelWarn|LevelError|LevelCrit)
+
+void USART1_IRQHandler(void);
+
+static uint32_t calls = 100000;
+
+static void Drain(void) {
+	while (USART1->CR1 & (USART_CR1_TXEIE | USART_CR1_TCIE)) {
+		USART1->ISR |= USART_ISR_TXE | USART_ISR_TC;
+		USART1_IRQHandler();
+	}
+}
+
+static uint64_t Nanoseconds(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+#define BENCH(name, ...) do { \
+	uint64_t cycles = 0, ns = 0; \
+	for (uint32_t i = 0; i < calls; i++) { \
+		float f = i * 0.001f; \
+		uint64_t startNs = Nanoseconds(); \
+		uint64_t start = __builtin_ia32_rdtsc(); \
+		__VA_ARGS__; \
+		cycles += __builtin_ia32_rdtsc() - start; \
+		ns += Nanoseconds() - startNs; \
+		Drain(); \
+	} \
+	printf("%-28s %8.0f cycles %8.1f ns\n", name, (double) cycles / calls, (double) ns / calls); \
+} while (0)
+
+static void Run(void *arg) {
+	(void) arg;
+	log_init();
+#ifdef LOG_DEFERRED
+	printf("log_write, deferred binary frames:\n");
+#else
+	printf("log_write, text formatted with vsnprintf:\n");
+#endif
+	BENCH("U/I magnitude and phase", LOG(Log_Frontend, LevelDebug, "Measurement U: %f@%f, I: %f@%f",
+			1.234f + f, 0.5f, 0.0123f + f, -1.07f));
+	BENCH("averages and errors", LOG(Log_Frontend, LevelDebug, "%lu averages, error |Z|: %f, phase: %f",
+			(unsigned long) i, 0.0012f + f, 0.0004f));
+	BENCH("PGA gain", LOG(Log_AD5940, LevelDebug, "Selected current PGA gain: %f", 1.5f + f));
+	BENCH("reconfiguration (integers)", LOG(Log_Frontend, LevelDebug,
+			"Reconfiguration: %lu reads, %lu writes, %luus", (unsigned long) i, 12UL, 350UL));
+	vTaskEndScheduler();
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1) {
+		calls = strtoul(argv[1], NULL, 0);
+	}
+	xTaskCreate(Run, "Bench", 1024, NULL, 1, NULL);
+	vTaskStartScheduler();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,270 @@
+/*
+ * Loopback test of the remote control over the simulated USB CDC interface
+ *
+ * The test acts as the USB host and runs the remote control against the simulated AD5941 while a local
+ * measurement (standing in for LCR::Run) uses the frontend whenever the remote control does not own
+ * it. It reports the command round trip latency and the rate of streamed records and checks that:
+ * - settings commands do not disturb the local measurement
+ * - READ? does not time out and the local measurement resumes afterwards
+ * - the local measurement does not reconfigure the frontend while remote measurements run
+ */
+#include "Remote.h"
+#include "Frontend.hpp"
+#include "ResultBus.hpp"
+#include "ad5940_sim.h"
+#include "host_usb.h"
+#include "log.h"
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static constexpr uint16_t LocalId = 1;
+static constexpr uint32_t LocalFrequency = 1000;
+static constexpr TickType_t ResponseTimeout = 5000;
+static constexpr TickType_t StreamDuration = 2000;
+
+static volatile uint32_t localResults;
+static bool passed = true;
+
+static uint64_t HostMicroseconds() {
+	timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000 + t.tv_nsec / 1000;
+}
+
+static void Check(bool condition, const char *what) {
+	if (!condition) {
+		printf("FAILED: %s\n", what);
+		passed = false;
+	}
+}
+
+static Frontend::Settings LocalSettings() {
+	Frontend::Settings s;
+	s.biasVoltage = 0;
+	s.frequency = LocalFrequency;
+	s.plan = nullptr;
+	s.excitationVoltage = 100000;
+	s.range = Frontend::Range::AUTO;
+	s.rangeHint = AD5940_HSRTIA_OPEN;
+	s.averages = 1;
+	s.targetError = 0.0f;
+	s.abortInvalid = true;
+	s.id = LocalId;
+	return s;
+}
+
+// Handles the frontend like LCR::Run does
+static void Local(void*) {
+	TaskHandle_t handle = xTaskGetCurrentTaskHandle();
+	int8_t subscriber = ResultBus::Subscribe(handle);
+	Remote::NotifyOnRelease(handle);
+	Frontend::Start(LocalSettings());
+	bool remoteOwned = false;
+	while (1) {
+		xTaskNotifyWait(0, 0, nullptr, portMAX_DELAY);
+		ResultBus::Record r;
+		if (Remote::OwnsFrontend()) {
+			while (ResultBus::Read(subscriber, r))
+				;
+			remoteOwned = true;
+			continue;
+		}
+		if (remoteOwned) {
+			remoteOwned = false;
+			Frontend::Start(LocalSettings());
+		}
+		while (ResultBus::Read(subscriber, r)) {
+			if (r.result.id == LocalId && r.result.frequency == LocalFrequency) {
+				localResults++;
+			}
+		}
+	}
+}
+
+static void Send(const char *command) {
+	host_usb_write(command, strlen(command));
+	host_usb_write("\n", 1);
+}
+
+static void Discard() {
+	uint8_t buf[256];
+	while (host_usb_read(buf, sizeof(buf)))
+		;
+}
+
+// Reads one line of the response (without the newline), returns false on timeout
+static bool Receive(char *line, size_t size, TickType_t timeout = ResponseTimeout) {
+	size_t len = 0;
+	TickType_t start = xTaskGetTickCount();
+	while (1) {
+		char c;
+		if (host_usb_read(&c, 1)) {
+			if (c == '\n') {
+				line[len] = 0;
+				return true;
+			}
+			if (len < size - 1) {
+				line[len++] = c;
+			}
+			continue;
+		}
+		// let the remote control handle the command before the simulated time advances
+		taskYIELD();
+		if (host_usb_available()) {
+			continue;
+		}
+		if (xTaskGetTickCount() - start >= timeout) {
+			line[len] = 0;
+			return false;
+		}
+		vTaskDelay(1);
+	}
+}
+
+static bool Query(const char *command, char *response, size_t size) {
+	Send(command);
+	bool ok = Receive(response, size);
+	if (!ok) {
+		printf("No response to %s\n", command);
+	}
+	return ok;
+}
+
+static void CheckNoError() {
+	char line[80];
+	Check(Query("SYST:ERR?", line, sizeof(line)) && !strncmp(line, "0,", 2), "no command error");
+	if (strncmp(line, "0,", 2)) {
+		printf("  SYST:ERR? returned %s\n", line);
+	}
+}
+
+static void WaitLocalResults(uint32_t count, const char *what) {
+	uint32_t start = localResults;
+	TickType_t startTick = xTaskGetTickCount();
+	while (localResults - start < count && xTaskGetTickCount() - startTick < ResponseTimeout) {
+		vTaskDelay(10);
+	}
+	Check(localResults - start >= count, what);
+}
+
+static void RoundTrip() {
+	constexpr uint32_t queries = 100;
+	char line[80];
+	uint64_t host = HostMicroseconds();
+	TickType_t sim = xTaskGetTickCount();
+	for (uint32_t i = 0; i < queries; i++) {
+		if (!Query("*IDN?", line, sizeof(line))) {
+			passed = false;
+			return;
+		}
+	}
+	sim = xTaskGetTickCount() - sim;
+	host = HostMicroseconds() - host;
+	printf("*IDN? round trip: %.2f sim ms, %.1f host us\n", (float) sim / queries, (float) host / queries);
+
+	constexpr uint32_t reads = 5;
+	host = HostMicroseconds();
+	sim = xTaskGetTickCount();
+	for (uint32_t i = 0; i < reads; i++) {
+		Check(Query("READ?", line, sizeof(line)) && strtoul(line, nullptr, 10) == 2000,
+				"READ? measures with the remote settings");
+	}
+	sim = xTaskGetTickCount() - sim;
+	host = HostMicroseconds() - host;
+	printf("READ? round trip: %.1f sim ms, %.1f host us (AVER 1)\n", (float) sim / reads, (float) host / reads);
+	CheckNoError();
+}
+
+static void Streaming() {
+	Send("INIT");
+	Send("STRE ON");
+	uint32_t startResults = localResults;
+	uint32_t records = 0, remoteRecords = 0, localRecords = 0, lostRecords = 0;
+	uint32_t lastSequence = 0;
+	uint8_t buf[sizeof(Remote::StreamRecord)];
+	size_t fill = 0;
+	TickType_t start = xTaskGetTickCount();
+	uint64_t host = HostMicroseconds();
+	while (xTaskGetTickCount() - start < StreamDuration) {
+		fill += host_usb_read(&buf[fill], sizeof(buf) - fill);
+		if (fill < sizeof(buf)) {
+			vTaskDelay(1);
+			continue;
+		}
+		Remote::StreamRecord r;
+		memcpy(&r, buf, sizeof(r));
+		if (r.sync != Remote::SyncWord) {
+			// resynchronize
+			memmove(buf, buf + 1, --fill);
+			continue;
+		}
+		fill = 0;
+		if (records && r.sequence != lastSequence + 1) {
+			lostRecords += r.sequence - lastSequence - 1;
+		}
+		lastSequence = r.sequence;
+		records++;
+		// results of the local measurement are streamed until the remote settings have been applied
+		if (r.id == 0) {
+			remoteRecords++;
+		} else if (remoteRecords) {
+			localRecords++;
+		}
+	}
+	host = HostMicroseconds() - host;
+	Send("STRE OFF");
+	char line[80];
+	Check(Query("STRE:STAT?", line, sizeof(line)), "streaming statistics");
+	Send("ABOR");
+	Discard();
+	printf("Streaming: %lu records in %lu sim ms (%lu records/s), %lu lost, %.1f host us per record,"
+			" firmware: %s\n", (unsigned long) records, (unsigned long) StreamDuration,
+			(unsigned long) (records * 1000 / StreamDuration), (unsigned long) lostRecords,
+			records ? (float) host / records : 0.0f, line);
+	Check(records > 0, "records streamed");
+	Check(remoteRecords && !localRecords, "only remote results while streaming");
+	Check(localResults == startResults, "local measurement paused while streaming");
+}
+
+static void Run(void*) {
+	log_init();
+	if (!Frontend::Init() || !Remote::Init()) {
+		printf("Initialization failed\n");
+		passed = false;
+		vTaskEndScheduler();
+	}
+	xTaskCreate(Local, "Local", 512, nullptr, 3, nullptr);
+	WaitLocalResults(3, "local measurement running");
+
+	// settings are only stored while the local measurement owns the frontend
+	Send("FREQ 2000");
+	Send("AVER 1");
+	char line[80];
+	Check(Query("FREQ?", line, sizeof(line)) && !strcmp(line, "2000"), "FREQ stored");
+	WaitLocalResults(3, "settings do not stop the local measurement");
+
+	RoundTrip();
+	WaitLocalResults(3, "local measurement resumes after READ?");
+
+	Streaming();
+	WaitLocalResults(3, "local measurement resumes after ABOR");
+	CheckNoError();
+
+	printf("%s\n", passed ? "PASSED" : "FAILED");
+	vTaskEndScheduler();
+}
+
+int main() {
+	// 100 Ohm in series with 1uF
+	ad5940_sim_set_dut_model([](void*, float f) -> ad5940_sim_impedance_t {
+		return {100.0f, -1.0f / (2 * 3.14159265f * f * 1e-6f)};
+	}, nullptr);
+	xTaskCreate(Run, "Host", 1024, nullptr, 1, nullptr);
+	vTaskStartScheduler();
+	return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
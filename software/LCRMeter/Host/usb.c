@@ -0,0 +1,72 @@
+/*
+ * USB CDC interface for host builds
+ *
+ * Replaces usbd_cdc_if.c: transmitted data is kept in a buffer for the test. A transfer completes with
+ * the next tick, about the latency of the full speed bulk endpoint polled by the USB host.
+ */
+#include "host_usb.h"
+#include "usbd_cdc_if.h"
+#include "Remote.h"
+#include "FreeRTOS.h"
+#include "task.h"
+
+#include <string.h>
+
+#define TX_BUFFER_SIZE			1000
+#define HOST_BUFFER_SIZE		(256 * 1024)
+
+static uint8_t txBuffer[TX_BUFFER_SIZE];
+static TickType_t txDone;
+static uint8_t txBusy;
+
+// ring buffer of the data received by the host
+static uint8_t hostBuffer[HOST_BUFFER_SIZE];
+static size_t hostWrite, hostRead;
+
+uint8_t CDC_Transmit_FS(uint8_t *Buf, uint16_t Len) {
+	if (CDC_TxBusy_FS()) {
+		return USBD_BUSY;
+	}
+	for (uint16_t i = 0; i < Len; i++) {
+		size_t next = (hostWrite + 1) % HOST_BUFFER_SIZE;
+		if (next == hostRead) {
+			// the test does not read, like a host that does not poll the endpoint
+			return USBD_BUSY;
+		}
+		hostBuffer[hostWrite] = Buf[i];
+		hostWrite = next;
+	}
+	txBusy = 1;
+	txDone = xTaskGetTickCount() + 1;
+	return USBD_OK;
+}
+
+uint8_t CDC_TxBusy_FS(void) {
+	if (txBusy && (TickType_t) (xTaskGetTickCount() - txDone) < portMAX_DELAY / 2) {
+		txBusy = 0;
+	}
+	return txBusy;
+}
+
+uint8_t *CDC_TxBuffer_FS(uint16_t *size) {
+	*size = TX_BUFFER_SIZE;
+	return txBuffer;
+}
+
+void host_usb_write(const void *data, size_t len) {
+	Remote_Received(data, len);
+}
+
+size_t host_usb_read(void *data, size_t len) {
+	size_t n = 0;
+	uint8_t *p = data;
+	while (n < len && hostRead != hostWrite) {
+		p[n++] = hostBuffer[hostRead];
+		hostRead = (hostRead + 1) % HOST_BUFFER_SIZE;
+	}
+	return n;
+}
+
+size_t host_usb_available(void) {
+	return (hostWrite + HOST_BUFFER_SIZE - hostRead) % HOST_BUFFER_SIZE;
+}
@@ -106,6 +106,8 @@ extern USBD_CDC_ItfTypeDef USBD_Interface_fops_FS;
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
+uint8_t CDC_TxBusy_FS(void);
+uint8_t* CDC_TxBuffer_FS(uint16_t *size);
 
 /* USER CODE END EXPORTED_FUNCTIONS */
 
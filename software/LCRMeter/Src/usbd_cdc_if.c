@@ -23,7 +23,7 @@
 #include "usbd_cdc_if.h"
 
 /* USER CODE BEGIN INCLUDE */
-
+#include "Remote.h"
 /* USER CODE END INCLUDE */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -263,6 +263,7 @@ static int8_t CDC_Control_FS(uint8_t cmd, uint8_t* pbuf, uint16_t length)
 static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
+  Remote_Received(Buf, *Len);
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
   USBD_CDC_ReceivePacket(&hUsbDeviceFS);
   return (USBD_OK);
@@ -295,7 +296,33 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
+/**
+  * @brief  CDC_TxBusy_FS
+  *         Checks whether a transmission is still in progress (or the device
+  *         is not configured yet)
+  * @retval 1 if CDC_Transmit_FS would return USBD_BUSY, 0 otherwise
+  */
+uint8_t CDC_TxBusy_FS(void)
+{
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  if (hcdc == NULL){
+    return 1;
+  }
+  return hcdc->TxState != 0;
+}
 
+/**
+  * @brief  CDC_TxBuffer_FS
+  *         Application transmit buffer, may be used to prepare data for
+  *         CDC_Transmit_FS without copying
+  * @param  size: Size of the buffer (in bytes)
+  * @retval Pointer to the buffer
+  */
+uint8_t* CDC_TxBuffer_FS(uint16_t *size)
+{
+  *size = APP_TX_DATA_SIZE;
+  return UserTxBufferFS;
+}
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
 /**
@@ -36,6 +36,7 @@
 /* Includes ------------------------------------------------------------------*/
 #include <string.h>
 #include "ff_gen_drv.h"
+#include "SD/sd.h"
 
 /* Private typedef -----------------------------------------------------------*/
 /* Private define ------------------------------------------------------------*/
@@ -82,7 +83,7 @@ DSTATUS USER_initialize (
 )
 {
   /* USER CODE BEGIN INIT */
-    Stat = STA_NOINIT;
+    Stat = sd_init() == SD_RES_OK ? 0 : STA_NOINIT;
     return Stat;
   /* USER CODE END INIT */
 }
@@ -97,7 +98,6 @@ DSTATUS USER_status (
 )
 {
   /* USER CODE BEGIN STATUS */
-    Stat = STA_NOINIT;
     return Stat;
   /* USER CODE END STATUS */
 }
@@ -118,7 +118,10 @@ DRESULT USER_read (
 )
 {
   /* USER CODE BEGIN READ */
-    return RES_OK;
+    if (Stat & STA_NOINIT) {
+      return RES_NOTRDY;
+    }
+    return sd_read(buff, sector, count) == SD_RES_OK ? RES_OK : RES_ERROR;
   /* USER CODE END READ */
 }
 
@@ -139,8 +142,10 @@ DRESULT USER_write (
 )
 { 
   /* USER CODE BEGIN WRITE */
-  /* USER CODE HERE */
-    return RES_OK;
+    if (Stat & STA_NOINIT) {
+      return RES_NOTRDY;
+    }
+    return sd_write(buff, sector, count) == SD_RES_OK ? RES_OK : RES_ERROR;
   /* USER CODE END WRITE */
 }
 #endif /* _USE_WRITE == 1 */
@@ -161,6 +166,31 @@ DRESULT USER_ioctl (
 {
   /* USER CODE BEGIN IOCTL */
     DRESULT res = RES_ERROR;
+    if (Stat & STA_NOINIT) {
+      return RES_NOTRDY;
+    }
+    switch (cmd) {
+    case CTRL_SYNC:
+      /* complete pending writes */
+      res = sd_sync() == SD_RES_OK ? RES_OK : RES_ERROR;
+      break;
+    case GET_SECTOR_COUNT:
+      *(DWORD*) buff = sd_sector_count();
+      res = RES_OK;
+      break;
+    case GET_SECTOR_SIZE:
+      *(WORD*) buff = SD_SECTOR_SIZE;
+      res = RES_OK;
+      break;
+    case GET_BLOCK_SIZE:
+      /* erase block size unknown */
+      *(DWORD*) buff = 1;
+      res = RES_OK;
+      break;
+    default:
+      res = RES_PARERR;
+      break;
+    }
     return res;
   /* USER CODE END IOCTL */
 }
@@ -0,0 +1,157 @@
+#!/usr/bin/env python3
+"""
+Decodes the deferred log output of the LCR meter (LOG_DEFERRED in Drivers/Board/log.h).
+
+The firmware sends the address of the format string and the raw arguments instead of the formatted
+text. The strings are read from the ELF file, it has to match the firmware running on the device.
+Text that is not part of a frame (e.g. the hard fault output of log_force) is passed through.
+
+Usage: logdecode.py <firmware.elf> [capture]
+The capture file (default: stdin) contains the raw data of the log UART (115200 baud), e.g.
+  stty -F /dev/ttyUSB0 115200 raw && logdecode.py Debug/LCRMeter.elf < /dev/ttyUSB0
+"""
+
+import re
+import struct
+import sys
+
+FRAME_SYNC = 0xFE
+STRING_IN_ROM = 0xFF
+LEVELS = ["DBG", "INF", "WRN", "ERR", "CRT"]
+# conversion specifier: flags, width, precision, length modifier, conversion
+SPECIFIER = re.compile(r"%([-+ #0]*)(\*|\d+)?(?:\.(\*|\d+))?([hlLjzt]*)([a-zA-Z%])")
+
+
+class Elf:
+    """Memory image of the allocated sections of a 32 bit little endian ELF file"""
+
+    def __init__(self, filename):
+        with open(filename, "rb") as f:
+            data = f.read()
+        if data[:4] != b"\x7fELF" or data[4] != 1 or data[5] != 1:
+            raise ValueError("not a 32 bit little endian ELF file")
+        shoff, = struct.unpack_from("<I", data, 0x20)
+        shentsize, shnum = struct.unpack_from("<HH", data, 0x2E)
+        self.sections = []
+        for i in range(shnum):
+            _, sh_type, flags, addr, offset, size = struct.unpack_from("<IIIIII", data,
+                                                                       shoff + i * shentsize)
+            # allocated sections with content (no .bss)
+            if flags & 0x2 and sh_type != 8 and size:
+                self.sections.append((addr, data[offset:offset + size]))
+
+    def string(self, address):
+        for start, content in self.sections:
+            if start <= address < start + len(content):
+                end = content.find(b"\0", address - start)
+                if end < 0:
+                    end = len(content)
+                return content[address - start:end].decode("latin-1")
+        return "<unknown string 0x%08x>" % address
+
+
+class Frame:
+    def __init__(self, payload):
+        self.payload = payload
+        self.pos = 0
+
+    def take(self, fmt):
+        values = struct.unpack_from(fmt, self.payload, self.pos)
+        self.pos += struct.calcsize(fmt)
+        return values[0]
+
+
+def format_message(elf, fmt, frame):
+    out = []
+    last = 0
+    truncated = False
+    for m in SPECIFIER.finditer(fmt):
+        out.append(fmt[last:m.start()])
+        last = m.end()
+        flags, width, precision, length, conv = m.groups()
+        if conv == "%":
+            out.append("%")
+            continue
+        try:
+            if width == "*":
+                width = str(frame.take("<i"))
+            if precision == "*":
+                precision = str(frame.take("<i"))
+            longlong = length.count("l") >= 2 or "j" in length
+            if conv in "di":
+                value = frame.take("<q" if longlong else "<i")
+            elif conv in "ouxX":
+                value = frame.take("<Q" if longlong else "<I")
+            elif conv == "c":
+                value = chr(frame.take("<i") & 0xFF)
+            elif conv == "p":
+                conv, flags, value = "x", "#", frame.take("<I")
+            elif conv in "fFeEgGaA":
+                value = frame.take("<d")
+                if conv in "aA":
+                    conv = "e"
+            elif conv == "s":
+                n = frame.take("<B")
+                if n == STRING_IN_ROM:
+                    value = elf.string(frame.take("<I"))
+                else:
+                    value = frame.payload[frame.pos:frame.pos + n].decode("latin-1")
+                    frame.pos += n
+            else:
+                out.append(m.group(0))
+                continue
+        except struct.error:
+            truncated = True
+            break
+        spec = "%" + flags + (width or "") + ("." + precision if precision is not None else "") + conv
+        out.append(spec % value)
+    if truncated:
+        out.append("<truncated>")
+    else:
+        out.append(fmt[last:])
+    return "".join(out)
+
+
+def decode(elf, payload):
+    frame = Frame(payload)
+    try:
+        level = frame.take("<B")
+        timestamp = frame.take("<I")
+        fmt = elf.string(frame.take("<I"))
+        module = elf.string(frame.take("<I"))
+    except struct.error:
+        return "<invalid frame>"
+    level = LEVELS[level] if level < len(LEVELS) else "???"
+    return "%05u [%6.6s,%s]: %s" % (timestamp, module[4:], level, format_message(elf, fmt, frame))
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit(__doc__)
+    elf = Elf(sys.argv[1])
+    source = open(sys.argv[2], "rb") if len(sys.argv) > 2 else sys.stdin.buffer
+    text = bytearray()
+    while True:
+        b = source.read(1)
+        if not b:
+            break
+        if b[0] != FRAME_SYNC:
+            # plain text output
+            text += b
+            if b == b"\n":
+                sys.stdout.write(text.decode("latin-1"))
+                sys.stdout.flush()
+                text.clear()
+            continue
+        if text:
+            sys.stdout.write(text.decode("latin-1") + "\n")
+            text.clear()
+        length = source.read(1)
+        if not length:
+            break
+        payload = source.read(length[0])
+        print(decode(elf, payload), flush=True)
+
+
+if __name__ == "__main__":
+    main()